@@ -10,7 +10,7 @@
 
 #include <QApplication>
 #include <QMenu>
-#include <QSocketNotifier>
+#include <QWindow>
 #include <QtMath>
 
 #include "capture.h"
@@ -177,15 +177,56 @@ CaptureWin::CaptureWin(QScrollArea *sa, QWidget *parent) :
 	QOpenGLWidget(parent),
 	m_fd(0),
 	m_v4l_queue(0),
+	m_timingsInterval(1000),
+	m_timerQueryHead(0),
+	m_timerQueryPending(0),
+	m_reportLatency(false),
+	m_latencyHead(0),
+	m_latencyCount(0),
+	m_updateColors(false),
 	m_origPixelFormat(0),
+	m_vertexArray(0),
+	m_vertexBuffer(0),
+	m_uvBuffer(0),
 	m_screenTextureCount(0),
+	m_texPixelFormat(0),
+	m_texWidth(0),
+	m_texHeight(0),
+	m_texSrgb(false),
 	m_program(0),
 	m_curIndex(-1),
-	m_nextIndex(-1),
+	m_frameSource(0),
+	m_maxBuffers(0),
+	m_arena(0),
+	m_recorder(0),
+	m_cpuConvert(false),
+	m_curConverted(false),
+	m_uploadMode(UploadDirect),
+	m_uploadSlot(0),
+	m_uploadSlotSize(0),
+	m_uploadBound(false),
+	m_eglDisplay(0),
+	m_dmabufTexCount(0),
+	m_dmabufFence(0),
+	m_governorWindow(0),
+	m_unfocusedFps(0),
+	m_exposed(true),
+	m_scaleMode(ScaleAuto),
+	m_convertFbo(0),
+	m_convertFboTex(0),
+	m_convertFboWidth(0),
+	m_convertFboHeight(0),
 	m_scrollArea(sa)
 {
 	m_curSize[0] = 0;
 	m_curData[0] = 0;
+	for (unsigned i = 0; i < UPLOAD_RING_SIZE; i++) {
+		m_uploadBuf[i] = 0;
+		m_uploadFence[i] = 0;
+		m_uploadMap[i] = 0;
+	}
+	memset(m_dmabufImage, 0, sizeof(m_dmabufImage));
+	memset(m_dmabufTex, 0, sizeof(m_dmabufTex));
 
 	m_enterFullScreen = new QAction("Enter fullscreen (F)", this);
 	connect(m_enterFullScreen, SIGNAL(triggered(bool)),
@@ -196,6 +237,12 @@ CaptureWin::CaptureWin(QScrollArea *sa, QWidget *parent) :
 		this, SLOT(toggleFullScreen(bool)));
 }
 
+CaptureWin::~CaptureWin()
+{
+	stopCapture();
+	cleanupGL();
+}
+
 void CaptureWin::resizeEvent(QResizeEvent *event)
 {
 	QSize origSize = QSize(m_origWidth, m_origHeight);
@@ -229,6 +276,17 @@ void CaptureWin::updateShader()
 	m_updateShader = true;
 }
 
+/*
+ * For changes that only affect the colorimetry. These are applied as
+ * uniforms of the current program, no new shader is needed.
+ */
+void CaptureWin::updateColors()
+{
+	setV4LFormat(m_v4l_fmt);
+	m_updateColors = true;
+	update();
+}
+
 void CaptureWin::showCurrentOverrides()
 {
 	static bool firstTime = true;
@@ -267,7 +325,7 @@ void CaptureWin::syncPrefsColor()
 	m_overrideQuantization = m_prefs->quantization;
 	m_overrideXferFunc = m_prefs->xfer_func;
 	m_overrideYCbCrEnc = m_prefs->ycbcr_enc;
-	updateShader();
+	updateColors();
 }
 
 void CaptureWin::restoreSize(bool)
@@ -327,7 +385,6 @@ bool CaptureWin::supportedFmt(__u32 fmt)
 {
 	switch (fmt) {
 	case V4L2_PIX_FMT_RGB565X:
-	case V4L2_PIX_FMT_Y16_BE:
 		return m_haveSwapBytes;
 
 	/*
@@ -379,17 +436,11 @@ void CaptureWin::configureTexture(size_t idx)
 void CaptureWin::setModeV4L2(cv4l_fd *fd)
 {
 	m_fd = fd;
-	QSocketNotifier *readSock = new QSocketNotifier(fd->g_fd(),
-		QSocketNotifier::Read, this);
-	QSocketNotifier *excepSock = new QSocketNotifier(fd->g_fd(),
-		QSocketNotifier::Exception, this);
 
 	v4l2_event_subscription sub = { };
 
 	sub.type = V4L2_EVENT_SOURCE_CHANGE;
 	m_fd->subscribe_event(sub);
-	connect(readSock, SIGNAL(activated(int)), this, SLOT(v4l2ReadEvent()));
-	connect(excepSock, SIGNAL(activated(int)), this, SLOT(v4l2ExceptionEvent()));
 
 	if (m_verbose && m_fd->g_direct())
 		printf("using libv4l2\n");
@@ -400,6 +451,130 @@ void CaptureWin::setQueue(cv4l_queue *q)
 	m_v4l_queue = q;
 	if (m_origPixelFormat == 0)
 		updateOrigValues();
+
+	if (m_uploadMode == UploadDmabuf && q->export_bufs(m_fd, m_fd->g_type())) {
+		fprintf(stderr, "Could not export buffers, falling back to direct upload\n");
+		m_uploadMode = UploadDirect;
+	}
+
+	RagnaCaptureThread *thread = new RagnaCaptureThread(m_fd, q);
+
+	thread->setArena(m_arena);
+	if (m_recorder) {
+		m_recorder->setFormat(m_v4l_fmt);
+		thread->setRecorder(m_recorder);
+	}
+	if (m_maxBuffers > q->g_buffers()) {
+		if (q->has_create_bufs(m_fd))
+			thread->setMaxBuffers(qMin(m_maxBuffers, (unsigned)VIDEO_MAX_FRAME));
+		else
+			fprintf(stderr, "The device can't add buffers while streaming, ignoring --max-buffers\n");
+	}
+	setSource(thread);
+}
+
+// Takes ownership, the source is deleted by stopCapture().
+void CaptureWin::setSource(RagnaFrameSource *source)
+{
+	if (m_origPixelFormat == 0)
+		updateOrigValues();
+
+	if (m_v4l_queue == NULL && m_uploadMode == UploadDmabuf) {
+		fprintf(stderr, "Only capture buffers can be imported, falling back to direct upload\n");
+		m_uploadMode = UploadDirect;
+	}
+
+	m_frameSource = source;
+	connect(m_frameSource, SIGNAL(frameReady()), this, SLOT(update()));
+	connect(m_frameSource, SIGNAL(sourceChanged()),
+		this, SLOT(v4l2SourceChangeEvent()));
+	watchWindow();
+	updateGovernor();
+}
+
+void CaptureWin::startCapture()
+{
+	if (m_frameSource)
+		m_frameSource->start(QThread::TimeCriticalPriority);
+}
+
+void CaptureWin::stopCapture()
+{
+	if (m_frameSource == NULL)
+		return;
+
+	m_frameSource->stop();
+	reportSkipped();
+	delete m_frameSource;
+	m_frameSource = NULL;
+}
+
+/*
+ * Follow the top level window so the governor knows when frames can't be
+ * seen. Expose events have no signal, so those come through a filter.
+ */
+void CaptureWin::watchWindow()
+{
+	QWindow *w = window()->windowHandle();
+
+	if (w == NULL || w == m_governorWindow)
+		return;
+
+	if (m_governorWindow)
+		m_governorWindow->removeEventFilter(this);
+	m_governorWindow = w;
+	w->installEventFilter(this);
+	connect(w, SIGNAL(activeChanged()), this, SLOT(updateGovernor()));
+	connect(w, SIGNAL(windowStateChanged(Qt::WindowState)),
+		this, SLOT(updateGovernor()));
+	connect(w, SIGNAL(visibleChanged(bool)), this, SLOT(updateGovernor()));
+	updateGovernor();
+}
+
+bool CaptureWin::eventFilter(QObject *watched, QEvent *event)
+{
+	if (watched == m_governorWindow && event->type() == QEvent::Expose)
+		QMetaObject::invokeMethod(this, "updateGovernor", Qt::QueuedConnection);
+	return QOpenGLWidget::eventFilter(watched, event);
+}
+
+/*
+ * Hidden, minimized or occluded windows (as far as the window system
+ * tells us) get no frames at all, and unfocused ones only get
+ * --unfocused-fps. The capture thread keeps cycling buffers either way.
+ */
+void CaptureWin::updateGovernor()
+{
+	QWindow *w = m_governorWindow;
+	bool exposed = w && w->isExposed() &&
+		       !(w->windowStates() & Qt::WindowMinimized);
+	uint64_t interval = 0;
+
+	if (m_unfocusedFps && !(w && w->isActive()))
+		interval = 1000000000ull / m_unfocusedFps;
+
+	if (m_frameSource)
+		m_frameSource->setDelivery(exposed, interval);
+
+	if (exposed && !m_exposed)
+		reportSkipped();
+	m_exposed = exposed;
+}
+
+void CaptureWin::reportSkipped()
+{
+	uint64_t hidden = 0;
+	uint64_t throttled = 0;
+
+	if (m_frameSource)
+		m_frameSource->takeSkipped(hidden, throttled);
+
+	if (hidden)
+		printf("Skipped %llu frames while the window was hidden\n",
+		       (unsigned long long)hidden);
+	if (throttled)
+		printf("Skipped %llu frames to stay at %u fps while unfocused\n",
+		       (unsigned long long)throttled, m_unfocusedFps);
 }
 
 bool CaptureWin::updateV4LFormat(const cv4l_fmt &fmt)
@@ -608,49 +783,26 @@ bool CaptureWin::setV4LFormat(cv4l_fmt &fmt)
 			printf("Plane %d Bytes per Line: %u\n", i, m_v4l_fmt.g_bytesperline(i));
 		}
 	}
+	if (m_recorder)
+		m_recorder->setFormat(m_v4l_fmt);
 	return true;
 }
 
-void CaptureWin::v4l2ReadEvent()
-{
-	cv4l_buffer buf(m_fd->g_type());
-
-	if (m_fd->dqbuf(buf))
-		return;
-
-	for (unsigned i = 0; i < m_v4l_queue->g_num_planes(); i++) {
-		m_nextData[i] = (__u8 *)m_v4l_queue->g_dataptr(buf.g_index(), i);
-		m_nextSize[i] = buf.g_bytesused(i);
-	}
-	int next = m_nextIndex;
-	m_nextIndex = buf.g_index();
-	if (next != -1) {
-		buf.s_index(next);
-		m_fd->qbuf(buf);
-	}
-	update();
-}
-
-void CaptureWin::v4l2ExceptionEvent()
+void CaptureWin::v4l2SourceChangeEvent()
 {
-	v4l2_event ev;
 	cv4l_fmt fmt;
 
-	while (m_fd->dqevent(ev) == 0) {
-		if (ev.type == V4L2_EVENT_SOURCE_CHANGE) {
-			m_fd->g_fmt(fmt);
-			if (!setV4LFormat(fmt)) {
-				fprintf(stderr, "Unsupported format: '%s' %s\n",
-					fcc2s(fmt.g_pixelformat()).c_str(),
-					pixfmt2s(fmt.g_pixelformat()).c_str());
-				std::exit(EXIT_FAILURE);
-			}
-			updateOrigValues();
-			showCurrentOverrides();
-
-			m_updateShader = true;
-		}
+	m_frameSource->format(fmt);
+	if (!setV4LFormat(fmt)) {
+		fprintf(stderr, "Unsupported format: '%s' %s\n",
+			fcc2s(fmt.g_pixelformat()).c_str(),
+			pixfmt2s(fmt.g_pixelformat()).c_str());
+		std::exit(EXIT_FAILURE);
 	}
+	updateOrigValues();
+	showCurrentOverrides();
+
+	m_updateShader = true;
 }
 
 void CaptureWin::updateOrigValues()
@@ -9,6 +9,8 @@
 #define GL_GLEXT_PROTOTYPES 1
 #define QT_NO_OPENGL_ES_2
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QKeyEvent>
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
@@ -17,6 +19,9 @@
 #include <libv4l2.h>
 
 #include "cv4l-helpers.h"
+#include "ragnacapturethread.h"
+#include "ragnahistogram.h"
+#include "ragnalatency.h"
 
 extern const __u32 formats[];
 extern const __u32 colorspaces[];
@@ -26,22 +31,63 @@ extern const __u32 hsv_encs[];
 extern const __u32 quantizations[];
 
 class QOpenGLPaintDevice;
+class QWindow;
+class RagnaArena;
 class RagnaPrefs;
 
 // This must be equal to the max number of textures that any shader uses
 #define MAX_TEXTURES_NEEDED 3
 
+// Number of timer queries that can be in flight when reporting timings
+#define TIMER_QUERY_RING 8
+
+// Number of frames whose latency can be waiting on the GPU or the swap
+#define LATENCY_RING 8
+
+// Number of pixel unpack buffers cycled through by the PBO upload path
+#define UPLOAD_RING_SIZE 3
+
+enum UploadMode {
+	UploadDirect,
+	UploadPBO,
+	UploadDmabuf,
+};
+
+enum ScaleMode {
+	// Convert every output pixel in the shader
+	ScaleShader,
+	// Convert at the source size into an FBO, then blit that to the view
+	ScaleBlit,
+	// ScaleBlit when the view is larger than the source, else ScaleShader
+	ScaleAuto,
+};
+
 class CaptureWin : public QOpenGLWidget, protected QOpenGLFunctions
 {
 	Q_OBJECT
+	// Drives the upload and draw steps directly with generated frames
+	friend class RagnaBench;
+
 public:
 	explicit CaptureWin(QScrollArea *sa, QWidget *parent = 0);
+	~CaptureWin();
 
 	void setModeV4L2(cv4l_fd *fd);
 	void setQueue(cv4l_queue *q);
+	void setSource(RagnaFrameSource *source);
 	bool setV4LFormat(cv4l_fmt &fmt);
+	void startCapture();
+	void stopCapture();
 	void setReportTimings(bool report) { m_reportTimings = report; }
+	void setTimingsInterval(unsigned ms) { m_timingsInterval = ms; }
+	void setReportLatency(bool report) { m_reportLatency = report; }
 	void setVerbose(bool verbose) { m_verbose = verbose; }
+	void setUploadMode(UploadMode mode) { m_uploadMode = mode; }
+	void setScaleMode(ScaleMode mode) { m_scaleMode = mode; }
+	void setUnfocusedFps(unsigned fps) { m_unfocusedFps = fps; }
+	void setMaxBuffers(unsigned max) { m_maxBuffers = max; }
+	void setArena(RagnaArena *arena) { m_arena = arena; }
+	void setRecorder(RagnaFrameSink *recorder) { m_recorder = recorder; }
 	void loadFromPrefs(RagnaPrefs *);
 	void saveToPrefs(RagnaPrefs *);
 	void syncPrefsColor();
@@ -50,8 +96,10 @@ signals:
 	void showConfigWindow();
 
 private slots:
-	void v4l2ReadEvent();
-	void v4l2ExceptionEvent();
+	void v4l2SourceChangeEvent();
+	void cleanupGL();
+	void latencySwapped();
+	void updateGovernor();
 
 	void restoreAll(bool checked);
 	void restoreSize(bool checked = false);
@@ -59,21 +107,57 @@ private slots:
 
 private:
 	bool updateV4LFormat(const cv4l_fmt &fmt);
+	bool eventFilter(QObject *watched, QEvent *event);
+	void watchWindow();
+	void reportSkipped();
 	void resizeEvent(QResizeEvent *event);
 	void focusInEvent(QFocusEvent *event);
 	void focusOutEvent(QFocusEvent *event);
 	void paintGL();
+	bool isShortFrame(const RagnaFrame &frame);
+	bool acquireFrame();
+	bool prepareFrame();
+	void uploadFrame();
+	void drawFrame();
+	bool useConvertFbo();
+	bool initConvertFbo(unsigned width, unsigned height);
+	void freeConvertFbo();
 	void initializeGL();
 	void contextMenuEvent(QContextMenuEvent *event);
 	void keyPressEvent(QKeyEvent *event);
 	void showCurrentOverrides();
 
 	bool supportedFmt(__u32 fmt);
+	bool selectConversion();
 	void checkError(const char *msg);
 	void configureTexture(size_t idx);
 	void updateOrigValues();
 	void updateShader();
+	void updateColors();
+	void updateColorUniforms();
 	void changeShader();
+	QOpenGLShaderProgram *buildProgram(QString code);
+	QString programCachePath(const QString &fragment, const QString &vertex);
+	bool loadProgramBinary(QOpenGLShaderProgram *program, const QString &path);
+	void saveProgramBinary(QOpenGLShaderProgram *program, const QString &path);
+
+	// Texture upload
+	void uploadBegin();
+	void uploadEnd();
+	void initUploadRing(unsigned size);
+	void freeUploadRing();
+	void renderFrame(__u32 format);
+	bool beginRenderTiming();
+	void submitLatency();
+	void harvestLatency();
+
+	// Zero-copy import of exported capture buffers
+	bool initDmabuf();
+	bool importDmabufFrame();
+	bool createDmabufImages(int index);
+	void freeDmabufImages();
+	void fenceDmabufFrame();
+	void waitDmabufFrame();
 
 	// Colorspace conversion shaders
 	void shader_YUV();
@@ -84,6 +168,7 @@ private:
 	void shader_Bayer();
 	void shader_YUV_packed();
 	void shader_YUY2();
+	void shader_Converted();
 
 	// Colorspace conversion render
 	void render_RGB(__u32 format);
@@ -94,12 +179,26 @@ private:
 	void render_NV12(__u32 format);
 	void render_NV16(__u32 format);
 	void render_NV24(__u32 format);
+	void render_Converted();
 
 	cv4l_fd *m_fd;
 	cv4l_fmt m_v4l_fmt;
 	cv4l_queue *m_v4l_queue;
 	bool m_verbose;
 	bool m_reportTimings;
+	unsigned m_timingsInterval;
+	GLuint m_timerQuery[TIMER_QUERY_RING];
+	unsigned m_timerQueryHead;
+	unsigned m_timerQueryPending;
+	RagnaHistogram m_renderTimes;
+	QElapsedTimer m_timingsClock;
+	bool m_reportLatency;
+	RagnaLatency m_latency;
+	RagnaLatencyRecord m_latencyCur;
+	RagnaLatencyRecord m_latencyRecord[LATENCY_RING];
+	GLsync m_latencyFence[LATENCY_RING];
+	unsigned m_latencyHead;
+	unsigned m_latencyCount;
 	bool m_is_rgb;
 	bool m_is_hsv;
 	bool m_is_bayer;
@@ -107,6 +206,7 @@ private:
 	bool m_accepts_srgb;
 	bool m_haveSwapBytes;
 	bool m_updateShader;
+	bool m_updateColors;
 	QSize m_viewSize;
 
 	__u32 m_overrideColorspace;
@@ -124,15 +224,57 @@ private:
 	__u32 m_origXferFunc;
 	__u32 m_origQuantization;
 
+	GLuint m_vertexArray;
+	GLuint m_vertexBuffer;
+	GLuint m_uvBuffer;
 	int m_screenTextureCount;
+	__u32 m_texPixelFormat;
+	__u32 m_texWidth;
+	__u32 m_texHeight;
+	bool m_texSrgb;
 	GLuint m_screenTexture[MAX_TEXTURES_NEEDED];
 	QOpenGLShaderProgram *m_program;
+	// Linked programs keyed on the defines that select the variant
+	QHash<QString, QOpenGLShaderProgram *> m_programCache;
 	__u8 *m_curData[MAX_TEXTURES_NEEDED];
 	unsigned m_curSize[MAX_TEXTURES_NEEDED];
-	__u8 *m_nextData[MAX_TEXTURES_NEEDED];
-	unsigned m_nextSize[MAX_TEXTURES_NEEDED];
 	int m_curIndex;
-	int m_nextIndex;
+	RagnaFrameSource *m_frameSource;
+	unsigned m_maxBuffers;
+	RagnaArena *m_arena;
+	RagnaFrameSink *m_recorder;
+	// Formats this context can't sample are unpacked by the capture thread
+	RagnaConvert m_convert;
+	bool m_cpuConvert;
+	bool m_curConverted;
+
+	UploadMode m_uploadMode;
+	// What render_* hands to glTexSubImage2D: either m_curData or offsets
+	// into the bound pixel unpack buffer.
+	__u8 *m_texData[MAX_TEXTURES_NEEDED];
+	GLuint m_uploadBuf[UPLOAD_RING_SIZE];
+	GLsync m_uploadFence[UPLOAD_RING_SIZE];
+	__u8 *m_uploadMap[UPLOAD_RING_SIZE];
+	unsigned m_uploadSlot;
+	unsigned m_uploadSlotSize;
+	bool m_uploadBound;
+	void *m_eglDisplay;
+	unsigned m_dmabufTexCount;
+	void *m_dmabufImage[VIDEO_MAX_FRAME][MAX_TEXTURES_NEEDED];
+	GLuint m_dmabufTex[VIDEO_MAX_FRAME][MAX_TEXTURES_NEEDED];
+	// Signals once the GPU is done sampling the current capture buffer.
+	GLsync m_dmabufFence;
+
+	// Render rate governor, see updateGovernor
+	QWindow *m_governorWindow;
+	unsigned m_unfocusedFps;
+	bool m_exposed;
+
+	ScaleMode m_scaleMode;
+	GLuint m_convertFbo;
+	GLuint m_convertFboTex;
+	unsigned m_convertFboWidth;
+	unsigned m_convertFboHeight;
 
 	QScrollArea *m_scrollArea;
 	QAction *m_resolutionOverride;
@@ -0,0 +1,163 @@
+#include <QVector3D>
+
+#include "capture.h"
+
+// Matrices are listed column by column, the same order as the mat3
+// constructor in v4l2-convert.glsl used to take them.
+
+// YUV (aka Y'CbCr) to R'G'B' matrices
+
+// Old obsolete HDTV standard. Replaced by REC 709.
+// SMPTE 240M has its own luma coefficients
+static const GLfloat yuv2rgb_smpte240m[3][3] = {
+	{ 1.0,     1.0,     1.0 },
+	{ 0.0,    -0.2253,  1.8270 },
+	{ 1.5756, -0.4768,  0.0 },
+};
+
+// BT.2020 luma coefficients
+static const GLfloat yuv2rgb_bt2020[3][3] = {
+	{ 1.0,     1.0,     1.0 },
+	{ 0.0,    -0.1646,  1.8814 },
+	{ 1.4719, -0.5703,  0.0 },
+};
+
+// These colorspaces all use the BT.601 luma coefficients
+static const GLfloat yuv2rgb_601[3][3] = {
+	{ 1.0,    1.0,    1.0 },
+	{ 0.0,   -0.344,  1.773 },
+	{ 1.403, -0.714,  0.0 },
+};
+
+// The HDTV colorspaces all use REC 709 luma coefficients
+static const GLfloat yuv2rgb_709[3][3] = {
+	{ 1.0,     1.0,     1.0 },
+	{ 0.0,    -0.1870,  1.8556 },
+	{ 1.5701, -0.4664,  0.0 },
+};
+
+// Various colorspace conversion matrices that transfer the source chromaticities
+// to the sRGB/Rec.709 chromaticities
+
+// Current SDTV standard, although slowly being replaced by REC 709.
+// Uses the SMPTE 170M aka SMPTE-C aka SMPTE RP 145 conversion matrix.
+static const GLfloat colconv_smpte170m[3][3] = {
+	{ 0.939536,  0.017743, -0.001591 },
+	{ 0.050215,  0.965758, -0.004356 },
+	{ 0.001789,  0.016243,  1.005951 },
+};
+
+// Old obsolete NTSC standard. Replaced by REC 709.
+// Uses the NTSC 1953 conversion matrix and the Bradford method to
+// compensate for the different whitepoints.
+static const GLfloat colconv_470_system_m[3][3] = {
+	{  1.4858417, -0.0251179, -0.0272254 },
+	{ -0.4033361,  0.9541568, -0.0440815 },
+	{ -0.0825056,  0.0709611,  1.0713068 },
+};
+
+// Old obsolete PAL/SECAM standard. Replaced by REC 709.
+// Uses the EBU Tech. 3213 conversion matrix.
+static const GLfloat colconv_470_system_bg[3][3] = {
+	{  1.0440, 0,  0 },
+	{ -0.0440, 1, -0.0119 },
+	{  0,      0,  1.0119 },
+};
+
+static const GLfloat colconv_oprgb[3][3] = {
+	{  1.3982832, 0,  0 },
+	{ -0.3982831, 1, -0.0429383 },
+	{  0,         0,  1.0429383 },
+};
+
+// Uses the Bradford method to compensate for the different whitepoints.
+static const GLfloat colconv_dci_p3[3][3] = {
+	{  1.1574000, -0.0415052, -0.0180562 },
+	{ -0.1548597,  1.0455684, -0.0785993 },
+	{ -0.0025403, -0.0040633,  1.0966555 },
+};
+
+static const GLfloat colconv_bt2020[3][3] = {
+	{  1.6603627, -0.1245635, -0.0181566 },
+	{ -0.5875400,  1.1329114, -0.1006017 },
+	{ -0.0728227, -0.0083478,  1.1187583 },
+};
+
+static const GLfloat identity[3][3] = {
+	{ 1.0, 0.0, 0.0 },
+	{ 0.0, 1.0, 0.0 },
+	{ 0.0, 0.0, 1.0 },
+};
+
+static const GLfloat (*yuv2rgbMatrix(__u32 ycbcr_enc))[3]
+{
+	switch (ycbcr_enc) {
+	case V4L2_YCBCR_ENC_SMPTE240M:
+		return yuv2rgb_smpte240m;
+	case V4L2_YCBCR_ENC_BT2020:
+		return yuv2rgb_bt2020;
+	case V4L2_YCBCR_ENC_601:
+	case V4L2_YCBCR_ENC_XV601:
+		return yuv2rgb_601;
+	default:
+		return yuv2rgb_709;
+	}
+}
+
+static const GLfloat (*colconvMatrix(__u32 colorspace))[3]
+{
+	switch (colorspace) {
+	case V4L2_COLORSPACE_SMPTE170M:
+	case V4L2_COLORSPACE_SMPTE240M:
+		return colconv_smpte170m;
+	case V4L2_COLORSPACE_470_SYSTEM_M:
+		return colconv_470_system_m;
+	case V4L2_COLORSPACE_470_SYSTEM_BG:
+		return colconv_470_system_bg;
+	case V4L2_COLORSPACE_OPRGB:
+		return colconv_oprgb;
+	case V4L2_COLORSPACE_DCI_P3:
+		return colconv_dci_p3;
+	case V4L2_COLORSPACE_BT2020:
+		return colconv_bt2020;
+	default:
+		return identity;
+	}
+}
+
+/*
+ * Load the colorimetry of m_v4l_fmt into the bound program. This used to
+ * be compiled into the shader, so every override meant a new program.
+ */
+void CaptureWin::updateColorUniforms()
+{
+	__u32 ycbcr_enc = m_v4l_fmt.g_ycbcr_enc();
+	__u32 quant = m_v4l_fmt.g_quantization();
+	QVector3D offset(0.0, 0.0, 0.0);
+	QVector3D scale(1.0, 1.0, 1.0);
+
+	if (m_is_rgb) {
+		if (quant == V4L2_QUANTIZATION_LIM_RANGE) {
+			offset = QVector3D(16.0 / 255.0, 16.0 / 255.0, 16.0 / 255.0);
+			scale = QVector3D(255.0 / 219.0, 255.0 / 219.0, 255.0 / 219.0);
+		}
+	} else if (!m_is_hsv) {
+		if (quant != V4L2_QUANTIZATION_FULL_RANGE ||
+		    ycbcr_enc == V4L2_YCBCR_ENC_XV601 ||
+		    ycbcr_enc == V4L2_YCBCR_ENC_XV709) {
+			offset = QVector3D(16.0 / 255.0, 0.0, 0.0);
+			scale = QVector3D(255.0 / 219.0, 255.0 / 224.0, 255.0 / 224.0);
+		}
+	}
+
+	m_program->setUniformValue("yuv2rgb", yuv2rgbMatrix(ycbcr_enc));
+	m_program->setUniformValue("colconv", colconvMatrix(m_v4l_fmt.g_colorspace()));
+	m_program->setUniformValue("quant_offset", offset);
+	m_program->setUniformValue("quant_scale", scale);
+	// setUniformValue(GLuint) is meant for samplers and uses glUniform1i
+	glUniform1ui(m_program->uniformLocation("xfer_func"),
+		     m_accepts_srgb ? V4L2_XFER_FUNC_NONE : m_v4l_fmt.g_xfer_func());
+	m_program->setUniformValue("const_lum", (GLint)(!m_is_rgb && !m_is_hsv &&
+				   ycbcr_enc == V4L2_YCBCR_ENC_BT2020_CONST_LUM));
+	checkError("updateColorUniforms");
+}
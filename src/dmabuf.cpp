@@ -0,0 +1,303 @@
+#include <string.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "capture.h"
+#include "v4l2-info.h"
+
+// DRM fourccs use the same encoding as V4L2 ones. Defined here to avoid
+// pulling in libdrm just for three constants.
+#define DRM_FORMAT_R8       v4l2_fourcc('R', '8', ' ', ' ')
+#define DRM_FORMAT_GR88     v4l2_fourcc('G', 'R', '8', '8')
+#define DRM_FORMAT_ABGR8888 v4l2_fourcc('A', 'B', '2', '4')
+
+typedef void (*ImageTargetTexture2DProc)(GLenum target, void *image);
+
+static PFNEGLCREATEIMAGEKHRPROC createImage;
+static PFNEGLDESTROYIMAGEKHRPROC destroyImage;
+static ImageTargetTexture2DProc imageTargetTexture2D;
+
+// How long to wait for the GPU to finish with a buffer before requeueing it.
+#define DMABUF_FENCE_TIMEOUT_NS 1000000000ull
+
+// Where the data of one shader texture lives inside a capture buffer.
+struct DmabufTexture {
+	unsigned plane;
+	unsigned offset;
+	unsigned width;
+	unsigned height;
+	unsigned pitch;
+	__u32 drmFormat;
+};
+
+static void setTexture(DmabufTexture &tex, unsigned plane, unsigned offset,
+		       unsigned width, unsigned height, unsigned pitch,
+		       __u32 drmFormat)
+{
+	tex.plane = plane;
+	tex.offset = offset;
+	tex.width = width;
+	tex.height = height;
+	tex.pitch = pitch;
+	tex.drmFormat = drmFormat;
+}
+
+/*
+ * Describe the textures the shader for this format samples from in terms
+ * of the capture buffer. This must match what the shader_* functions
+ * create, so only formats that use normalized 8 bit textures are handled.
+ * Everything else goes through glTexSubImage2D.
+ */
+static unsigned dmabufLayout(const cv4l_fmt &fmt, DmabufTexture tex[])
+{
+	unsigned w = fmt.g_width();
+	unsigned h = fmt.g_height();
+	unsigned bpl = fmt.g_bytesperline();
+
+	switch (fmt.g_pixelformat()) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+		setTexture(tex[0], 0, 0, w / 2, h, bpl, DRM_FORMAT_ABGR8888);
+		return 1;
+
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], 0, bpl * h, w, h / 2, bpl, DRM_FORMAT_R8);
+		return 2;
+
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV61:
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], 0, bpl * h, w, h, bpl, DRM_FORMAT_R8);
+		return 2;
+
+	case V4L2_PIX_FMT_NV12M:
+	case V4L2_PIX_FMT_NV21M:
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], 1, 0, w, h / 2, fmt.g_bytesperline(1), DRM_FORMAT_R8);
+		return 2;
+
+	case V4L2_PIX_FMT_NV16M:
+	case V4L2_PIX_FMT_NV61M:
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], 1, 0, w, h, fmt.g_bytesperline(1), DRM_FORMAT_R8);
+		return 2;
+
+	case V4L2_PIX_FMT_NV24:
+	case V4L2_PIX_FMT_NV42:
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], 0, bpl * h, w, h, bpl * 2, DRM_FORMAT_GR88);
+		return 2;
+
+	case V4L2_PIX_FMT_YUV420:
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], 0, bpl * h, w / 2, h / 2, bpl / 2, DRM_FORMAT_R8);
+		setTexture(tex[2], 0, bpl * h + bpl * h / 4, w / 2, h / 2, bpl / 2, DRM_FORMAT_R8);
+		return 3;
+
+	case V4L2_PIX_FMT_YVU420:
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], 0, bpl * h + bpl * h / 4, w / 2, h / 2, bpl / 2, DRM_FORMAT_R8);
+		setTexture(tex[2], 0, bpl * h, w / 2, h / 2, bpl / 2, DRM_FORMAT_R8);
+		return 3;
+
+	case V4L2_PIX_FMT_YUV422P:
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], 0, bpl * h, w / 2, h, bpl / 2, DRM_FORMAT_R8);
+		setTexture(tex[2], 0, bpl * h + bpl * h / 2, w / 2, h, bpl / 2, DRM_FORMAT_R8);
+		return 3;
+
+	case V4L2_PIX_FMT_YUV420M:
+	case V4L2_PIX_FMT_YVU420M:
+	case V4L2_PIX_FMT_YUV422M:
+	case V4L2_PIX_FMT_YVU422M:
+	case V4L2_PIX_FMT_YUV444M:
+	case V4L2_PIX_FMT_YVU444M: {
+		__u32 pf = fmt.g_pixelformat();
+		bool swapUV = pf == V4L2_PIX_FMT_YVU420M ||
+			      pf == V4L2_PIX_FMT_YVU422M ||
+			      pf == V4L2_PIX_FMT_YVU444M;
+		unsigned cw = w;
+		unsigned ch = h;
+
+		if (pf != V4L2_PIX_FMT_YUV444M && pf != V4L2_PIX_FMT_YVU444M)
+			cw /= 2;
+		if (pf == V4L2_PIX_FMT_YUV420M || pf == V4L2_PIX_FMT_YVU420M)
+			ch /= 2;
+
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_R8);
+		setTexture(tex[1], swapUV ? 2 : 1, 0, cw, ch,
+			   fmt.g_bytesperline(swapUV ? 2 : 1), DRM_FORMAT_R8);
+		setTexture(tex[2], swapUV ? 1 : 2, 0, cw, ch,
+			   fmt.g_bytesperline(swapUV ? 1 : 2), DRM_FORMAT_R8);
+		return 3;
+	}
+
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_XRGB32:
+	case V4L2_PIX_FMT_ARGB32:
+	case V4L2_PIX_FMT_RGBX32:
+	case V4L2_PIX_FMT_RGBA32:
+	case V4L2_PIX_FMT_BGR32:
+	case V4L2_PIX_FMT_XBGR32:
+	case V4L2_PIX_FMT_ABGR32:
+	case V4L2_PIX_FMT_BGRX32:
+	case V4L2_PIX_FMT_BGRA32:
+	case V4L2_PIX_FMT_HSV32:
+	case V4L2_PIX_FMT_YUV32:
+	case V4L2_PIX_FMT_AYUV32:
+	case V4L2_PIX_FMT_XYUV32:
+	case V4L2_PIX_FMT_VUYA32:
+	case V4L2_PIX_FMT_VUYX32:
+		// DRM ABGR8888 is R, G, B, A in memory, the same as GL_RGBA
+		setTexture(tex[0], 0, 0, w, h, bpl, DRM_FORMAT_ABGR8888);
+		return 1;
+	}
+	return 0;
+}
+
+bool CaptureWin::initDmabuf()
+{
+	EGLDisplay dpy = eglGetCurrentDisplay();
+
+	if (dpy == EGL_NO_DISPLAY)
+		return false;
+
+	const char *exts = eglQueryString(dpy, EGL_EXTENSIONS);
+
+	if (exts == NULL || strstr(exts, "EGL_EXT_image_dma_buf_import") == NULL)
+		return false;
+	if (!context()->hasExtension("GL_OES_EGL_image"))
+		return false;
+
+	createImage = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+	destroyImage = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+	imageTargetTexture2D = (ImageTargetTexture2DProc)
+		eglGetProcAddress("glEGLImageTargetTexture2DOES");
+
+	if (!createImage || !destroyImage || !imageTargetTexture2D)
+		return false;
+
+	m_eglDisplay = dpy;
+	return true;
+}
+
+bool CaptureWin::createDmabufImages(int index)
+{
+	DmabufTexture tex[MAX_TEXTURES_NEEDED];
+	unsigned count = dmabufLayout(m_v4l_fmt, tex);
+
+	if (count == 0)
+		return false;
+
+	// Don't mistake an older error for an import failure below.
+	while (glGetError() != GL_NO_ERROR)
+		;
+
+	glGenTextures(count, m_dmabufTex[index]);
+	for (unsigned t = 0; t < count; t++) {
+		EGLint attrs[] = {
+			EGL_WIDTH, (EGLint)tex[t].width,
+			EGL_HEIGHT, (EGLint)tex[t].height,
+			EGL_LINUX_DRM_FOURCC_EXT, (EGLint)tex[t].drmFormat,
+			EGL_DMA_BUF_PLANE0_FD_EXT, m_v4l_queue->g_fd(index, tex[t].plane),
+			EGL_DMA_BUF_PLANE0_OFFSET_EXT, (EGLint)tex[t].offset,
+			EGL_DMA_BUF_PLANE0_PITCH_EXT, (EGLint)tex[t].pitch,
+			EGL_NONE
+		};
+		EGLImageKHR image = createImage(m_eglDisplay, EGL_NO_CONTEXT,
+						EGL_LINUX_DMA_BUF_EXT, NULL, attrs);
+
+		if (image == EGL_NO_IMAGE_KHR)
+			return false;
+
+		m_dmabufImage[index][t] = image;
+		glBindTexture(GL_TEXTURE_2D, m_dmabufTex[index][t]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		imageTargetTexture2D(GL_TEXTURE_2D, image);
+		if (glGetError() != GL_NO_ERROR)
+			return false;
+	}
+	m_dmabufTexCount = count;
+	return true;
+}
+
+void CaptureWin::freeDmabufImages()
+{
+	waitDmabufFrame();
+	if (m_dmabufTexCount == 0 && m_eglDisplay == NULL)
+		return;
+
+	for (unsigned i = 0; i < VIDEO_MAX_FRAME; i++) {
+		for (unsigned t = 0; t < MAX_TEXTURES_NEEDED; t++) {
+			if (m_dmabufTex[i][t])
+				glDeleteTextures(1, &m_dmabufTex[i][t]);
+			if (m_dmabufImage[i][t])
+				destroyImage(m_eglDisplay, m_dmabufImage[i][t]);
+			m_dmabufTex[i][t] = 0;
+			m_dmabufImage[i][t] = 0;
+		}
+	}
+	m_dmabufTexCount = 0;
+}
+
+/*
+ * Bind the textures wrapping the current capture buffer. The images are
+ * created the first time a buffer index is seen and reused after that, so
+ * showing a frame costs no copies at all. Returns false if the frame has
+ * to be uploaded by render_* instead.
+ */
+bool CaptureWin::importDmabufFrame()
+{
+	if (m_uploadMode != UploadDmabuf || m_curIndex < 0)
+		return false;
+
+	if (m_dmabufTex[m_curIndex][0] == 0 && !createDmabufImages(m_curIndex)) {
+		fprintf(stderr, "Could not import %s buffers, falling back to direct upload\n",
+			fcc2s(m_v4l_fmt.g_pixelformat()).c_str());
+		freeDmabufImages();
+		m_uploadMode = UploadDirect;
+		return false;
+	}
+
+	for (unsigned t = 0; t < m_dmabufTexCount; t++) {
+		glActiveTexture(GL_TEXTURE0 + t);
+		glBindTexture(GL_TEXTURE_2D, m_dmabufTex[m_curIndex][t]);
+	}
+	checkError("importDmabufFrame");
+	return true;
+}
+
+/*
+ * The draw only queues commands that sample the capture buffer. Fence them
+ * so the buffer isn't handed back to the driver, which would overwrite it,
+ * while the GPU may still be reading it.
+ */
+void CaptureWin::fenceDmabufFrame()
+{
+	if (m_dmabufFence)
+		glDeleteSync(m_dmabufFence);
+	m_dmabufFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void CaptureWin::waitDmabufFrame()
+{
+	if (m_dmabufFence == 0)
+		return;
+
+	GLenum ret = glClientWaitSync(m_dmabufFence, GL_SYNC_FLUSH_COMMANDS_BIT,
+				      DMABUF_FENCE_TIMEOUT_NS);
+
+	if ((ret == GL_TIMEOUT_EXPIRED || ret == GL_WAIT_FAILED) && m_verbose)
+		printf("Capture buffer %d is still in use, requeueing it anyway\n",
+		       m_curIndex);
+	glDeleteSync(m_dmabufFence);
+	m_dmabufFence = 0;
+	checkError("waitDmabufFrame");
+}
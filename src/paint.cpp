@@ -41,8 +41,100 @@ void CaptureWin::initializeGL()
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 	checkError("InitializeGL Part 2");
-	m_program = new QOpenGLShaderProgram(this);
 	m_updateShader = true;
+
+	// Define Quad surface to draw to, vertices sequenced for GL_TRIANGLE_FAN
+	// Adjusting these will make the screen to draw to smaller or larger
+	const GLfloat quadVertex[] = {
+		-1.0f, -1.0f, // Left Bottom
+		+1.0f, -1.0f, // Right Bottom
+		+1.0f, +1.0f, // Rigth Top
+		-1.0f, +1.0f  // Left Top
+	};
+
+	// Normalized texture coords to be aligned to draw quad corners, same sequence but 0,0 is Left Top
+	const GLuint texCoords[] = {
+		0, 1,
+		1, 1,
+		1, 0,
+		0, 0
+	};
+
+	// The quad never changes, so the vertex array is built once and
+	// only bound when drawing.
+	glGenVertexArrays(1, &m_vertexArray);
+	glBindVertexArray(m_vertexArray);
+
+	glGenBuffers(1, &m_vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertex), quadVertex, GL_STATIC_DRAW);
+
+	// Attach Quad positions to vertex shader "position" attribute (location = 0)
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+	glGenBuffers(1, &m_uvBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_uvBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(texCoords), texCoords, GL_STATIC_DRAW);
+
+	// Attach texture corner positions to vertex shader "texCoord" attribute (location = 1)
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 2, GL_UNSIGNED_INT, GL_FALSE, 0, (void*)0);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	checkError("InitializeGL Part 3");
+
+	if (m_reportTimings) {
+		glGenQueries(TIMER_QUERY_RING, m_timerQuery);
+		m_timerQueryHead = 0;
+		m_timerQueryPending = 0;
+		m_timingsClock.start();
+	}
+
+	connect(context(), SIGNAL(aboutToBeDestroyed()), this, SLOT(cleanupGL()));
+	if (m_reportLatency)
+		connect(this, SIGNAL(frameSwapped()), this, SLOT(latencySwapped()));
+
+	watchWindow();
+
+	if (m_uploadMode == UploadDmabuf && !initDmabuf()) {
+		fprintf(stderr, "DMABUF import is not available, falling back to direct upload\n");
+		m_uploadMode = UploadDirect;
+	}
+}
+
+void CaptureWin::cleanupGL()
+{
+	if (context() == NULL || m_vertexArray == 0)
+		return;
+
+	makeCurrent();
+	glDeleteVertexArrays(1, &m_vertexArray);
+	glDeleteBuffers(1, &m_vertexBuffer);
+	glDeleteBuffers(1, &m_uvBuffer);
+	m_vertexArray = m_vertexBuffer = m_uvBuffer = 0;
+
+	if (m_screenTextureCount)
+		glDeleteTextures(m_screenTextureCount, m_screenTexture);
+	m_screenTextureCount = 0;
+	m_texPixelFormat = 0;
+
+	freeUploadRing();
+	freeDmabufImages();
+	freeConvertFbo();
+
+	if (m_reportTimings)
+		glDeleteQueries(TIMER_QUERY_RING, m_timerQuery);
+	for (; m_latencyCount; m_latencyCount--) {
+		glDeleteSync(m_latencyFence[m_latencyHead]);
+		m_latencyHead = (m_latencyHead + 1) % LATENCY_RING;
+	}
+
+	qDeleteAll(m_programCache);
+	m_programCache.clear();
+	m_program = NULL;
+	doneCurrent();
 }
 
 
@@ -51,73 +143,417 @@ void CaptureWin::paintGL()
 	if (m_v4l_fmt.g_width() < 16 || m_v4l_fmt.g_frame_height() < 16)
 		return;
 
-	if (m_v4l_queue == NULL || m_nextIndex == -1)
+	if (!acquireFrame())
 		return;
 
-	cv4l_buffer buf(*m_v4l_queue, m_curIndex);
+	if (!prepareFrame())
+		return;
+
+	uploadFrame();
+	drawFrame();
+	if (m_uploadMode == UploadDmabuf && !m_cpuConvert)
+		fenceDmabufFrame();
+}
 
-	m_fd->qbuf(buf);
-	for (unsigned i = 0; i < m_v4l_queue->g_num_planes(); i++) {
-		m_curData[i] = m_nextData[i];
-		m_curSize[i] = m_nextSize[i];
-		m_curIndex = m_nextIndex;
-		m_nextIndex = -1;
-		m_nextData[i] = 0;
-		m_nextSize[i] = 0;
+/*
+ * Frames that are shorter than the format says can't be uploaded without
+ * reading past their end. Converted frames are always complete.
+ */
+bool CaptureWin::isShortFrame(const RagnaFrame &frame)
+{
+	if (frame.converted)
+		return false;
+
+	for (unsigned i = 0; i < frame.num_planes; i++)
+		if (frame.size[i] < m_v4l_fmt.g_sizeimage(i))
+			return true;
+	return false;
+}
+
+/*
+ * Only the newest frame is shown, older ones go straight back to the
+ * capture thread so the driver doesn't run out of buffers.
+ */
+bool CaptureWin::acquireFrame()
+{
+	if (m_frameSource == NULL)
+		return false;
+
+	RagnaFrame frame, next;
+	bool haveFrame = false;
+
+	while (m_frameSource->popFrame(next)) {
+		if (isShortFrame(next)) {
+			// Keep showing the current frame instead.
+			if (m_verbose)
+				printf("Dropping short frame %d (%u bytes)\n",
+				       next.index, next.size[0]);
+			m_frameSource->releaseFrame(next.index);
+			continue;
+		}
+		waitDmabufFrame();
+		m_frameSource->releaseFrame(m_curIndex);
+		m_curIndex = next.index;
+		frame = next;
+		haveFrame = true;
 	}
 
+	if (haveFrame == false)
+		return false;
 
+	for (unsigned i = 0; i < frame.num_planes; i++) {
+		m_curData[i] = frame.data[i];
+		m_curSize[i] = frame.size[i];
+	}
+	m_curConverted = frame.converted;
+	memset(&m_latencyCur, 0, sizeof(m_latencyCur));
+	m_latencyCur.timestamp = frame.timestamp;
+	m_latencyCur.dequeued = frame.dequeued;
+	return true;
+}
+
+/*
+ * Bring the program and textures up to date with the current format.
+ * Returns false (after clearing the display) if there's nothing to draw.
+ */
+bool CaptureWin::prepareFrame()
+{
 	if (m_curData[0] == NULL) {
 		// No data, just clear display
 		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT);
 		checkError("paintGL - no data");
-		return;
+		return false;
 	}
 
 	if (m_updateShader) {
 		m_updateShader = false;
-		if (!supportedFmt(m_v4l_fmt.g_pixelformat())) {
+		if (!selectConversion()) {
 			fprintf(stderr, "OpenGL ES unsupported format 0x%08x ('%s').\n",
 				m_v4l_fmt.g_pixelformat(), fcc2s(m_v4l_fmt.g_pixelformat()).c_str());
 
 			glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 			glClear(GL_COLOR_BUFFER_BIT);
 			checkError("paintGL - no data");
-			return;
+			return false;
 		}
 
 		changeShader();
+	} else if (m_updateColors) {
+		// Only sRGB textures depend on the colorimetry
+		if (m_texSrgb != m_accepts_srgb)
+			changeShader();
+		else
+			updateColorUniforms();
+	}
+	m_updateColors = false;
+
+	// Frames dequeued before the conversion was switched on or off are
+	// in the wrong layout, keep showing the last one instead.
+	return m_cpuConvert == m_curConverted;
+}
+
+/*
+ * Decide whether the current format can be sampled as is or has to be
+ * unpacked on the CPU first, and tell the capture thread.
+ */
+bool CaptureWin::selectConversion()
+{
+	__u32 pixfmt = m_v4l_fmt.g_pixelformat();
+
+	m_cpuConvert = false;
+	if (supportedFmt(pixfmt)) {
+		if (m_frameSource)
+			m_frameSource->clearConversion();
+		return true;
+	}
+
+	if (!m_convert.setup(pixfmt))
+		return false;
+
+	m_cpuConvert = true;
+	if (m_frameSource)
+		m_frameSource->setConversion(m_convert, m_v4l_fmt.g_width(),
+					     m_v4l_fmt.g_height(),
+					     m_v4l_fmt.g_bytesperline());
+	if (m_verbose)
+		printf("Unpacking '%s' on the CPU (%s)\n",
+		       fcc2s(pixfmt).c_str(), RagnaConvert::isaName());
+	return true;
+}
+
+void CaptureWin::uploadFrame()
+{
+	m_latencyCur.uploadStart = RagnaLatency::now();
+	if (m_cpuConvert || !importDmabufFrame()) {
+		uploadBegin();
+		renderFrame(m_v4l_fmt.g_pixelformat());
+		uploadEnd();
 	}
+	m_latencyCur.uploadEnd = RagnaLatency::now();
+}
+
+void CaptureWin::drawFrame()
+{
+	QSize s = m_viewSize;
+	GLint x = (size().width() - s.width()) / 2;
+	GLint y = (size().height() - s.height()) / 2;
+	bool twoPass = useConvertFbo();
+
+	if (twoPass) {
+		glBindFramebuffer(GL_FRAMEBUFFER, m_convertFbo);
+		glViewport(0, 0, m_convertFboWidth, m_convertFboHeight);
+	} else {
+		glViewport(x, y, s.width(), s.height());
+	}
+
+	bool timed = m_reportTimings && beginRenderTiming();
+
+	glBindVertexArray(m_vertexArray);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	glBindVertexArray(0);
+
+	if (twoPass) {
+		// Nearest keeps the result identical to converting per output
+		// pixel, since the source textures are sampled that way too.
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, m_convertFbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
+		glBlitFramebuffer(0, 0, m_convertFboWidth, m_convertFboHeight,
+				  x, y, x + s.width(), y + s.height(),
+				  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+	}
+
+	checkError("paintGL");
+
+	if (timed)
+		glEndQuery(GL_TIME_ELAPSED);
+	if (m_reportLatency)
+		submitLatency();
+}
+
+/*
+ * The conversion shader runs once per fragment it's drawn to. When the
+ * view is larger than the source, convert at the source size and let a
+ * blit do the scaling so the cost doesn't grow with the window.
+ */
+bool CaptureWin::useConvertFbo()
+{
+	unsigned width = m_origWidth;
+	unsigned height = m_origHeight;
+
+	switch (m_scaleMode) {
+	case ScaleShader:
+		return false;
+	case ScaleAuto:
+		if ((qint64)m_viewSize.width() * m_viewSize.height() <=
+		    (qint64)width * height)
+			return false;
+		break;
+	case ScaleBlit:
+		break;
+	}
+
+	if (m_convertFbo && m_convertFboWidth == width &&
+	    m_convertFboHeight == height)
+		return true;
+
+	if (initConvertFbo(width, height))
+		return true;
+
+	fprintf(stderr, "Could not create the conversion framebuffer, converting per output pixel\n");
+	m_scaleMode = ScaleShader;
+	return false;
+}
+
+bool CaptureWin::initConvertFbo(unsigned width, unsigned height)
+{
+	freeConvertFbo();
+
+	glGenTextures(1, &m_convertFboTex);
+	glBindTexture(GL_TEXTURE_2D, m_convertFboTex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+		     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &m_convertFbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_convertFbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, m_convertFboTex, 0);
+
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+	checkError("initConvertFbo");
+
+	m_convertFboWidth = width;
+	m_convertFboHeight = height;
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		freeConvertFbo();
+		return false;
+	}
+
+	if (m_verbose)
+		printf("Converting into a %ux%u framebuffer before scaling\n",
+		       width, height);
+	return true;
+}
+
+void CaptureWin::freeConvertFbo()
+{
+	if (m_convertFbo)
+		glDeleteFramebuffers(1, &m_convertFbo);
+	if (m_convertFboTex)
+		glDeleteTextures(1, &m_convertFboTex);
+	m_convertFbo = 0;
+	m_convertFboTex = 0;
+	m_convertFboWidth = 0;
+	m_convertFboHeight = 0;
+}
+
+/*
+ * Collect finished timer queries, oldest first, without waiting on the GPU,
+ * then start a new one if a slot is free. A frame goes untimed rather than
+ * stall when every query is still in flight.
+ */
+bool CaptureWin::beginRenderTiming()
+{
+	while (m_timerQueryPending) {
+		unsigned oldest = (m_timerQueryHead + TIMER_QUERY_RING -
+				   m_timerQueryPending) % TIMER_QUERY_RING;
+		GLuint available = 0;
+		GLuint t;
+
+		glGetQueryObjectuiv(m_timerQuery[oldest], GL_QUERY_RESULT_AVAILABLE,
+				    &available);
+		if (!available)
+			break;
+
+		glGetQueryObjectuiv(m_timerQuery[oldest], GL_QUERY_RESULT, &t);
+		m_renderTimes.add(t);
+		m_timerQueryPending--;
+	}
+
+	if (m_timingsClock.elapsed() >= m_timingsInterval) {
+		m_renderTimes.report("Render time");
+		m_renderTimes.reset();
+		m_timingsClock.restart();
+	}
+
+	if (m_timerQueryPending == TIMER_QUERY_RING)
+		return false;
+
+	glBeginQuery(GL_TIME_ELAPSED, m_timerQuery[m_timerQueryHead]);
+	m_timerQueryHead = (m_timerQueryHead + 1) % TIMER_QUERY_RING;
+	m_timerQueryPending++;
+	return true;
+}
+
+void CaptureWin::submitLatency()
+{
+	unsigned slot = (m_latencyHead + m_latencyCount) % LATENCY_RING;
+
+	m_latencyCur.submitted = RagnaLatency::now();
+
+	if (m_latencyCount == LATENCY_RING) {
+		// Nothing is completing, forget the oldest frame.
+		glDeleteSync(m_latencyFence[m_latencyHead]);
+		m_latencyHead = (m_latencyHead + 1) % LATENCY_RING;
+		m_latencyCount--;
+	}
+
+	m_latencyRecord[slot] = m_latencyCur;
+	m_latencyFence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	m_latencyCount++;
+	harvestLatency();
+}
+
+/*
+ * Poll the fences of frames in flight, without waiting, and account for
+ * every frame that has both finished on the GPU and been swapped.
+ */
+void CaptureWin::harvestLatency()
+{
+	uint64_t t = RagnaLatency::now();
+
+	for (unsigned i = 0; i < m_latencyCount; i++) {
+		unsigned slot = (m_latencyHead + i) % LATENCY_RING;
+		RagnaLatencyRecord &r = m_latencyRecord[slot];
+
+		if (r.gpuDone)
+			continue;
+
+		GLenum status = glClientWaitSync(m_latencyFence[slot], 0, 0);
+
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+			r.gpuDone = t;
+	}
+
+	while (m_latencyCount) {
+		RagnaLatencyRecord &r = m_latencyRecord[m_latencyHead];
+
+		if (r.gpuDone == 0 || r.swapped == 0)
+			break;
+
+		m_latency.add(r);
+		glDeleteSync(m_latencyFence[m_latencyHead]);
+		m_latencyHead = (m_latencyHead + 1) % LATENCY_RING;
+		m_latencyCount--;
+	}
+
+	m_latency.reportIfDue(m_timingsInterval);
+}
+
+void CaptureWin::latencySwapped()
+{
+	uint64_t t = RagnaLatency::now();
+
+	for (unsigned i = 0; i < m_latencyCount; i++) {
+		RagnaLatencyRecord &r = m_latencyRecord[(m_latencyHead + i) % LATENCY_RING];
+
+		if (r.swapped == 0)
+			r.swapped = t;
+	}
+
+	makeCurrent();
+	harvestLatency();
+	doneCurrent();
+}
 
-	if (!supportedFmt(m_v4l_fmt.g_pixelformat()))
+void CaptureWin::renderFrame(__u32 format)
+{
+	if (m_cpuConvert) {
+		render_Converted();
 		return;
+	}
 
-	switch (m_v4l_fmt.g_pixelformat()) {
+	switch (format) {
 	case V4L2_PIX_FMT_YUYV:
 	case V4L2_PIX_FMT_YVYU:
 	case V4L2_PIX_FMT_UYVY:
 	case V4L2_PIX_FMT_VYUY:
-		render_YUY2(m_v4l_fmt.g_pixelformat());
+		render_YUY2(format);
 		break;
 
 	case V4L2_PIX_FMT_NV16:
 	case V4L2_PIX_FMT_NV61:
 	case V4L2_PIX_FMT_NV16M:
 	case V4L2_PIX_FMT_NV61M:
-		render_NV16(m_v4l_fmt.g_pixelformat());
+		render_NV16(format);
 		break;
 
 	case V4L2_PIX_FMT_NV12:
 	case V4L2_PIX_FMT_NV21:
 	case V4L2_PIX_FMT_NV12M:
 	case V4L2_PIX_FMT_NV21M:
-		render_NV12(m_v4l_fmt.g_pixelformat());
+		render_NV12(format);
 		break;
 
 	case V4L2_PIX_FMT_NV24:
 	case V4L2_PIX_FMT_NV42:
-		render_NV24(m_v4l_fmt.g_pixelformat());
+		render_NV24(format);
 		break;
 
 	case V4L2_PIX_FMT_YUV422P:
@@ -129,7 +565,7 @@ void CaptureWin::paintGL()
 	case V4L2_PIX_FMT_YVU422M:
 	case V4L2_PIX_FMT_YUV444M:
 	case V4L2_PIX_FMT_YVU444M:
-		render_YUV(m_v4l_fmt.g_pixelformat());
+		render_YUV(format);
 		break;
 
 	case V4L2_PIX_FMT_YUV444:
@@ -140,7 +576,7 @@ void CaptureWin::paintGL()
 	case V4L2_PIX_FMT_XYUV32:
 	case V4L2_PIX_FMT_VUYA32:
 	case V4L2_PIX_FMT_VUYX32:
-		render_YUV_packed(m_v4l_fmt.g_pixelformat());
+		render_YUV_packed(format);
 		break;
 
 	case V4L2_PIX_FMT_SBGGR8:
@@ -159,7 +595,7 @@ void CaptureWin::paintGL()
 	case V4L2_PIX_FMT_SGBRG16:
 	case V4L2_PIX_FMT_SGRBG16:
 	case V4L2_PIX_FMT_SRGGB16:
-		render_Bayer(m_v4l_fmt.g_pixelformat());
+		render_Bayer(format);
 		break;
 
 	case V4L2_PIX_FMT_GREY:
@@ -208,88 +644,9 @@ void CaptureWin::paintGL()
 	case V4L2_PIX_FMT_HSV24:
 	case V4L2_PIX_FMT_HSV32:
 	default:
-		render_RGB(m_v4l_fmt.g_pixelformat());
+		render_RGB(format);
 		break;
 	}
-
-	static unsigned long long tot_t;
-	static unsigned cnt;
-	GLuint query;
-	QSize s = m_viewSize;
-
-	glViewport((size().width() - s.width()) / 2,
-		   (size().height() - s.height()) / 2,
-		   s.width(), s.height());
-
-	if (m_reportTimings) {
-		glGenQueries(1, &query);
-		glBeginQuery(GL_TIME_ELAPSED, query);
-	}
-
-	GLuint VertexArrayID;
-	glGenVertexArrays(1, &VertexArrayID);
-	glBindVertexArray(VertexArrayID);
-
-	// Define Quad surface to draw to, vertices sequenced for GL_TRIANGLE_FAN
-	// Adjusting these will make the screen to draw to smaller or larger
-	const GLfloat quadVertex[] = {
-		-1.0f, -1.0f, // Left Bottom
-		+1.0f, -1.0f, // Right Bottom
-		+1.0f, +1.0f, // Rigth Top
-		-1.0f, +1.0f  // Left Top
-	};
-
-	// Normalized texture coords to be aligned to draw quad corners, same sequence but 0,0 is Left Top
-	const GLuint texCoords[] = {
-		0, 1,
-		1, 1,
-		1, 0,
-		0, 0
-	};
-
-	GLuint vertexbuffer;
-	glGenBuffers(1, &vertexbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertex), quadVertex, GL_STATIC_DRAW);
-
-	GLuint uvbuffer;
-	glGenBuffers(1, &uvbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, uvbuffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(texCoords), texCoords, GL_STATIC_DRAW);
-
-	// Attach Quad positions to vertex shader "position" attribute (location = 0)
-	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-	// Attach texture corner positions to vertex shader "texCoord" attribute (location = 1)
-	glEnableVertexAttribArray(1);
-	glBindBuffer(GL_ARRAY_BUFFER, uvbuffer);
-	glVertexAttribPointer(1, 2, GL_UNSIGNED_INT, GL_FALSE, 0, (void*)0);
-
-	// Draw quad with texture
-	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-
-	// Disable attrib arrays
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glDeleteBuffers(1, &vertexbuffer);
-
-	checkError("paintGL");
-
-	if (m_reportTimings) {
-		glEndQuery(GL_TIME_ELAPSED);
-		GLuint t;
-		glGetQueryObjectuiv(query, GL_QUERY_RESULT, &t);
-		glDeleteQueries(1, &query);
-
-		cnt++;
-		tot_t += t;
-		unsigned ave = tot_t / cnt;
-		printf("Average render time: %09u ns, frame %d render time: %09u ns\n",
-		       ave, cnt, t);
-	}
 }
 
 static const char *prog =
@@ -448,9 +805,19 @@ static const struct define defines[] = {
 
 void CaptureWin::changeShader()
 {
-	if (m_screenTextureCount)
-		glDeleteTextures(m_screenTextureCount, m_screenTexture);
-	m_program->removeAllShaders();
+	// Only the shader depends on the colorimetry, the textures only need
+	// to be replaced when the frame layout changes.
+	bool newTextures = m_texPixelFormat != m_v4l_fmt.g_pixelformat() ||
+			   m_texWidth != m_v4l_fmt.g_width() ||
+			   m_texHeight != m_v4l_fmt.g_height() ||
+			   m_texSrgb != m_accepts_srgb;
+
+	if (newTextures) {
+		if (m_screenTextureCount)
+			glDeleteTextures(m_screenTextureCount, m_screenTexture);
+		m_screenTextureCount = 0;
+		freeDmabufImages();
+	}
 	checkError("Render settings.\n");
 
 	QString code;
@@ -466,62 +833,23 @@ void CaptureWin::changeShader()
 		"#define FIELD %3\n"
 		"#define IS_RGB %4\n"
 		"#define PIXFMT %5u\n"
-		"#define COLSP %6\n"
-		"#define XFERFUNC %7\n"
-		"#define YCBCRENC %8\n"
-		"#define QUANT %9\n\n"
-		"#define IS_HSV %10\n"
-		"#define HSVENC %11\n")
+		"#define IS_HSV %6\n"
+		"#define HSVENC %7\n")
 		.arg(m_v4l_fmt.g_width())
 		.arg(m_v4l_fmt.g_height())
 		.arg(m_v4l_fmt.g_field())
 		.arg(m_is_rgb)
 		.arg(m_v4l_fmt.g_pixelformat())
-		.arg(m_v4l_fmt.g_colorspace())
-		.arg(m_accepts_srgb ? V4L2_XFER_FUNC_NONE : m_v4l_fmt.g_xfer_func())
-		.arg(m_v4l_fmt.g_ycbcr_enc())
-		.arg(m_v4l_fmt.g_quantization())
 		.arg(m_is_hsv)
 		.arg(m_v4l_fmt.g_hsv_enc());
 
-	for (unsigned i = 0; defines[i].name; i++)
-		code += QString("#define ") + defines[i].name + " " + QString("%1").arg(defines[i].id) + "u\n";
-	code += "#line 1\n";
-
-	code += prog;
-
-	bool src_ok = m_program->addShaderFromSourceCode(
-		QOpenGLShader::Fragment, code);
-
-	if (!src_ok) {
-		fprintf(stderr, "OpenGL Error: fragment shader compilation failed.\n");
-		std::exit(EXIT_FAILURE);
-	}
-
-	// Mandatory vertex shader replaces fixed pipeline in GLES 2.0. In this case just a feedthrough shader.
-	QString vertexShaderSrc;
-
-	if (context()->isOpenGLES())
-		vertexShaderSrc = "#version 300 es\n"
-			"precision mediump float;\n";
-	else
-		vertexShaderSrc = "#version 330\n";
-
-	vertexShaderSrc +=
-		"layout(location = 0) in vec2 position;\n"
-		"layout(location = 1) in vec2 texCoord;\n"
-		"out vec2 vs_TexCoord;\n"
-		"void main() {\n"
-		"       gl_Position = vec4(position, 0.0, 1.0);\n"
-		"       vs_TexCoord = texCoord;\n"
-		"}\n";
-
-	src_ok = m_program->addShaderFromSourceCode(
-		QOpenGLShader::Vertex, vertexShaderSrc);
+	// Everything that varies between programs is in the lines above.
+	QString key = code;
 
-	if (!src_ok) {
-		fprintf(stderr, "OpenGL Error: vertex shader compilation failed.\n");
-		std::exit(EXIT_FAILURE);
+	m_program = m_programCache.value(key);
+	if (m_program == NULL) {
+		m_program = buildProgram(code);
+		m_programCache.insert(key, m_program);
 	}
 
 	if (!m_program->bind()) {
@@ -539,6 +867,20 @@ void CaptureWin::changeShader()
 	loc = m_program->uniformLocation("vtex");
 	if (loc >= 0)
 		m_program->setUniformValue(loc, 2);
+	updateColorUniforms();
+
+	if (!newTextures)
+		return;
+
+	m_texPixelFormat = m_v4l_fmt.g_pixelformat();
+	m_texWidth = m_v4l_fmt.g_width();
+	m_texHeight = m_v4l_fmt.g_height();
+	m_texSrgb = m_accepts_srgb;
+
+	if (m_cpuConvert) {
+		shader_Converted();
+		return;
+	}
 
 	switch (m_v4l_fmt.g_pixelformat()) {
 	case V4L2_PIX_FMT_YUYV:
@@ -660,6 +1002,69 @@ void CaptureWin::changeShader()
 	}
 }
 
+QOpenGLShaderProgram *CaptureWin::buildProgram(QString code)
+{
+	for (unsigned i = 0; defines[i].name; i++)
+		code += QString("#define ") + defines[i].name + " " + QString("%1").arg(defines[i].id) + "u\n";
+	code += "#line 1\n";
+
+	code += prog;
+
+	// Mandatory vertex shader replaces fixed pipeline in GLES 2.0. In this case just a feedthrough shader.
+	QString vertexShaderSrc;
+
+	if (context()->isOpenGLES())
+		vertexShaderSrc = "#version 300 es\n"
+			"precision mediump float;\n";
+	else
+		vertexShaderSrc = "#version 330\n";
+
+	vertexShaderSrc +=
+		"layout(location = 0) in vec2 position;\n"
+		"layout(location = 1) in vec2 texCoord;\n"
+		"out vec2 vs_TexCoord;\n"
+		"void main() {\n"
+		"       gl_Position = vec4(position, 0.0, 1.0);\n"
+		"       vs_TexCoord = texCoord;\n"
+		"}\n";
+
+	QOpenGLShaderProgram *program = new QOpenGLShaderProgram(this);
+	QString cachePath = programCachePath(code, vertexShaderSrc);
+
+	if (!cachePath.isEmpty() && loadProgramBinary(program, cachePath))
+		return program;
+
+	program->create();
+	if (!cachePath.isEmpty())
+		glProgramParameteri(program->programId(),
+				    GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+	bool src_ok = program->addShaderFromSourceCode(
+		QOpenGLShader::Fragment, code);
+
+	if (!src_ok) {
+		fprintf(stderr, "OpenGL Error: fragment shader compilation failed.\n");
+		std::exit(EXIT_FAILURE);
+	}
+
+	src_ok = program->addShaderFromSourceCode(
+		QOpenGLShader::Vertex, vertexShaderSrc);
+
+	if (!src_ok) {
+		fprintf(stderr, "OpenGL Error: vertex shader compilation failed.\n");
+		std::exit(EXIT_FAILURE);
+	}
+
+	if (!program->link()) {
+		fprintf(stderr, "OpenGL Error: shader link failed.\n");
+		std::exit(EXIT_FAILURE);
+	}
+
+	if (!cachePath.isEmpty())
+		saveProgramBinary(program, cachePath);
+	return program;
+}
+
 void CaptureWin::shader_YUV()
 {
 	unsigned vdiv = 2, hdiv = 2;
@@ -933,6 +1338,25 @@ void CaptureWin::shader_YUV_packed()
 	checkError("Packed YUV shader");
 }
 
+// Holds what RagnaConvert unpacked, see selectConversion
+void CaptureWin::shader_Converted()
+{
+	m_screenTextureCount = 1;
+	glGenTextures(m_screenTextureCount, m_screenTexture);
+	glActiveTexture(GL_TEXTURE0);
+	configureTexture(0);
+
+	if (m_convert.bytesPerPixel() == 2)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB565, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(), 0,
+			     GL_RGB, GL_UNSIGNED_SHORT_5_6_5, NULL);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, m_accepts_srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8,
+			     m_v4l_fmt.g_width(), m_v4l_fmt.g_height(), 0,
+			     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	checkError("Converted shader");
+}
+
 void CaptureWin::render_YUV(__u32 format)
 {
 	unsigned vdiv = 2, hdiv = 2;
@@ -966,7 +1390,7 @@ void CaptureWin::render_YUV(__u32 format)
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, m_screenTexture[0]);
 	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[0]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[0]);
 	checkError("YUV paint ytex");
 
 	glActiveTexture(GL_TEXTURE1);
@@ -976,19 +1400,19 @@ void CaptureWin::render_YUV(__u32 format)
 	case V4L2_PIX_FMT_YUV420:
 	case V4L2_PIX_FMT_YVU420:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width() / hdiv, m_v4l_fmt.g_height() / vdiv,
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[0] == NULL ? NULL : &m_curData[0][idxU]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[0] + idxU);
 		break;
 	case V4L2_PIX_FMT_YUV420M:
 	case V4L2_PIX_FMT_YUV422M:
 	case V4L2_PIX_FMT_YUV444M:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width() / hdiv, m_v4l_fmt.g_height() / vdiv,
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[1]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[1]);
 		break;
 	case V4L2_PIX_FMT_YVU420M:
 	case V4L2_PIX_FMT_YVU422M:
 	case V4L2_PIX_FMT_YVU444M:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width() / hdiv, m_v4l_fmt.g_height() / vdiv,
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[2]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[2]);
 		break;
 	}
 	checkError("YUV paint utex");
@@ -1000,19 +1424,19 @@ void CaptureWin::render_YUV(__u32 format)
 	case V4L2_PIX_FMT_YUV420:
 	case V4L2_PIX_FMT_YVU420:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width() / hdiv, m_v4l_fmt.g_height() / vdiv,
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[0] == NULL ? NULL : &m_curData[0][idxV]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[0] + idxV);
 		break;
 	case V4L2_PIX_FMT_YUV420M:
 	case V4L2_PIX_FMT_YUV422M:
 	case V4L2_PIX_FMT_YUV444M:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width() / hdiv, m_v4l_fmt.g_height() / vdiv,
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[2]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[2]);
 		break;
 	case V4L2_PIX_FMT_YVU420M:
 	case V4L2_PIX_FMT_YVU422M:
 	case V4L2_PIX_FMT_YVU444M:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width() / hdiv, m_v4l_fmt.g_height() / vdiv,
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[1]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[1]);
 		break;
 	}
 	checkError("YUV paint vtex");
@@ -1023,7 +1447,7 @@ void CaptureWin::render_NV12(__u32 format)
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, m_screenTexture[0]);
 	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[0]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[0]);
 	checkError("NV12 paint ytex");
 
 	glActiveTexture(GL_TEXTURE1);
@@ -1033,12 +1457,12 @@ void CaptureWin::render_NV12(__u32 format)
 	case V4L2_PIX_FMT_NV21:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height() / 2,
 				GL_RED, GL_UNSIGNED_BYTE,
-				m_curData[0] ? m_curData[0] + m_v4l_fmt.g_width() * m_v4l_fmt.g_height() : NULL);
+				m_texData[0] + m_v4l_fmt.g_width() * m_v4l_fmt.g_height());
 		break;
 	case V4L2_PIX_FMT_NV12M:
 	case V4L2_PIX_FMT_NV21M:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height() / 2,
-				GL_RED, GL_UNSIGNED_BYTE, m_curData[1]);
+				GL_RED, GL_UNSIGNED_BYTE, m_texData[1]);
 		break;
 	}
 	checkError("NV12 paint uvtex");
@@ -1050,7 +1474,7 @@ void CaptureWin::render_NV24(__u32 format)
 	glBindTexture(GL_TEXTURE_2D, m_screenTexture[0]);
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline());
 	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[0]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[0]);
 	checkError("NV24 paint ytex");
 
 	glActiveTexture(GL_TEXTURE1);
@@ -1058,7 +1482,7 @@ void CaptureWin::render_NV24(__u32 format)
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline());
 	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
 			GL_RG, GL_UNSIGNED_BYTE,
-			m_curData[0] ? m_curData[0] + m_v4l_fmt.g_sizeimage() / 3 : NULL);
+			m_texData[0] + m_v4l_fmt.g_sizeimage() / 3);
 	checkError("NV24 paint uvtex");
 }
 
@@ -1068,7 +1492,7 @@ void CaptureWin::render_NV16(__u32 format)
 	glBindTexture(GL_TEXTURE_2D, m_screenTexture[0]);
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline());
 	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-			GL_RED, GL_UNSIGNED_BYTE, m_curData[0]);
+			GL_RED, GL_UNSIGNED_BYTE, m_texData[0]);
 	checkError("NV16 paint ytex");
 
 	glActiveTexture(GL_TEXTURE1);
@@ -1078,12 +1502,12 @@ void CaptureWin::render_NV16(__u32 format)
 	case V4L2_PIX_FMT_NV61:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
 				GL_RED, GL_UNSIGNED_BYTE,
-				m_curData[0] ? m_curData[0] + m_v4l_fmt.g_sizeimage() / 2 : NULL);
+				m_texData[0] + m_v4l_fmt.g_sizeimage() / 2);
 		break;
 	case V4L2_PIX_FMT_NV16M:
 	case V4L2_PIX_FMT_NV61M:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RED, GL_UNSIGNED_BYTE, m_curData[1]);
+				GL_RED, GL_UNSIGNED_BYTE, m_texData[1]);
 		break;
 	}
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
@@ -1096,7 +1520,7 @@ void CaptureWin::render_YUY2(__u32 format)
 	glBindTexture(GL_TEXTURE_2D, m_screenTexture[0]);
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 4);
 	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width() / 2, m_v4l_fmt.g_height(),
-			GL_RGBA, GL_UNSIGNED_BYTE, m_curData[0]);
+			GL_RGBA, GL_UNSIGNED_BYTE, m_texData[0]);
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 	checkError("YUY2 paint");
 }
@@ -1110,7 +1534,7 @@ void CaptureWin::render_RGB(__u32 format)
 	case V4L2_PIX_FMT_RGB332:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline());
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGB, GL_UNSIGNED_BYTE_3_3_2, m_curData[0]);
+				GL_RGB, GL_UNSIGNED_BYTE_3_3_2, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_RGB444:
@@ -1124,13 +1548,13 @@ void CaptureWin::render_RGB(__u32 format)
 	case V4L2_PIX_FMT_BGRA444:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 2);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, m_curData[0]);
+				GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_GREY:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline());
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RED_INTEGER, GL_UNSIGNED_BYTE, m_curData[0]);
+				GL_RED_INTEGER, GL_UNSIGNED_BYTE, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_Y10:
@@ -1139,12 +1563,12 @@ void CaptureWin::render_RGB(__u32 format)
 	case V4L2_PIX_FMT_Z16:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 2);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RED_INTEGER, GL_UNSIGNED_SHORT, m_curData[0]);
+				GL_RED_INTEGER, GL_UNSIGNED_SHORT, m_texData[0]);
 		break;
 	case V4L2_PIX_FMT_Y16_BE:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 2);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RED_INTEGER, GL_UNSIGNED_SHORT, m_curData[0]);
+				GL_RED_INTEGER, GL_UNSIGNED_SHORT, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_RGB555:
@@ -1154,7 +1578,7 @@ void CaptureWin::render_RGB(__u32 format)
 	case V4L2_PIX_FMT_ABGR555:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 2);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, m_curData[0]);
+				GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_RGB555X:
@@ -1166,7 +1590,7 @@ void CaptureWin::render_RGB(__u32 format)
 		// to be tested first, though.
 		glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_TRUE);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, m_curData[0]);
+				GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, m_texData[0]);
 		glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
 		break;
 
@@ -1176,13 +1600,13 @@ void CaptureWin::render_RGB(__u32 format)
 	case V4L2_PIX_FMT_BGRA555:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 2);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_BGRA, GL_UNSIGNED_SHORT_5_5_5_1, m_curData[0]);
+				GL_BGRA, GL_UNSIGNED_SHORT_5_5_5_1, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_RGB565:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 2);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGB, GL_UNSIGNED_SHORT_5_6_5, m_curData[0]);
+				GL_RGB, GL_UNSIGNED_SHORT_5_6_5, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_RGB565X:
@@ -1192,7 +1616,7 @@ void CaptureWin::render_RGB(__u32 format)
 		// to be tested first, though.
 		glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_TRUE);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGB, GL_UNSIGNED_SHORT_5_6_5, m_curData[0]);
+				GL_RGB, GL_UNSIGNED_SHORT_5_6_5, m_texData[0]);
 		glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
 		break;
 
@@ -1209,12 +1633,12 @@ void CaptureWin::render_RGB(__u32 format)
 	case V4L2_PIX_FMT_BGRA32:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 4);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGBA, GL_UNSIGNED_BYTE, m_curData[0]);
+				GL_RGBA, GL_UNSIGNED_BYTE, m_texData[0]);
 		break;
 	case V4L2_PIX_FMT_BGR666:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 4);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, m_curData[0]);
+				GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_RGB24:
@@ -1223,7 +1647,7 @@ void CaptureWin::render_RGB(__u32 format)
 	default:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 3);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGB, GL_UNSIGNED_BYTE, m_curData[0]);
+				GL_RGB, GL_UNSIGNED_BYTE, m_texData[0]);
 		break;
 	}
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
@@ -1242,7 +1666,7 @@ void CaptureWin::render_Bayer(__u32 format)
 	case V4L2_PIX_FMT_SRGGB8:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline());
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RED_INTEGER, GL_UNSIGNED_BYTE, m_curData[0]);
+				GL_RED_INTEGER, GL_UNSIGNED_BYTE, m_texData[0]);
 		break;
 	case V4L2_PIX_FMT_SBGGR10:
 	case V4L2_PIX_FMT_SGBRG10:
@@ -1258,7 +1682,7 @@ void CaptureWin::render_Bayer(__u32 format)
 	case V4L2_PIX_FMT_SRGGB16:
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, m_v4l_fmt.g_bytesperline() / 2);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RED_INTEGER, GL_UNSIGNED_SHORT, m_curData[0]);
+				GL_RED_INTEGER, GL_UNSIGNED_SHORT, m_texData[0]);
 		break;
 	}
 	checkError("Bayer paint");
@@ -1272,17 +1696,17 @@ void CaptureWin::render_YUV_packed(__u32 format)
 	switch (format) {
 	case V4L2_PIX_FMT_YUV555:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, m_curData[0]);
+				GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_YUV444:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, m_curData[0]);
+				GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_YUV565:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGB, GL_UNSIGNED_SHORT_5_6_5, m_curData[0]);
+				GL_RGB, GL_UNSIGNED_SHORT_5_6_5, m_texData[0]);
 		break;
 
 	case V4L2_PIX_FMT_YUV32:
@@ -1291,8 +1715,23 @@ void CaptureWin::render_YUV_packed(__u32 format)
 	case V4L2_PIX_FMT_VUYA32:
 	case V4L2_PIX_FMT_VUYX32:
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
-				GL_RGBA, GL_UNSIGNED_BYTE, m_curData[0]);
+				GL_RGBA, GL_UNSIGNED_BYTE, m_texData[0]);
 		break;
 	}
 	checkError("Packed YUV paint");
 }
+
+void CaptureWin::render_Converted()
+{
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, m_screenTexture[0]);
+
+	// The converted frame is tightly packed
+	if (m_convert.bytesPerPixel() == 2)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
+				GL_RGB, GL_UNSIGNED_SHORT_5_6_5, m_texData[0]);
+	else
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_v4l_fmt.g_width(), m_v4l_fmt.g_height(),
+				GL_RGBA, GL_UNSIGNED_BYTE, m_texData[0]);
+	checkError("Converted paint");
+}
@@ -6,7 +6,11 @@
  */
 
 #include <QApplication>
+#include "ragnaarena.h"
 #include "ragnacontroller.h"
+#include "ragnafilesource.h"
+#include "ragnafwhtrecorder.h"
+#include "ragnarecorder.h"
 #include "v4l2-info.h"
 
 static void usage()
@@ -18,15 +22,57 @@ static void usage()
 	       "\n"
 	       "  If -d is not specified, then use /dev/video0.\n"
 	       "\n"
+	       "  --file=<path>            play back <path> instead of capturing, either a\n"
+	       "                           --record recording or a v4l2-ctl stream file\n"
+	       "  --fps=<fps>              frames per second to play stream files at, they\n"
+	       "                           carry no timestamps (default 30)\n"
+	       "  --benchmark              with --file, show every frame as fast as possible\n"
+	       "                           and report the frame rate at the end of the file\n"
 	       "  -b, --buffers=<bufs>     request <bufs> buffers (default 4) when streaming\n"
 	       "                           from a video device\n"
+	       "  --max-buffers=<bufs>     add buffers while streaming, up to <bufs>, when\n"
+	       "                           frames are lost because the driver ran out, and\n"
+	       "                           stop using the extra ones once that has stopped\n"
+	       "  --memory=<mode>          where capture buffers live:\n"
+	       "                           mmap: buffers allocated by the driver (default)\n"
+	       "                           userptr: one arena of 2 MiB pages allocated by\n"
+	       "                           ragna, falls back to mmap if that isn't supported\n"
 	       "  -h, --help               display this help message\n"
 	       "  -t, --timings            report frame render timings\n"
+	       "  --timings-interval=<ms>  report render time percentiles every <ms>\n"
+	       "                           milliseconds (default 1000), implies -t\n"
+	       "  --latency                report how long frames take from capture to the\n"
+	       "                           screen, per stage, every --timings-interval\n"
+	       "  --unfocused-fps=<fps>    show at most <fps> frames per second while the\n"
+	       "                           window doesn't have focus (default: no limit)\n"
 	       "  -v, --verbose            be more verbose\n"
 	       "  -R, --raw                open device in raw mode\n"
 	       "\n"
 	       "  --opengl                 force openGL to display the video\n"
-	       "                           (default: openGL ES)\n");
+	       "                           (default: openGL ES)\n"
+	       "  --record=<path>          write every captured frame, as is, to <path>.0000,\n"
+	       "                           <path>.0001, ... Frames are dropped from the\n"
+	       "                           recording, never from the display, if the disk\n"
+	       "                           can't keep up\n"
+	       "  --record-segment=<MiB>   start a new file after <MiB> MiB (default 1024)\n"
+	       "  --record-fwht=<path>     write captured frames to <path>, compressed with\n"
+	       "                           the FWHT codec, in the v4l2-ctl stream format\n"
+	       "  --record-gop=<frames>    frames per FWHT group of pictures (default 10),\n"
+	       "                           groups are compressed in parallel\n"
+	       "  --record-bitrate=<kbps>  pick the FWHT quantization of every frame to\n"
+	       "                           record at <kbps> kbit/s, and report the bitrate\n"
+	       "                           every second (default: fixed quantization)\n"
+	       "  --record-latency=<ms>    how far ahead of --record-bitrate the output may\n"
+	       "                           run, in <ms> milliseconds of it (default 1000)\n"
+	       "  --upload=<mode>          how frames reach the GPU:\n"
+	       "                           direct: glTexSubImage2D from the capture buffer (default)\n"
+	       "                           pbo: copy through a ring of pixel unpack buffers\n"
+	       "                           dmabuf: import the capture buffers through EGL, falls\n"
+	       "                           back to direct if that isn't supported\n"
+	       "  --scale=<mode>           how frames are scaled to the window:\n"
+	       "                           shader: convert every output pixel\n"
+	       "                           blit: convert at the source size, then blit\n"
+	       "                           auto: blit when enlarging, else shader (default)\n");
 }
 
 static void usageError(const char *msg)
@@ -96,6 +142,58 @@ static bool isOption(const QString &opt, const char *longOpt, const char *shortO
 	return opt == longOpt || opt == shortOpt;
 }
 
+static void openDevice(cv4l_fd &fd, QString video_device, RagnaController &rc,
+		       cv4l_fmt &fmt)
+{
+	video_device = getDeviceName("/dev/video", video_device);
+	if (fd.open(video_device.toUtf8().data(), true) < 0) {
+		perror((QString("could not open ") + video_device).toUtf8().data());
+		std::exit(EXIT_FAILURE);
+	}
+	if (!fd.has_vid_cap()) {
+		fprintf(stderr, "%s is not a video capture device\n", video_device.toUtf8().data());
+		std::exit(EXIT_FAILURE);
+	}
+
+	fd.g_fmt(fmt);
+	rc.updateFormatForPrefs(&fmt);
+	fd.s_fmt(fmt);
+
+	{
+		bool found = false;
+		unsigned int pf = fmt.g_pixelformat();
+
+		for (unsigned i = 0; formats[i]; i++) {
+			if (pf == formats[i]) {
+				found = true;
+				break;
+			}
+		}
+
+		if (!found) {
+			/* Try fixing it to one that's known to work. */
+			__u32 overridePixelFormat = V4L2_PIX_FMT_RGB24;
+
+			fmt.s_pixelformat(V4L2_PIX_FMT_RGB24);
+			fd.s_fmt(fmt);
+			fd.g_fmt(fmt);
+
+			if (fmt.g_pixelformat() != overridePixelFormat)
+				fprintf(stderr, "Not able to override format to %s (%s)\n",
+					fcc2s(overridePixelFormat).c_str(),
+					pixfmt2s(overridePixelFormat).c_str());
+			else
+				found = true;
+		}
+
+		if (!found) {
+			fprintf(stderr, "Unknown/invalid device format %s (%s)\n",
+				fcc2s(pf).c_str(), pixfmt2s(pf).c_str());
+			std::exit(EXIT_FAILURE);
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
 	QApplication disp(argc, argv);
@@ -106,10 +204,25 @@ int main(int argc, char **argv)
 	cv4l_fd fd;
 	cv4l_fmt fmt;
 	unsigned v4l2_bufs = 4;
+	unsigned max_bufs = 0;
+	unsigned memory = V4L2_MEMORY_MMAP;
 	bool info_option = false;
 	bool report_timings = false;
+	unsigned timings_interval = 1000;
+	bool report_latency = false;
 	bool verbose = false;
 	bool force_opengl = false;
+	UploadMode upload_mode = UploadDirect;
+	ScaleMode scale_mode = ScaleAuto;
+	unsigned unfocused_fps = 0;
+	QString record_path;
+	unsigned record_segment = 1024;
+	QString record_fwht_path;
+	unsigned record_gop = 10;
+	unsigned record_kbps = 0;
+	unsigned record_latency = 1000;
+	unsigned file_fps = 30;
+	bool benchmark = false;
 
 	disp.setApplicationDisplayName("Ragna Viewer");
 	QStringList args = disp.arguments();
@@ -119,11 +232,32 @@ int main(int argc, char **argv)
 		if (isOptArg(args[i], "--device", "-d")) {
 			if (!processOption(args, i, video_device))
 				return 0;
+		} else if (isOptArg(args[i], "--file")) {
+			if (!processOption(args, i, filename))
+				return 0;
+		} else if (isOptArg(args[i], "--fps")) {
+			if (!processOption(args, i, file_fps))
+				return 0;
+			if (file_fps == 0) {
+				usageInvParm(args[i].toUtf8());
+				return 0;
+			}
+		} else if (isOption(args[i], "--benchmark")) {
+			benchmark = true;
 		} else if (isOption(args[i], "--help", "-h")) {
 			usage();
 			info_option = true;
 		} else if (isOption(args[i], "--timings", "-t")) {
 			report_timings = true;
+		} else if (isOptArg(args[i], "--timings-interval")) {
+			if (!processOption(args, i, timings_interval))
+				return 0;
+			report_timings = true;
+		} else if (isOption(args[i], "--latency")) {
+			report_latency = true;
+		} else if (isOptArg(args[i], "--unfocused-fps")) {
+			if (!processOption(args, i, unfocused_fps))
+				return 0;
 		} else if (isOptArg(args[i], "--opengl")) {
 			force_opengl = true;
 		} else if (isOption(args[i], "--verbose", "-v")) {
@@ -133,6 +267,72 @@ int main(int argc, char **argv)
 		} else if (isOptArg(args[i], "--buffers", "-b")) {
 			if (!processOption(args, i, v4l2_bufs))
 				return 0;
+		} else if (isOptArg(args[i], "--max-buffers")) {
+			if (!processOption(args, i, max_bufs))
+				return 0;
+		} else if (isOptArg(args[i], "--memory")) {
+			if (!processOption(args, i, s))
+				return 0;
+			if (s == "mmap") {
+				memory = V4L2_MEMORY_MMAP;
+			} else if (s == "userptr") {
+				memory = V4L2_MEMORY_USERPTR;
+			} else {
+				usageInvParm(s.toUtf8());
+				return 0;
+			}
+		} else if (isOptArg(args[i], "--record-segment")) {
+			if (!processOption(args, i, record_segment))
+				return 0;
+			if (record_segment == 0) {
+				usageInvParm(args[i].toUtf8());
+				return 0;
+			}
+		} else if (isOptArg(args[i], "--record-fwht")) {
+			if (!processOption(args, i, record_fwht_path))
+				return 0;
+		} else if (isOptArg(args[i], "--record-gop")) {
+			if (!processOption(args, i, record_gop))
+				return 0;
+			if (record_gop == 0) {
+				usageInvParm(args[i].toUtf8());
+				return 0;
+			}
+		} else if (isOptArg(args[i], "--record-bitrate")) {
+			if (!processOption(args, i, record_kbps))
+				return 0;
+		} else if (isOptArg(args[i], "--record-latency")) {
+			if (!processOption(args, i, record_latency))
+				return 0;
+		} else if (isOptArg(args[i], "--record")) {
+			if (!processOption(args, i, record_path))
+				return 0;
+		} else if (isOptArg(args[i], "--upload")) {
+			if (!processOption(args, i, s))
+				return 0;
+			if (s == "direct") {
+				upload_mode = UploadDirect;
+			} else if (s == "pbo") {
+				upload_mode = UploadPBO;
+			} else if (s == "dmabuf") {
+				upload_mode = UploadDmabuf;
+			} else {
+				usageInvParm(s.toUtf8());
+				return 0;
+			}
+		} else if (isOptArg(args[i], "--scale")) {
+			if (!processOption(args, i, s))
+				return 0;
+			if (s == "shader") {
+				scale_mode = ScaleShader;
+			} else if (s == "blit") {
+				scale_mode = ScaleBlit;
+			} else if (s == "auto") {
+				scale_mode = ScaleAuto;
+			} else {
+				usageInvParm(s.toUtf8());
+				return 0;
+			}
 		} else {
 			printf("Invalid argument %s\n", args[i].toUtf8().data());
 			return 0;
@@ -140,60 +340,40 @@ int main(int argc, char **argv)
 	}
 	if (info_option)
 		return 0;
+	if (!record_path.isEmpty() && !record_fwht_path.isEmpty()) {
+		fprintf(stderr, "--record and --record-fwht can't be used together\n");
+		return 0;
+	}
 
-	video_device = getDeviceName("/dev/video", video_device);
-	if (fd.open(video_device.toUtf8().data(), true) < 0) {
-		perror((QString("could not open ") + video_device).toUtf8().data());
-		std::exit(EXIT_FAILURE);
+	if (!filename.isEmpty() &&
+	    (!record_path.isEmpty() || !record_fwht_path.isEmpty())) {
+		fprintf(stderr, "--file can't be combined with --record or --record-fwht\n");
+		return 0;
 	}
-	if (!fd.has_vid_cap()) {
-		fprintf(stderr, "%s is not a video capture device\n", video_device.toUtf8().data());
-		std::exit(EXIT_FAILURE);
+	if (benchmark && filename.isEmpty()) {
+		fprintf(stderr, "--benchmark needs --file\n");
+		return 0;
 	}
 
-	fd.g_fmt(fmt);
-
 	RagnaController rc;
+	RagnaFileSource *fileSource = NULL;
 
 	rc.loadPrefs();
-	rc.updateFormatForPrefs(&fmt);
-	fd.s_fmt(fmt);
-
-	{
-		bool found = false;
-		unsigned int pf = fmt.g_pixelformat();
-
-		for (unsigned i = 0; formats[i]; i++) {
-			if (pf == formats[i]) {
-				found = true;
-				break;
-			}
-		}
-
-		if (!found) {
-			/* Try fixing it to one that's known to work. */
-			__u32 overridePixelFormat = V4L2_PIX_FMT_RGB24;
-
-			fmt.s_pixelformat(V4L2_PIX_FMT_RGB24);
-			fd.s_fmt(fmt);
-			fd.g_fmt(fmt);
-
-			if (fmt.g_pixelformat() != overridePixelFormat)
-				fprintf(stderr, "Not able to override format to %s (%s)\n",
-					fcc2s(overridePixelFormat).c_str(),
-					pixfmt2s(overridePixelFormat).c_str());
-			else
-				found = true;
-		}
-
-		if (!found) {
-			fprintf(stderr, "Unknown/invalid device format %s (%s)\n",
-				fcc2s(pf).c_str(), pixfmt2s(pf).c_str());
+	if (!filename.isEmpty()) {
+		fileSource = new RagnaFileSource;
+		if (!fileSource->open(filename))
 			std::exit(EXIT_FAILURE);
-		}
+		fileSource->setFps(file_fps);
+		fileSource->setBenchmark(benchmark);
+		fileSource->format(fmt);
+	} else {
+		openDevice(fd, video_device, rc, fmt);
 	}
 
 	format.setDepthBufferSize(24);
+	// Don't let the display's refresh rate cap the benchmark.
+	if (benchmark)
+		format.setSwapInterval(0);
 
 	if (force_opengl)
 		format.setRenderableType(QSurfaceFormat::OpenGL);
@@ -205,9 +385,34 @@ int main(int argc, char **argv)
 	QSurfaceFormat::setDefaultFormat(format);
 	CaptureWin win(rsa);
 	win.setVerbose(verbose);
-	win.setModeV4L2(&fd);
+	if (fileSource == NULL)
+		win.setModeV4L2(&fd);
 	win.setFormat(format);
 	win.setReportTimings(report_timings);
+	win.setTimingsInterval(timings_interval);
+	win.setReportLatency(report_latency);
+	win.setUploadMode(upload_mode);
+	win.setScaleMode(scale_mode);
+	win.setUnfocusedFps(unfocused_fps);
+	win.setMaxBuffers(max_bufs);
+
+	RagnaRecorder recorder;
+
+	if (!record_path.isEmpty()) {
+		if (!recorder.open(record_path, (uint64_t)record_segment << 20))
+			std::exit(EXIT_FAILURE);
+		win.setRecorder(&recorder);
+		recorder.start();
+	}
+
+	RagnaFwhtRecorder fwhtRecorder;
+
+	if (!record_fwht_path.isEmpty()) {
+		if (!fwhtRecorder.open(record_fwht_path, record_gop,
+				       record_kbps, record_latency))
+			std::exit(EXIT_FAILURE);
+		win.setRecorder(&fwhtRecorder);
+	}
 	while (!win.setV4LFormat(fmt)) {
 		fprintf(stderr, "Unsupported format: '%s' %s\n",
 			fcc2s(fmt.g_pixelformat()).c_str(),
@@ -218,17 +423,60 @@ int main(int argc, char **argv)
 	rc.setCapture(&win, rsa);
 	rsa->resize(QSize(fmt.g_width(), fmt.g_frame_height()));
 
-	cv4l_queue q(fd.g_type(), V4L2_MEMORY_MMAP);
-	q.reqbufs(&fd, v4l2_bufs);
-	q.obtain_bufs(&fd);
-	q.queue_all(&fd);
-	win.setQueue(&q);
-	if (fd.streamon()) {
-		fputs("Error initializing the stream. Stopping.\n", stderr);
-		std::exit(EXIT_FAILURE);
+	// Declared before q, the driver may still hold user pointers into it.
+	RagnaArena arena;
+	cv4l_queue q(fd.g_type(), memory);
+
+	if (fileSource) {
+		win.setSource(fileSource);
+		if (benchmark)
+			QObject::connect(fileSource, &RagnaFileSource::finished,
+					 &disp, &QApplication::quit);
+	} else {
+		if (memory == V4L2_MEMORY_USERPTR) {
+			bool ok = !q.reqbufs(&fd, v4l2_bufs);
+
+			if (ok) {
+				// Leave room for the buffers --max-buffers may add later.
+				unsigned bufs = qMax(q.g_buffers(),
+						     qMin(max_bufs, (unsigned)VIDEO_MAX_FRAME));
+
+				ok = arena.reserve(RagnaArena::bufferSize(&q) * bufs) &&
+				     !arena.obtainBufs(&q);
+			}
+			if (ok) {
+				win.setArena(&arena);
+				if (verbose)
+					printf("capture buffers use %zu MiB of %s\n",
+					       arena.size() >> 20, arena.backingName());
+			} else {
+				fprintf(stderr, "Could not use user pointer buffers, falling back to mmap\n");
+				q.reqbufs(&fd, 0);
+				arena.release();
+				q.init(fd.g_type(), V4L2_MEMORY_MMAP);
+				memory = V4L2_MEMORY_MMAP;
+			}
+		}
+		if (memory == V4L2_MEMORY_MMAP) {
+			q.reqbufs(&fd, v4l2_bufs);
+			q.obtain_bufs(&fd);
+		}
+		q.queue_all(&fd);
+		win.setQueue(&q);
+		if (fd.streamon()) {
+			fputs("Error initializing the stream. Stopping.\n", stderr);
+			std::exit(EXIT_FAILURE);
+		}
 	}
+	win.startCapture();
 
 	rc.start();
 
-	return disp.exec();
+	int ret = disp.exec();
+
+	// The capture thread uses the queue, so stop it before q goes away.
+	win.stopCapture();
+	recorder.stop();
+	fwhtRecorder.stop();
+	return ret;
 }
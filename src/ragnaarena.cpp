@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "cv4l-helpers.h"
+#include "ragnaarena.h"
+
+RagnaArena::RagnaArena()
+    : m_map(MAP_FAILED),
+      m_mapSize(0),
+      m_base(0),
+      m_size(0),
+      m_used(0),
+      m_backing(BackingNone)
+{
+}
+
+RagnaArena::~RagnaArena()
+{
+    release();
+}
+
+bool RagnaArena::reserve(size_t size)
+{
+    release();
+    size = roundUp(size, HugePage);
+
+#ifdef MAP_HUGETLB
+    m_map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (m_map != MAP_FAILED) {
+        m_mapSize = size;
+        m_base = (char *)m_map;
+        m_size = size;
+        m_backing = BackingHugetlb;
+        return true;
+    }
+#endif
+
+    /*
+     * No hugetlb pages are reserved. Map a huge page more than needed so
+     * the arena can start on a 2 MiB boundary, which transparent hugepages
+     * need to be used at all.
+     */
+    m_mapSize = size + HugePage;
+    m_map = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_map == MAP_FAILED) {
+        m_mapSize = 0;
+        return false;
+    }
+
+    m_base = (char *)roundUp((uintptr_t)m_map, HugePage);
+    m_size = size;
+    m_backing = BackingPages;
+#ifdef MADV_HUGEPAGE
+    if (madvise(m_base, m_size, MADV_HUGEPAGE) == 0)
+        m_backing = BackingTransparent;
+#endif
+    return true;
+}
+
+void *RagnaArena::alloc(size_t size)
+{
+    size = roundUp(size);
+    if (m_base == 0 || m_size - m_used < size)
+        return 0;
+
+    void *p = m_base + m_used;
+
+    m_used += size;
+    return p;
+}
+
+void RagnaArena::release()
+{
+    if (m_map != MAP_FAILED)
+        munmap(m_map, m_mapSize);
+    m_map = MAP_FAILED;
+    m_mapSize = 0;
+    m_base = 0;
+    m_size = 0;
+    m_used = 0;
+    m_backing = BackingNone;
+}
+
+size_t RagnaArena::bufferSize(cv4l_queue *q)
+{
+    size_t size = 0;
+
+    for (unsigned p = 0; p < q->g_num_planes(); p++)
+        size += roundUp(q->g_length(p));
+    return size;
+}
+
+int RagnaArena::obtainBufs(cv4l_queue *q, unsigned from)
+{
+    for (unsigned b = from; b < q->g_buffers(); b++) {
+        for (unsigned p = 0; p < q->g_num_planes(); p++) {
+            void *m = alloc(q->g_length(p));
+
+            if (m == 0)
+                return ENOMEM;
+            q->s_userptr(b, p, m);
+        }
+    }
+    return 0;
+}
+
+const char *RagnaArena::backingName() const
+{
+    switch (m_backing) {
+    case BackingHugetlb:
+        return "hugetlb pages";
+    case BackingTransparent:
+        return "transparent hugepages";
+    case BackingPages:
+        return "normal pages";
+    default:
+        return "nothing";
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef RAGNAARENA_H
+# define RAGNAARENA_H
+# include <stddef.h>
+
+class cv4l_queue;
+
+/*
+ * One contiguous mapping that USERPTR capture buffers are carved out of.
+ * It's backed by 2 MiB pages when the system allows it: explicit hugetlb
+ * pages first, then transparent hugepages, then normal pages. Memory is
+ * only returned when the arena goes away.
+ */
+class RagnaArena
+{
+public:
+    enum Backing {
+        BackingNone,
+        BackingHugetlb,
+        BackingTransparent,
+        BackingPages,
+    };
+
+    RagnaArena();
+    ~RagnaArena();
+
+    bool reserve(size_t size);
+    void *alloc(size_t size);
+    void release();
+
+    /* Like cv4l_queue::obtain_bufs for USERPTR queues, but from the arena. */
+    int obtainBufs(cv4l_queue *q, unsigned from = 0);
+    static size_t bufferSize(cv4l_queue *q);
+
+    Backing backing() const { return m_backing; }
+    const char *backingName() const;
+    size_t size() const { return m_size; }
+    size_t used() const { return m_used; }
+
+    static const size_t HugePage = 2 * 1024 * 1024;
+    /* Drivers want user pointers to start on a page. */
+    static const size_t Align = 4096;
+
+    static size_t roundUp(size_t size, size_t align = Align)
+    {
+        return (size + align - 1) & ~(align - 1);
+    }
+
+private:
+    void *m_map;
+    size_t m_mapSize;
+    char *m_base;
+    size_t m_size;
+    size_t m_used;
+    Backing m_backing;
+};
+
+#endif
@@ -0,0 +1,346 @@
+#include <QApplication>
+#include <QScrollArea>
+#include <vector>
+
+#include "capture.h"
+#include "v4l2-info.h"
+
+extern "C" {
+#include "v4l2-tpg.h"
+}
+
+#define BENCH_MAX_WIDTH 3840
+
+static const struct {
+    unsigned width;
+    unsigned height;
+} benchSizes[] = {
+    { 640, 480 },
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+    { 0, 0 }
+};
+
+/*
+ * Feeds test pattern frames straight into a CaptureWin, skipping the
+ * capture thread, and times the upload and the conversion draw of each
+ * one separately. glFinish() is used between the steps so each time
+ * covers the GPU work too, which is fine here but not in the viewer.
+ */
+class RagnaBench
+{
+public:
+    RagnaBench(CaptureWin *win, unsigned frames);
+    ~RagnaBench();
+
+    void run(__u32 pixfmt, unsigned width, unsigned height);
+
+private:
+    bool setupFormat(__u32 pixfmt, unsigned width, unsigned height);
+    void convertFrame();
+
+    CaptureWin *m_win;
+    unsigned m_frames;
+    struct tpg_data m_tpg;
+    std::vector<__u8> m_buf[VIDEO_MAX_PLANES];
+    std::vector<__u8> m_converted;
+};
+
+RagnaBench::RagnaBench(CaptureWin *win, unsigned frames)
+    : m_win(win),
+      m_frames(frames)
+{
+    tpg_init(&m_tpg, 640, 480);
+    tpg_alloc(&m_tpg, BENCH_MAX_WIDTH);
+}
+
+RagnaBench::~RagnaBench()
+{
+    tpg_free(&m_tpg);
+}
+
+bool RagnaBench::setupFormat(__u32 pixfmt, unsigned width, unsigned height)
+{
+    if (!tpg_s_fourcc(&m_tpg, pixfmt))
+        return false;
+
+    tpg_reset_source(&m_tpg, width, height, V4L2_FIELD_NONE);
+
+    unsigned buffers = tpg_g_buffers(&m_tpg);
+    cv4l_fmt fmt(buffers > 1 ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE :
+                               V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+    fmt.s_pixelformat(pixfmt);
+    fmt.s_width(width);
+    fmt.s_height(height);
+    fmt.s_field(V4L2_FIELD_NONE);
+    fmt.s_colorspace(V4L2_COLORSPACE_DEFAULT);
+    fmt.s_num_planes(buffers);
+
+    for (unsigned p = 0; p < buffers; p++) {
+        unsigned size = tpg_calc_plane_size(&m_tpg, p);
+
+        /* A single buffer holds every plane back to back. */
+        if (buffers == 1)
+            for (unsigned i = 1; i < tpg_g_planes(&m_tpg); i++)
+                size += tpg_calc_plane_size(&m_tpg, i);
+
+        fmt.s_bytesperline(tpg_g_bytesperline(&m_tpg, p), p);
+        fmt.s_sizeimage(size, p);
+        m_buf[p].resize(size);
+    }
+
+    m_win->m_overrideColorspace = 0xffffffff;
+    m_win->m_overrideYCbCrEnc = 0xffffffff;
+    m_win->m_overrideHSVEnc = 0xffffffff;
+    m_win->m_overrideXferFunc = 0xffffffff;
+    m_win->m_overrideQuantization = 0xffffffff;
+    if (!m_win->setV4LFormat(fmt))
+        return false;
+
+    m_win->resize(width, height);
+    m_win->updateOrigValues();
+
+    /* Generate the pattern in the colorimetry the shader will assume. */
+    const cv4l_fmt &cur = m_win->m_v4l_fmt;
+
+    tpg_s_colorspace(&m_tpg, cur.g_colorspace());
+    tpg_s_xfer_func(&m_tpg, cur.g_xfer_func());
+    if (m_win->m_is_hsv)
+        tpg_s_hsv_enc(&m_tpg, cur.g_hsv_enc());
+    else
+        tpg_s_ycbcr_enc(&m_tpg, cur.g_ycbcr_enc());
+    tpg_s_quantization(&m_tpg, cur.g_quantization());
+
+    for (unsigned p = 0; p < buffers; p++) {
+        tpg_fillbuffer(&m_tpg, 0, p, m_buf[p].data());
+        m_win->m_curData[p] = m_buf[p].data();
+        m_win->m_curSize[p] = m_buf[p].size();
+    }
+    return true;
+}
+
+/* Does what the capture thread does for formats the context can't sample. */
+void RagnaBench::convertFrame()
+{
+    const cv4l_fmt &fmt = m_win->m_v4l_fmt;
+    const RagnaConvert &convert = m_win->m_convert;
+
+    m_converted.resize(convert.frameSize(fmt.g_width(), fmt.g_height()));
+    convert.convert(m_buf[0].data(), fmt.g_bytesperline(), m_converted.data(),
+                    fmt.g_width(), fmt.g_height());
+    m_win->m_curData[0] = m_converted.data();
+    m_win->m_curSize[0] = m_converted.size();
+    m_win->m_curConverted = true;
+}
+
+void RagnaBench::run(__u32 pixfmt, unsigned width, unsigned height)
+{
+    RagnaHistogram upload;
+    RagnaHistogram convert;
+    uint64_t bytes = 0;
+
+    printf("%-8s %5ux%-5u ", fcc2s(pixfmt).c_str(), width, height);
+
+    if (!setupFormat(pixfmt, width, height)) {
+        printf("skipped (no test pattern for this format)\n");
+        return;
+    }
+
+    m_win->makeCurrent();
+    m_win->m_updateShader = true;
+    m_win->m_curConverted = false;
+
+    bool ok = m_win->prepareFrame();
+
+    if (m_win->m_cpuConvert) {
+        convertFrame();
+        ok = m_win->prepareFrame();
+    }
+    if (!ok) {
+        printf("skipped (not supported by this context)\n");
+        m_win->doneCurrent();
+        return;
+    }
+
+    for (unsigned p = 0; p < m_win->m_v4l_fmt.g_num_planes(); p++)
+        bytes += m_win->m_v4l_fmt.g_sizeimage(p);
+
+    /* Let the driver allocate and compile lazily before timing. */
+    m_win->uploadFrame();
+    m_win->drawFrame();
+    glFinish();
+
+    for (unsigned i = 0; i < m_frames; i++) {
+        uint64_t start = RagnaLatency::now();
+
+        /* The capture thread would do this, count it as part of the upload. */
+        if (m_win->m_cpuConvert)
+            convertFrame();
+        m_win->uploadFrame();
+        glFinish();
+
+        uint64_t uploaded = RagnaLatency::now();
+
+        m_win->drawFrame();
+        glFinish();
+
+        uint64_t drawn = RagnaLatency::now();
+
+        upload.add(uploaded - start);
+        convert.add(drawn - uploaded);
+    }
+    m_win->doneCurrent();
+
+    double uploadNs = upload.percentile(50);
+    double convertNs = convert.percentile(50);
+
+    printf("upload %7.3f ms %8.1f MB/s   convert %7.3f ms %8.1f Mpix/s\n",
+           uploadNs / 1e6, uploadNs ? bytes * 1e3 / uploadNs : 0.0,
+           convertNs / 1e6,
+           convertNs ? (double)width * height * 1e3 / convertNs : 0.0);
+}
+
+static void usage()
+{
+    puts("Usage: ragna-bench <options>\n\n"
+         "Times uploading and converting test pattern frames for every\n"
+         "pixel format the viewer supports, at several resolutions. By\n"
+         "default the offscreen Qt platform is used, set QT_QPA_PLATFORM\n"
+         "to benchmark against a real window system instead.\n\n"
+         "Options:\n\n"
+         "  -f, --format=<fourcc>    only benchmark this pixel format\n"
+         "  -n, --frames=<n>         frames timed per format and size (default 100)\n"
+         "  -s, --size=<w>x<h>       only benchmark this resolution\n"
+         "  --opengl                 use openGL instead of openGL ES\n"
+         "  --upload=<mode>          direct (default) or pbo, see ragna --help\n"
+         "  -h, --help               display this help message");
+}
+
+static bool optionValue(const QStringList &args, int &i, const char *longOpt,
+                        const char *shortOpt, QString &value)
+{
+    const QString &arg = args[i];
+
+    if (arg.startsWith(QString(longOpt) + "=")) {
+        value = arg.mid(strlen(longOpt) + 1);
+        return true;
+    }
+    if (arg == shortOpt && i + 1 < args.size()) {
+        value = args[++i];
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication app(argc, argv);
+    QStringList args = app.arguments();
+    QSurfaceFormat format;
+    __u32 onlyFormat = 0;
+    unsigned onlyWidth = 0;
+    unsigned onlyHeight = 0;
+    unsigned frames = 100;
+    bool force_opengl = false;
+    UploadMode upload_mode = UploadDirect;
+
+    for (int i = 1; i < args.size(); i++) {
+        QString s;
+
+        if (args[i] == "--help" || args[i] == "-h") {
+            usage();
+            return 0;
+        } else if (args[i] == "--opengl") {
+            force_opengl = true;
+        } else if (optionValue(args, i, "--format", "-f", s)) {
+            QByteArray fcc = s.toLatin1().leftJustified(4, ' ');
+
+            onlyFormat = v4l2_fourcc(fcc[0], fcc[1], fcc[2], fcc[3]);
+        } else if (optionValue(args, i, "--frames", "-n", s)) {
+            frames = s.toUInt();
+        } else if (optionValue(args, i, "--size", "-s", s)) {
+            QStringList wh = s.split('x');
+
+            if (wh.size() == 2) {
+                onlyWidth = wh[0].toUInt();
+                onlyHeight = wh[1].toUInt();
+            }
+            if (onlyWidth < 16 || onlyWidth > BENCH_MAX_WIDTH ||
+                onlyHeight < 16) {
+                printf("Invalid parameter for %s\n", args[i].toUtf8().data());
+                return 1;
+            }
+        } else if (optionValue(args, i, "--upload", NULL, s)) {
+            if (s == "direct") {
+                upload_mode = UploadDirect;
+            } else if (s == "pbo") {
+                upload_mode = UploadPBO;
+            } else {
+                printf("Invalid parameter for %s\n", args[i].toUtf8().data());
+                return 1;
+            }
+        } else {
+            printf("Invalid argument %s\n", args[i].toUtf8().data());
+            usage();
+            return 1;
+        }
+    }
+    if (frames == 0)
+        frames = 1;
+
+    format.setDepthBufferSize(24);
+    if (force_opengl)
+        format.setRenderableType(QSurfaceFormat::OpenGL);
+    else
+        format.setRenderableType(QSurfaceFormat::OpenGLES);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+    format.setVersion(3, 3);
+    QSurfaceFormat::setDefaultFormat(format);
+
+    CaptureWin win(NULL);
+    RagnaBench bench(&win, frames);
+
+    win.setVerbose(false);
+    win.setReportTimings(false);
+    win.setReportLatency(false);
+    win.setUploadMode(upload_mode);
+    win.setFormat(format);
+
+    /* initializeGL looks at the format, so start from a known one. */
+    cv4l_fmt fmt(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+    fmt.s_pixelformat(V4L2_PIX_FMT_RGB24);
+    fmt.s_width(640);
+    fmt.s_height(480);
+    fmt.s_field(V4L2_FIELD_NONE);
+    fmt.s_bytesperline(640 * 3);
+    fmt.s_sizeimage(640 * 480 * 3);
+    win.setV4LFormat(fmt);
+    win.resize(640, 480);
+    win.show();
+
+    /* Forces initializeGL, paintGL does nothing without a capture thread. */
+    win.grabFramebuffer();
+    if (win.context() == NULL || !win.context()->isValid()) {
+        fprintf(stderr, "Could not create an OpenGL context\n");
+        return 1;
+    }
+
+    for (unsigned f = 0; formats[f]; f++) {
+        if (onlyFormat && formats[f] != onlyFormat)
+            continue;
+
+        if (onlyWidth) {
+            bench.run(formats[f], onlyWidth, onlyHeight);
+            continue;
+        }
+        for (unsigned s = 0; benchSizes[s].width; s++)
+            bench.run(formats[f], benchSizes[s].width, benchSizes[s].height);
+    }
+    return 0;
+}
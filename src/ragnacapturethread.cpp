@@ -0,0 +1,247 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "ragnacapturethread.h"
+#include "ragnalatency.h"
+
+/* Don't grow more often than this, one gap can show up on several frames. */
+#define POOL_GROW_INTERVAL_NS 100000000ull
+/* Park one extra buffer after this long without any pressure. */
+#define POOL_SHRINK_AFTER_NS 5000000000ull
+
+RagnaCaptureThread::RagnaCaptureThread(cv4l_fd *fd, cv4l_queue *q)
+    : m_fd(fd),
+      m_queue(q),
+      m_baseBuffers(0),
+      m_maxBuffers(0),
+      m_queued(0),
+      m_pressure(false),
+      m_haveSequence(false),
+      m_lastSequence(0),
+      m_lastGrow(0),
+      m_calmSince(0),
+      m_parkWanted(0),
+      m_arena(0),
+      m_recorder(0)
+{
+}
+
+RagnaCaptureThread::~RagnaCaptureThread()
+{
+    stop();
+}
+
+bool RagnaCaptureThread::format(cv4l_fmt &fmt)
+{
+    return m_fd->g_fmt(fmt) == 0;
+}
+
+void RagnaCaptureThread::requeue(int index)
+{
+    if (m_parkWanted) {
+        m_parked.push_back(index);
+        m_parkWanted--;
+        return;
+    }
+
+    cv4l_buffer buf(*m_queue, index);
+
+    if (m_fd->qbuf(buf) == 0)
+        m_queued++;
+}
+
+void RagnaCaptureThread::requeueReleased()
+{
+    int index;
+
+    while (m_released.pop(index))
+        requeue(index);
+}
+
+/* Called for every dequeued buffer, before deciding what to do with it. */
+void RagnaCaptureThread::notePressure(const cv4l_buffer &buf)
+{
+    __u32 sequence = buf.g_sequence();
+
+    if (m_queued)
+        m_queued--;
+    if (m_queued == 0)
+        m_pressure = true;
+    if (m_haveSequence && sequence - m_lastSequence > 1)
+        m_pressure = true;
+    m_lastSequence = sequence;
+    m_haveSequence = true;
+}
+
+bool RagnaCaptureThread::growPool()
+{
+    unsigned from = m_queue->g_buffers();
+
+    if (m_queue->create_bufs(m_fd, 1) || m_queue->g_buffers() == from) {
+        fprintf(stderr, "Could not add capture buffers, staying at %u\n", from);
+        m_maxBuffers = from;
+        return false;
+    }
+    int err;
+
+    if (m_queue->g_memory() == V4L2_MEMORY_USERPTR && m_arena)
+        err = m_arena->obtainBufs(m_queue, from);
+    else
+        err = m_queue->obtain_bufs(m_fd, from);
+    if (err) {
+        fprintf(stderr, "Could not map the new capture buffers\n");
+        m_maxBuffers = from;
+        return false;
+    }
+
+    /* The renderer imports exported buffers, so export new ones too. */
+    if (m_queue->g_fd(0, 0) >= 0) {
+        for (unsigned b = from; b < m_queue->g_buffers(); b++) {
+            for (unsigned p = 0; p < m_queue->g_num_planes(); p++) {
+                v4l2_exportbuffer expbuf = {};
+
+                expbuf.type = m_queue->g_type();
+                expbuf.index = b;
+                expbuf.plane = p;
+                expbuf.flags = O_RDWR;
+                if (v4l_ioctl(m_fd->g_v4l_fd(), VIDIOC_EXPBUF, &expbuf) == 0)
+                    m_queue->s_fd(b, p, expbuf.fd);
+            }
+        }
+    }
+
+    for (unsigned b = from; b < m_queue->g_buffers(); b++)
+        requeue(b);
+    printf("Capture pool grew to %u buffers\n", m_queue->g_buffers());
+    return true;
+}
+
+void RagnaCaptureThread::adaptPool()
+{
+    uint64_t now = RagnaLatency::now();
+    bool pressure = m_pressure;
+
+    m_pressure = false;
+    if (pressure) {
+        m_calmSince = now;
+        if (m_parkWanted) {
+            /* Still waiting to park one, just don't. */
+            m_parkWanted--;
+        } else if (!m_parked.empty()) {
+            int index = m_parked.back();
+
+            m_parked.pop_back();
+            requeue(index);
+        } else if (m_queue->g_buffers() < m_maxBuffers &&
+                   now - m_lastGrow >= POOL_GROW_INTERVAL_NS) {
+            growPool();
+            m_lastGrow = now;
+        }
+        return;
+    }
+
+    unsigned active = m_queue->g_buffers() - m_parked.size() - m_parkWanted;
+
+    if (active > m_baseBuffers && now - m_calmSince >= POOL_SHRINK_AFTER_NS) {
+        m_parkWanted++;
+        m_calmSince = now;
+    }
+}
+
+void RagnaCaptureThread::dequeueEvents()
+{
+    v4l2_event ev;
+    bool changed = false;
+
+    while (m_fd->dqevent(ev) == 0)
+        if (ev.type == V4L2_EVENT_SOURCE_CHANGE)
+            changed = true;
+
+    if (changed)
+        emit sourceChanged();
+}
+
+void RagnaCaptureThread::dequeueFrames()
+{
+    cv4l_buffer buf(*m_queue);
+    unsigned buffers = m_queue->g_buffers() - m_parked.size();
+    /*
+     * The renderer always holds one buffer. Keep at least one more with
+     * the driver, and drop new frames instead of letting the ring take
+     * everything else when the renderer falls behind.
+     */
+    unsigned maxPending = buffers > 3 ? buffers - 2 : 1;
+
+    while (m_fd->dqbuf(buf) == 0) {
+        RagnaFrame frame;
+
+        notePressure(buf);
+        if (m_recorder)
+            m_recorder->submit(buf, m_queue);
+        if (m_ready.count() >= maxPending || !shouldDeliver()) {
+            requeue(buf.g_index());
+            continue;
+        }
+
+        frame.dequeued = RagnaLatency::now();
+        frame.timestamp = 0;
+        if (buf.g_timestamp_type() == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+            frame.timestamp = buf.g_timestamp_ns();
+        frame.index = buf.g_index();
+        frame.num_planes = m_queue->g_num_planes();
+        for (unsigned i = 0; i < frame.num_planes; i++) {
+            frame.data[i] = (__u8 *)m_queue->g_dataptr(frame.index, i);
+            frame.size[i] = buf.g_bytesused(i);
+        }
+        frame.converted = convertFrame(frame);
+
+        m_ready.push(frame);
+        emit frameReady();
+    }
+}
+
+void RagnaCaptureThread::run()
+{
+    struct pollfd fds[2];
+
+    fds[0].fd = m_fd->g_fd();
+    fds[0].events = POLLIN | POLLPRI;
+    fds[1].fd = m_wakeFd;
+    fds[1].events = POLLIN;
+
+    /* Everything was queued before streaming started. */
+    m_baseBuffers = m_queue->g_buffers();
+    m_queued = m_baseBuffers;
+    m_calmSince = RagnaLatency::now();
+
+    while (m_stop == false) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("capture poll");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+
+            if (read(m_wakeFd, &count, sizeof(count)) < 0) {
+                /* Raced with another read, nothing to drain. */
+            }
+        }
+
+        requeueReleased();
+
+        if (fds[0].revents & POLLPRI)
+            dequeueEvents();
+        if (fds[0].revents & POLLIN) {
+            dequeueFrames();
+            adaptPool();
+        }
+        else if (fds[0].revents & POLLERR)
+            /* Nothing is queued with the driver, wait for a release. */
+            poll(&fds[1], 1, 10);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef RAGNACAPTURETHREAD_H
+# define RAGNACAPTURETHREAD_H
+# include <vector>
+
+# include "cv4l-helpers.h"
+# include "ragnaarena.h"
+# include "ragnaframesink.h"
+# include "ragnaframesource.h"
+
+/*
+ * Dequeues buffers from the capture device on its own thread so that a
+ * busy GUI thread can't starve the driver. Frame indices are buffer
+ * indices, and released buffers are queued again from this thread so
+ * that only it ever calls qbuf/dqbuf.
+ */
+class RagnaCaptureThread : public RagnaFrameSource
+{
+public:
+    RagnaCaptureThread(cv4l_fd *, cv4l_queue *);
+    ~RagnaCaptureThread();
+
+    bool format(cv4l_fmt &fmt) override;
+    void setMaxBuffers(unsigned max) { m_maxBuffers = max; }
+    void setArena(RagnaArena *arena) { m_arena = arena; }
+    void setRecorder(RagnaFrameSink *recorder) { m_recorder = recorder; }
+
+private:
+    void run() override;
+    void dequeueEvents();
+    void dequeueFrames();
+    void requeueReleased();
+    void requeue(int index);
+    void notePressure(const cv4l_buffer &);
+    void adaptPool();
+    bool growPool();
+
+    cv4l_fd *m_fd;
+    cv4l_queue *m_queue;
+
+    /*
+     * The pool grows with CREATE_BUFS when the driver runs dry or skips
+     * sequence numbers. There's no way to free buffers while streaming, so
+     * when things calm down the extra ones are parked instead: kept out of
+     * the queue until they are needed again.
+     */
+    unsigned m_baseBuffers;
+    unsigned m_maxBuffers;
+    unsigned m_queued;
+    bool m_pressure;
+    bool m_haveSequence;
+    __u32 m_lastSequence;
+    uint64_t m_lastGrow;
+    uint64_t m_calmSince;
+    unsigned m_parkWanted;
+    std::vector<int> m_parked;
+    /* USERPTR buffers added while streaming come from here, if set. */
+    RagnaArena *m_arena;
+    /* Sees every dequeued frame, even those the display skips. */
+    RagnaFrameSink *m_recorder;
+};
+
+#endif
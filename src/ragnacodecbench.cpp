@@ -0,0 +1,481 @@
+#include <QCoreApplication>
+#include <QStringList>
+#include <QThreadPool>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "ragnacodecslices.h"
+#include "ragnalatency.h"
+#include "v4l-stream.h"
+#include "v4l2-info.h"
+
+extern "C" {
+#include "v4l2-tpg.h"
+}
+
+#define BENCH_MAX_WIDTH 3840
+/*
+ * Well below what the codec does at the default QP, falling under it
+ * means the codec broke, not that it got a little worse.
+ */
+#define BENCH_MIN_PSNR 30
+
+static const struct {
+    unsigned width;
+    unsigned height;
+} benchSizes[] = {
+    /*
+     * Macroblock rows that don't fill the last slice, and 4:2:0 chroma
+     * planes that end in half a macroblock row.
+     */
+    { 176, 136 },
+    { 640, 480 },
+    { 1920, 1080 },
+    { 0, 0 }
+};
+
+/*
+ * From content every P frame can skip to content that doesn't compress
+ * at all, which is stored unencoded, and all of them mixed.
+ */
+static const struct {
+    const char *name;
+    enum tpg_pattern pattern;
+    enum tpg_move_mode move;
+    bool mixed;
+} benchContent[] = {
+    { "bars", TPG_PAT_75_COLORBAR, TPG_MOVE_NONE, false },
+    { "moving", TPG_PAT_100_COLORSQUARES, TPG_MOVE_POS_FAST, false },
+    { "noise", TPG_PAT_NOISE, TPG_MOVE_NONE, false },
+    { "mixed", TPG_PAT_NOISE, TPG_MOVE_NONE, true },
+    { NULL, TPG_PAT_NOISE, TPG_MOVE_NONE, false }
+};
+
+/*
+ * The content of the mixed frames, in turn. Noise comes between frames
+ * that skip blocks within a GOP, which is 10 frames long by default, so
+ * the frames after an unencoded one have to pick up from it.
+ */
+static const unsigned benchMix[] = { 0, 2, 0, 1, 2, 1 };
+
+/* Slice heights the output must not depend on, in macroblock rows. */
+static const unsigned benchSliceRows[] = { 1, 3, 8, 0 };
+
+struct CodecRun
+{
+    bool ok;
+    uint64_t encodeNs;
+    uint64_t decodeNs;
+    uint64_t compBytes;
+    double sqErr;
+    /* Of every compressed and decoded frame, to compare runs. */
+    uint64_t hash;
+};
+
+/*
+ * Encodes and decodes test pattern frames for every pixel format the
+ * FWHT codec supports, timing fwht_compress(), fwht_decompress() and the
+ * RLE used for uncompressed streams. Every run with another instruction
+ * set or slice height has to give the same bytes as the plain C encoder
+ * and decoder on a single thread, and the RLE round trip has to be exact.
+ */
+class RagnaCodecBench
+{
+public:
+    RagnaCodecBench(unsigned frames, unsigned sliceRows, bool conformance);
+    ~RagnaCodecBench();
+
+    bool run(const v4l2_fwht_pixfmt_info *info, unsigned width, unsigned height);
+
+private:
+    bool setupFormat(const v4l2_fwht_pixfmt_info *info, unsigned width, unsigned height);
+    void generate(unsigned content);
+    bool codecFrames(codec_ctx *enc, codec_ctx *dec, CodecRun &res);
+    CodecRun codec(enum fwht_simd simd, unsigned sliceRows);
+    bool rle(uint64_t &compressNs, uint64_t &decompressNs, uint64_t &rleBytes);
+
+    unsigned m_frames;
+    unsigned m_sliceRows;
+    bool m_conformance;
+    struct tpg_data m_tpg;
+    const v4l2_fwht_pixfmt_info *m_info;
+    unsigned m_width;
+    unsigned m_height;
+    unsigned m_size;
+    std::vector<std::vector<__u8> > m_raw;
+    std::vector<__u8> m_decoded;
+    std::vector<__u32> m_rle;
+};
+
+static uint64_t hash(uint64_t h, const __u8 *p, unsigned size)
+{
+    for (unsigned i = 0; i < size; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+static double squaredError(const __u8 *a, const __u8 *b, unsigned size)
+{
+    uint64_t sum = 0;
+
+    for (unsigned i = 0; i < size; i++) {
+        int d = a[i] - b[i];
+
+        sum += d * d;
+    }
+    return sum;
+}
+
+RagnaCodecBench::RagnaCodecBench(unsigned frames, unsigned sliceRows, bool conformance)
+    : m_frames(frames),
+      m_sliceRows(sliceRows),
+      m_conformance(conformance),
+      m_info(NULL),
+      m_width(0),
+      m_height(0),
+      m_size(0)
+{
+    tpg_init(&m_tpg, 640, 480);
+    tpg_alloc(&m_tpg, BENCH_MAX_WIDTH);
+}
+
+RagnaCodecBench::~RagnaCodecBench()
+{
+    tpg_free(&m_tpg);
+}
+
+bool RagnaCodecBench::setupFormat(const v4l2_fwht_pixfmt_info *info,
+                                  unsigned width, unsigned height)
+{
+    if (!tpg_s_fourcc(&m_tpg, info->id) || tpg_g_buffers(&m_tpg) > 1)
+        return false;
+
+    tpg_reset_source(&m_tpg, width, height, V4L2_FIELD_NONE);
+
+    unsigned size = 0;
+
+    for (unsigned p = 0; p < tpg_g_planes(&m_tpg); p++)
+        size += tpg_calc_plane_size(&m_tpg, p);
+
+    /* The codec wants the planes back to back without padding. */
+    if (tpg_g_bytesperline(&m_tpg, 0) != width * info->bytesperline_mult ||
+        size != width * height * info->sizeimage_mult / info->sizeimage_div)
+        return false;
+
+    m_info = info;
+    m_width = width;
+    m_height = height;
+    m_size = size;
+    m_decoded.resize(size);
+    m_rle.resize((size + 3) / 4);
+    return true;
+}
+
+void RagnaCodecBench::generate(unsigned content)
+{
+    /* The same noise for every run, format and size. */
+    srand(1);
+    tpg_s_mv_vert_mode(&m_tpg, TPG_MOVE_NONE);
+    tpg_init_mv_count(&m_tpg);
+
+    m_raw.resize(m_frames);
+    for (unsigned i = 0; i < m_frames; i++) {
+        unsigned c = content;
+
+        if (benchContent[content].mixed)
+            c = benchMix[i % (sizeof(benchMix) / sizeof(benchMix[0]))];
+        tpg_s_pattern(&m_tpg, benchContent[c].pattern);
+        tpg_s_mv_hor_mode(&m_tpg, benchContent[c].move);
+        m_raw[i].resize(m_size);
+        tpg_fillbuffer(&m_tpg, 0, 0, m_raw[i].data());
+        tpg_update_mv_count(&m_tpg, false);
+    }
+}
+
+bool RagnaCodecBench::codecFrames(codec_ctx *enc, codec_ctx *dec, CodecRun &res)
+{
+    for (std::vector<__u8> &frame : m_raw) {
+        uint64_t start = RagnaLatency::now();
+        unsigned compSize;
+        __u8 *comp = fwht_compress(enc, frame.data(), m_size, &compSize);
+        uint64_t encoded = RagnaLatency::now();
+
+        /* v4l2_fwht_encode failed, its error came back as a size. */
+        if ((int)compSize < 0 || compSize > enc->comp_max_size) {
+            fprintf(stderr, "Encoding failed\n");
+            return false;
+        }
+        if (!fwht_decompress(dec, comp, compSize, m_decoded.data(), m_size)) {
+            fprintf(stderr, "Decoding failed\n");
+            return false;
+        }
+
+        uint64_t decoded = RagnaLatency::now();
+
+        res.encodeNs += encoded - start;
+        res.decodeNs += decoded - encoded;
+        res.compBytes += compSize;
+        res.sqErr += squaredError(frame.data(), m_decoded.data(), m_size);
+        res.hash = hash(res.hash, comp, compSize);
+        res.hash = hash(res.hash, m_decoded.data(), m_size);
+    }
+    return true;
+}
+
+CodecRun RagnaCodecBench::codec(enum fwht_simd simd, unsigned sliceRows)
+{
+    CodecRun res = { false, 0, 0, 0, 0, 1469598103934665603ULL };
+    codec_ctx *enc = fwht_alloc(m_info->id, m_width, m_height, m_width, m_height,
+                                V4L2_FIELD_NONE, V4L2_COLORSPACE_SRGB,
+                                V4L2_XFER_FUNC_SRGB, V4L2_YCBCR_ENC_601,
+                                V4L2_QUANTIZATION_LIM_RANGE);
+    codec_ctx *dec = fwht_alloc(m_info->id, m_width, m_height, m_width, m_height,
+                                V4L2_FIELD_NONE, V4L2_COLORSPACE_SRGB,
+                                V4L2_XFER_FUNC_SRGB, V4L2_YCBCR_ENC_601,
+                                V4L2_QUANTIZATION_LIM_RANGE);
+    enum fwht_simd prevSimd = fwht_get_simd();
+
+    fwht_set_simd(simd);
+    if (!enc || !dec) {
+        fprintf(stderr, "Could not allocate the codec\n");
+    } else if (sliceRows &&
+               (!RagnaCodecSlices::enable(enc, QThreadPool::globalInstance(), sliceRows) ||
+                !RagnaCodecSlices::enable(dec, QThreadPool::globalInstance(), sliceRows))) {
+        fprintf(stderr, "Could not allocate the slices\n");
+    } else {
+        res.ok = codecFrames(enc, dec, res);
+    }
+
+    fwht_set_simd(prevSimd);
+    if (enc)
+        fwht_free(enc);
+    if (dec)
+        fwht_free(dec);
+    return res;
+}
+
+bool RagnaCodecBench::rle(uint64_t &compressNs, uint64_t &decompressNs, uint64_t &rleBytes)
+{
+    unsigned bpl = rle_calc_bpl(m_width * m_info->bytesperline_mult, m_info->id);
+    __u8 *buf = (__u8 *)m_rle.data();
+
+    compressNs = decompressNs = rleBytes = 0;
+    for (std::vector<__u8> &frame : m_raw) {
+        memcpy(buf, frame.data(), m_size);
+
+        uint64_t start = RagnaLatency::now();
+        unsigned size = rle_compress(buf, m_size, bpl);
+        uint64_t compressed = RagnaLatency::now();
+
+        /* The receiving end reads it into the end of the frame buffer. */
+        memmove(buf + m_size - size, buf, size);
+        compressed = RagnaLatency::now();
+        rle_decompress(buf, m_size, size, bpl);
+
+        uint64_t decompressed = RagnaLatency::now();
+
+        compressNs += compressed - start;
+        decompressNs += decompressed - compressed;
+        rleBytes += size;
+        if (memcmp(buf, frame.data(), m_size))
+            return false;
+    }
+    return true;
+}
+
+bool RagnaCodecBench::run(const v4l2_fwht_pixfmt_info *info, unsigned width, unsigned height)
+{
+    bool ok = true;
+
+    /* Chroma planes have to be whole macroblocks wide, see fwht_set_format(). */
+    if (width % (8 * info->width_div)) {
+        printf("%-8s %5ux%-5u skipped (the codec can't do this width)\n",
+               fcc2s(info->id).c_str(), width, height);
+        return true;
+    }
+    if (!setupFormat(info, width, height)) {
+        printf("%-8s %5ux%-5u skipped (no test pattern for this format)\n",
+               fcc2s(info->id).c_str(), width, height);
+        return true;
+    }
+
+    /* 8x8 blocks, luma, chroma and alpha alike. */
+    double blocks = (double)m_frames * m_size / 64;
+    double mb = (double)m_frames * m_size / 1e6;
+
+    for (unsigned c = 0; benchContent[c].name; c++) {
+        uint64_t rleNs, unrleNs, rleBytes;
+        const char *fail = NULL;
+
+        printf("%-8s %5ux%-5u %-7s", fcc2s(info->id).c_str(), width, height,
+               benchContent[c].name);
+        fflush(stdout);
+        generate(c);
+
+        CodecRun timed = codec(fwht_get_simd(), m_sliceRows);
+        double psnr = timed.sqErr ? 10 * log10(255.0 * 255 * m_frames * m_size / timed.sqErr) : 99;
+
+        if (!timed.ok)
+            fail = "codec error";
+        else if (psnr < BENCH_MIN_PSNR)
+            fail = "PSNR too low";
+        else if (!rle(rleNs, unrleNs, rleBytes))
+            fail = "RLE round trip differs";
+
+        if (!fail && m_conformance) {
+            CodecRun ref = codec(FWHT_SIMD_NONE, 0);
+
+            for (int simd = FWHT_SIMD_NONE; simd <= fwht_simd_supported() && !fail; simd++) {
+                for (unsigned r = 0; benchSliceRows[r] && !fail; r++) {
+                    CodecRun cur = codec((enum fwht_simd)simd, benchSliceRows[r]);
+
+                    if (!cur.ok || cur.hash != ref.hash) {
+                        fprintf(stderr, "%s with slices of %u rows differs from C\n",
+                                fwht_simd_name((enum fwht_simd)simd), benchSliceRows[r]);
+                        fail = "not conformant";
+                    }
+                }
+            }
+            if (ref.hash != timed.hash)
+                fail = "not conformant";
+        }
+
+        if (fail) {
+            printf(" FAILED: %s\n", fail);
+            ok = false;
+            continue;
+        }
+        printf(" enc %7.1f MB/s %6.1f ns/blk  dec %7.1f MB/s %6.1f ns/blk"
+               "  %5.1fx %5.1f dB  rle %7.1f / %7.1f MB/s %5.1fx\n",
+               mb * 1e9 / timed.encodeNs, timed.encodeNs / blocks,
+               mb * 1e9 / timed.decodeNs, timed.decodeNs / blocks,
+               (double)m_frames * m_size / timed.compBytes, psnr,
+               rleNs ? mb * 1e9 / rleNs : 0.0, unrleNs ? mb * 1e9 / unrleNs : 0.0,
+               (double)m_frames * m_size / rleBytes);
+    }
+    return ok;
+}
+
+static void usage()
+{
+    puts("Usage: ragna-codec-bench <options>\n\n"
+         "Encodes and decodes test pattern frames with the FWHT codec for\n"
+         "every pixel format it supports, at several resolutions, and\n"
+         "reports throughput, time per 8x8 block, compression ratio and\n"
+         "PSNR, and the same for the RLE of uncompressed streams. Every\n"
+         "instruction set and slice height is checked against the plain C\n"
+         "codec, the exit status is 1 if anything failed.\n\n"
+         "Options:\n\n"
+         "  -f, --format=<fourcc>    only benchmark this pixel format\n"
+         "  -n, --frames=<n>         frames per format, size and pattern (default 10)\n"
+         "  -s, --size=<w>x<h>       only benchmark this resolution\n"
+         "  --simd=<set>             time with none, sse4.1 or avx2 (default: the best one)\n"
+         "  --slices=<rows>          time with slices of this many macroblock rows\n"
+         "                           (default: 0, on a single thread)\n"
+         "  --no-conformance         only time, don't compare with the C codec\n"
+         "  -h, --help               display this help message");
+}
+
+static bool optionValue(const QStringList &args, int &i, const char *longOpt,
+                        const char *shortOpt, QString &value)
+{
+    const QString &arg = args[i];
+
+    if (arg.startsWith(QString(longOpt) + "=")) {
+        value = arg.mid(strlen(longOpt) + 1);
+        return true;
+    }
+    if (arg == shortOpt && i + 1 < args.size()) {
+        value = args[++i];
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments();
+    __u32 onlyFormat = 0;
+    unsigned onlyWidth = 0;
+    unsigned onlyHeight = 0;
+    unsigned frames = 10;
+    unsigned sliceRows = 0;
+    bool conformance = true;
+    bool ok = true;
+
+    for (int i = 1; i < args.size(); i++) {
+        QString s;
+
+        if (args[i] == "--help" || args[i] == "-h") {
+            usage();
+            return 0;
+        } else if (args[i] == "--no-conformance") {
+            conformance = false;
+        } else if (optionValue(args, i, "--format", "-f", s)) {
+            QByteArray fcc = s.toLatin1().leftJustified(4, ' ');
+
+            onlyFormat = v4l2_fourcc(fcc[0], fcc[1], fcc[2], fcc[3]);
+            if (!v4l2_fwht_find_pixfmt(onlyFormat)) {
+                printf("Invalid parameter for %s\n", args[i].toUtf8().data());
+                return 1;
+            }
+        } else if (optionValue(args, i, "--frames", "-n", s)) {
+            frames = s.toUInt();
+        } else if (optionValue(args, i, "--size", "-s", s)) {
+            QStringList wh = s.split('x');
+
+            if (wh.size() == 2) {
+                onlyWidth = wh[0].toUInt();
+                onlyHeight = wh[1].toUInt();
+            }
+            /* The codec only does whole macroblocks. */
+            if (onlyWidth < 16 || onlyWidth > BENCH_MAX_WIDTH || onlyWidth % 8 ||
+                onlyHeight < 16 || onlyHeight % 8) {
+                printf("Invalid parameter for %s\n", args[i].toUtf8().data());
+                return 1;
+            }
+        } else if (optionValue(args, i, "--simd", NULL, s)) {
+            int simd;
+
+            for (simd = FWHT_SIMD_AVX2; simd > FWHT_SIMD_NONE; simd--)
+                if (s == fwht_simd_name((enum fwht_simd)simd))
+                    break;
+            if (simd == FWHT_SIMD_NONE && s != fwht_simd_name(FWHT_SIMD_NONE)) {
+                printf("Invalid parameter for %s\n", args[i].toUtf8().data());
+                return 1;
+            }
+            if (fwht_set_simd((enum fwht_simd)simd) != simd) {
+                printf("%s is not supported by this CPU\n", s.toUtf8().data());
+                return 1;
+            }
+        } else if (optionValue(args, i, "--slices", NULL, s)) {
+            sliceRows = s.toUInt();
+        } else {
+            printf("Invalid argument %s\n", args[i].toUtf8().data());
+            usage();
+            return 1;
+        }
+    }
+    if (frames == 0)
+        frames = 1;
+
+    RagnaCodecBench bench(frames, sliceRows, conformance);
+    const v4l2_fwht_pixfmt_info *info;
+
+    printf("Timing with %s, %s\n", fwht_simd_name(fwht_get_simd()),
+           sliceRows ? "in slices" : "on a single thread");
+    for (unsigned f = 0; (info = v4l2_fwht_get_pixfmt(f)); f++) {
+        if (onlyFormat && info->id != onlyFormat)
+            continue;
+
+        if (onlyWidth) {
+            ok &= bench.run(info, onlyWidth, onlyHeight);
+            continue;
+        }
+        for (unsigned s = 0; benchSizes[s].width; s++)
+            ok &= bench.run(info, benchSizes[s].width, benchSizes[s].height);
+    }
+    return ok ? 0 : 1;
+}
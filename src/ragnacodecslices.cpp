@@ -0,0 +1,49 @@
+#include <atomic>
+#include <memory>
+#include <QSemaphore>
+
+#include "ragnacodecslices.h"
+#include "v4l-stream.h"
+
+/* Rows of macroblocks per slice, 64 lines of luma. */
+#define SLICE_ROWS 8
+
+struct SliceRun
+{
+    void (*job)(void *arg, unsigned i);
+    void *arg;
+    unsigned count;
+    std::atomic<unsigned> next;
+    QSemaphore done;
+};
+
+static void runSlices(const std::shared_ptr<SliceRun> &run)
+{
+    for (unsigned i = run->next++; i < run->count; i = run->next++) {
+        run->job(run->arg, i);
+        run->done.release();
+    }
+}
+
+bool RagnaCodecSlices::enable(codec_ctx *ctx, QThreadPool *pool, unsigned rows)
+{
+    return fwht_set_slices(ctx, run, pool, rows ? rows : SLICE_ROWS);
+}
+
+void RagnaCodecSlices::run(void *pool, void (*job)(void *arg, unsigned i),
+                           void *arg, unsigned count)
+{
+    QThreadPool *threads = static_cast<QThreadPool *>(pool);
+    std::shared_ptr<SliceRun> slices = std::make_shared<SliceRun>();
+
+    slices->job = job;
+    slices->arg = arg;
+    slices->count = count;
+    slices->next = 0;
+    for (unsigned i = 1; i < count; i++)
+        if (!threads->tryStart([slices] { runSlices(slices); }))
+            break;
+    runSlices(slices);
+    // Helpers that start late find nothing left, and only touch slices.
+    slices->done.acquire(count);
+}
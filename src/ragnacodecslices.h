@@ -0,0 +1,25 @@
+#ifndef RAGNACODECSLICES_H
+# define RAGNACODECSLICES_H
+# include <QThreadPool>
+
+struct codec_ctx;
+
+/*
+ * Lets an FWHT codec context encode and decode frames in slices, on the
+ * calling thread and whichever threads of a pool are idle at the time.
+ * Helpers are never queued behind other work, so using the pool from
+ * one of its own threads can't deadlock, and whatever the helpers don't
+ * get to is done by the caller.
+ */
+class RagnaCodecSlices
+{
+public:
+    /* Rows of macroblocks per slice, 0 for the default. */
+    static bool enable(codec_ctx *ctx, QThreadPool *pool, unsigned rows = 0);
+
+private:
+    static void run(void *pool, void (*job)(void *arg, unsigned i),
+                    void *arg, unsigned count);
+};
+
+#endif
@@ -0,0 +1,481 @@
+#include <stdint.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "ragnaconvert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# define RAGNA_CONVERT_X86
+# include <immintrin.h>
+#endif
+
+enum ConvertKind {
+    Unpack1555,     /* GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV */
+    Unpack1555BE,   /* The same, with GL_UNPACK_SWAP_BYTES */
+    Unpack5551,     /* GL_BGRA, GL_UNSIGNED_SHORT_5_5_5_1 */
+    Unpack332,      /* GL_RGB, GL_UNSIGNED_BYTE_3_3_2 */
+    Unpack8888Rev,  /* GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV */
+    Swap565,        /* GL_RGB, GL_UNSIGNED_SHORT_5_6_5 with swapped bytes */
+    ConvertKinds
+};
+
+typedef void (*RowFunc)(const __u8 *src, __u8 *dst, unsigned width);
+
+/*
+ * GL normalizes a 5 bit channel to v / 31, then rounds it to 8 bits. This is
+ * round(v * 255 / 31) for all 32 values, replicating the top bits instead is
+ * off by one for 3, 7, 24 and 28.
+ */
+static inline unsigned expand5(unsigned v)
+{
+    return (v * 527 + 23) >> 6;
+}
+
+/*
+ * Scalar versions. These handle whole rows on CPUs without SIMD support
+ * and the pixels left over at the end of each row otherwise.
+ */
+
+static void row1555(const __u8 *src, __u8 *dst, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++, src += 2, dst += 4) {
+        unsigned v = src[0] | (src[1] << 8);
+
+        dst[0] = expand5((v >> 10) & 31);
+        dst[1] = expand5((v >> 5) & 31);
+        dst[2] = expand5(v & 31);
+        dst[3] = (v & 0x8000) ? 255 : 0;
+    }
+}
+
+static void row1555BE(const __u8 *src, __u8 *dst, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++, src += 2, dst += 4) {
+        unsigned v = (src[0] << 8) | src[1];
+
+        dst[0] = expand5((v >> 10) & 31);
+        dst[1] = expand5((v >> 5) & 31);
+        dst[2] = expand5(v & 31);
+        dst[3] = (v & 0x8000) ? 255 : 0;
+    }
+}
+
+static void row5551(const __u8 *src, __u8 *dst, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++, src += 2, dst += 4) {
+        unsigned v = src[0] | (src[1] << 8);
+
+        dst[0] = expand5((v >> 1) & 31);
+        dst[1] = expand5((v >> 6) & 31);
+        dst[2] = expand5(v >> 11);
+        dst[3] = (v & 1) ? 255 : 0;
+    }
+}
+
+static void row332(const __u8 *src, __u8 *dst, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++, src++, dst += 4) {
+        unsigned v = src[0];
+
+        dst[0] = ((v >> 5) * 73) >> 1;
+        dst[1] = (((v >> 2) & 7) * 73) >> 1;
+        dst[2] = (v & 3) * 85;
+        dst[3] = 255;
+    }
+}
+
+static void row8888Rev(const __u8 *src, __u8 *dst, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++, src += 4, dst += 4) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = src[3];
+    }
+}
+
+static void rowSwap565(const __u8 *src, __u8 *dst, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++, src += 2, dst += 2) {
+        dst[0] = src[1];
+        dst[1] = src[0];
+    }
+}
+
+static const RowFunc scalarRows[ConvertKinds] = {
+    row1555,
+    row1555BE,
+    row5551,
+    row332,
+    row8888Rev,
+    rowSwap565,
+};
+
+#ifdef RAGNA_CONVERT_X86
+
+/*
+ * The SIMD versions work on 16 bit lanes holding one channel each, then
+ * interleave r|g<<8 with b|a<<8 into RGBA8. Results are identical to the
+ * scalar code.
+ */
+
+# define SSE __attribute__((target("sse4.1")))
+# define AVX2 __attribute__((target("avx2")))
+
+SSE static inline __m128i sseExpand5(__m128i v)
+{
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(527)),
+                                        _mm_set1_epi16(23)), 6);
+}
+
+SSE static inline void sseStoreRGBA(__u8 *dst, __m128i r, __m128i g,
+                                    __m128i b, __m128i a)
+{
+    __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+    __m128i ba = _mm_or_si128(b, _mm_slli_epi16(a, 8));
+
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(rg, ba));
+}
+
+SSE static inline void sse1555(__m128i v, __u8 *dst)
+{
+    __m128i m5 = _mm_set1_epi16(31);
+
+    sseStoreRGBA(dst,
+                 sseExpand5(_mm_and_si128(_mm_srli_epi16(v, 10), m5)),
+                 sseExpand5(_mm_and_si128(_mm_srli_epi16(v, 5), m5)),
+                 sseExpand5(_mm_and_si128(v, m5)),
+                 _mm_and_si128(_mm_srai_epi16(v, 15), _mm_set1_epi16(0xff)));
+}
+
+SSE static void sseRow1555(const __u8 *src, __u8 *dst, unsigned width)
+{
+    unsigned x = 0;
+
+    for (; x + 8 <= width; x += 8, src += 16, dst += 32)
+        sse1555(_mm_loadu_si128((const __m128i *)src), dst);
+    row1555(src, dst, width - x);
+}
+
+SSE static void sseRow1555BE(const __u8 *src, __u8 *dst, unsigned width)
+{
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                       9, 8, 11, 10, 13, 12, 15, 14);
+    unsigned x = 0;
+
+    for (; x + 8 <= width; x += 8, src += 16, dst += 32)
+        sse1555(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), swap),
+                dst);
+    row1555BE(src, dst, width - x);
+}
+
+SSE static void sseRow5551(const __u8 *src, __u8 *dst, unsigned width)
+{
+    __m128i m5 = _mm_set1_epi16(31);
+    __m128i one = _mm_set1_epi16(1);
+    unsigned x = 0;
+
+    for (; x + 8 <= width; x += 8, src += 16, dst += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+        sseStoreRGBA(dst,
+                     sseExpand5(_mm_and_si128(_mm_srli_epi16(v, 1), m5)),
+                     sseExpand5(_mm_and_si128(_mm_srli_epi16(v, 6), m5)),
+                     sseExpand5(_mm_srli_epi16(v, 11)),
+                     _mm_mullo_epi16(_mm_and_si128(v, one),
+                                     _mm_set1_epi16(255)));
+    }
+    row5551(src, dst, width - x);
+}
+
+SSE static inline void sse332(__m128i v, __u8 *dst)
+{
+    __m128i m3 = _mm_set1_epi16(7);
+    __m128i x73 = _mm_set1_epi16(73);
+
+    sseStoreRGBA(dst,
+                 _mm_srli_epi16(_mm_mullo_epi16(_mm_srli_epi16(v, 5), x73), 1),
+                 _mm_srli_epi16(_mm_mullo_epi16(
+                     _mm_and_si128(_mm_srli_epi16(v, 2), m3), x73), 1),
+                 _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi16(3)),
+                                 _mm_set1_epi16(85)),
+                 _mm_set1_epi16(255));
+}
+
+SSE static void sseRow332(const __u8 *src, __u8 *dst, unsigned width)
+{
+    unsigned x = 0;
+
+    for (; x + 16 <= width; x += 16, src += 16, dst += 64) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+        sse332(_mm_cvtepu8_epi16(v), dst);
+        sse332(_mm_cvtepu8_epi16(_mm_srli_si128(v, 8)), dst + 32);
+    }
+    row332(src, dst, width - x);
+}
+
+SSE static void sseRow8888Rev(const __u8 *src, __u8 *dst, unsigned width)
+{
+    const __m128i shuf = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                       10, 9, 8, 11, 14, 13, 12, 15);
+    unsigned x = 0;
+
+    for (; x + 4 <= width; x += 4, src += 16, dst += 16)
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src),
+                                          shuf));
+    row8888Rev(src, dst, width - x);
+}
+
+SSE static void sseRowSwap565(const __u8 *src, __u8 *dst, unsigned width)
+{
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                       9, 8, 11, 10, 13, 12, 15, 14);
+    unsigned x = 0;
+
+    for (; x + 8 <= width; x += 8, src += 16, dst += 16)
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src),
+                                          swap));
+    rowSwap565(src, dst, width - x);
+}
+
+static const RowFunc sseRows[ConvertKinds] = {
+    sseRow1555,
+    sseRow1555BE,
+    sseRow5551,
+    sseRow332,
+    sseRow8888Rev,
+    sseRowSwap565,
+};
+
+AVX2 static inline __m256i avxExpand5(__m256i v)
+{
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(v, _mm256_set1_epi16(527)),
+                                              _mm256_set1_epi16(23)), 6);
+}
+
+AVX2 static inline void avxStoreRGBA(__u8 *dst, __m256i r, __m256i g,
+                                     __m256i b, __m256i a)
+{
+    __m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+    __m256i ba = _mm256_or_si256(b, _mm256_slli_epi16(a, 8));
+    /* unpack works within each 128 bit lane, put the pixels back in order */
+    __m256i lo = _mm256_unpacklo_epi16(rg, ba);
+    __m256i hi = _mm256_unpackhi_epi16(rg, ba);
+
+    _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 32),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+AVX2 static inline void avx1555(__m256i v, __u8 *dst)
+{
+    __m256i m5 = _mm256_set1_epi16(31);
+
+    avxStoreRGBA(dst,
+                 avxExpand5(_mm256_and_si256(_mm256_srli_epi16(v, 10), m5)),
+                 avxExpand5(_mm256_and_si256(_mm256_srli_epi16(v, 5), m5)),
+                 avxExpand5(_mm256_and_si256(v, m5)),
+                 _mm256_and_si256(_mm256_srai_epi16(v, 15),
+                                  _mm256_set1_epi16(0xff)));
+}
+
+AVX2 static void avxRow1555(const __u8 *src, __u8 *dst, unsigned width)
+{
+    unsigned x = 0;
+
+    for (; x + 16 <= width; x += 16, src += 32, dst += 64)
+        avx1555(_mm256_loadu_si256((const __m256i *)src), dst);
+    sseRow1555(src, dst, width - x);
+}
+
+AVX2 static void avxRow1555BE(const __u8 *src, __u8 *dst, unsigned width)
+{
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                          9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6,
+                                          9, 8, 11, 10, 13, 12, 15, 14);
+    unsigned x = 0;
+
+    for (; x + 16 <= width; x += 16, src += 32, dst += 64)
+        avx1555(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)src),
+                                    swap), dst);
+    sseRow1555BE(src, dst, width - x);
+}
+
+AVX2 static void avxRow5551(const __u8 *src, __u8 *dst, unsigned width)
+{
+    __m256i m5 = _mm256_set1_epi16(31);
+    __m256i one = _mm256_set1_epi16(1);
+    unsigned x = 0;
+
+    for (; x + 16 <= width; x += 16, src += 32, dst += 64) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+
+        avxStoreRGBA(dst,
+                     avxExpand5(_mm256_and_si256(_mm256_srli_epi16(v, 1), m5)),
+                     avxExpand5(_mm256_and_si256(_mm256_srli_epi16(v, 6), m5)),
+                     avxExpand5(_mm256_srli_epi16(v, 11)),
+                     _mm256_mullo_epi16(_mm256_and_si256(v, one),
+                                        _mm256_set1_epi16(255)));
+    }
+    sseRow5551(src, dst, width - x);
+}
+
+AVX2 static void avxRow332(const __u8 *src, __u8 *dst, unsigned width)
+{
+    __m256i m3 = _mm256_set1_epi16(7);
+    __m256i x73 = _mm256_set1_epi16(73);
+    unsigned x = 0;
+
+    for (; x + 16 <= width; x += 16, src += 16, dst += 64) {
+        __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)src));
+
+        avxStoreRGBA(dst,
+                     _mm256_srli_epi16(_mm256_mullo_epi16(
+                         _mm256_srli_epi16(v, 5), x73), 1),
+                     _mm256_srli_epi16(_mm256_mullo_epi16(
+                         _mm256_and_si256(_mm256_srli_epi16(v, 2), m3), x73), 1),
+                     _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi16(3)),
+                                        _mm256_set1_epi16(85)),
+                     _mm256_set1_epi16(255));
+    }
+    row332(src, dst, width - x);
+}
+
+AVX2 static void avxRow8888Rev(const __u8 *src, __u8 *dst, unsigned width)
+{
+    const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15,
+                                          2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15);
+    unsigned x = 0;
+
+    for (; x + 8 <= width; x += 8, src += 32, dst += 32)
+        _mm256_storeu_si256((__m256i *)dst,
+                            _mm256_shuffle_epi8(
+                                _mm256_loadu_si256((const __m256i *)src), shuf));
+    sseRow8888Rev(src, dst, width - x);
+}
+
+AVX2 static void avxRowSwap565(const __u8 *src, __u8 *dst, unsigned width)
+{
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                          9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6,
+                                          9, 8, 11, 10, 13, 12, 15, 14);
+    unsigned x = 0;
+
+    for (; x + 16 <= width; x += 16, src += 32, dst += 32)
+        _mm256_storeu_si256((__m256i *)dst,
+                            _mm256_shuffle_epi8(
+                                _mm256_loadu_si256((const __m256i *)src), swap));
+    sseRowSwap565(src, dst, width - x);
+}
+
+static const RowFunc avxRows[ConvertKinds] = {
+    avxRow1555,
+    avxRow1555BE,
+    avxRow5551,
+    avxRow332,
+    avxRow8888Rev,
+    avxRowSwap565,
+};
+
+#endif
+
+static const RowFunc *rowFuncs(const char **name = 0)
+{
+    static const RowFunc *rows;
+    static const char *rowsName;
+
+    if (rows == 0) {
+        rows = scalarRows;
+        rowsName = "scalar";
+#ifdef RAGNA_CONVERT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            rows = avxRows;
+            rowsName = "AVX2";
+        } else if (__builtin_cpu_supports("sse4.1")) {
+            rows = sseRows;
+            rowsName = "SSE4.1";
+        }
+#endif
+    }
+    if (name)
+        *name = rowsName;
+    return rows;
+}
+
+RagnaConvert::RagnaConvert()
+    : m_row(0),
+      m_bpp(0)
+{
+}
+
+bool RagnaConvert::setup(__u32 pixfmt)
+{
+    ConvertKind kind;
+
+    m_row = 0;
+    m_bpp = 4;
+
+    switch (pixfmt) {
+    case V4L2_PIX_FMT_RGB555:
+    case V4L2_PIX_FMT_XRGB555:
+    case V4L2_PIX_FMT_ARGB555:
+    case V4L2_PIX_FMT_XBGR555:
+    case V4L2_PIX_FMT_ABGR555:
+    case V4L2_PIX_FMT_YUV555:
+        kind = Unpack1555;
+        break;
+    case V4L2_PIX_FMT_RGB555X:
+    case V4L2_PIX_FMT_XRGB555X:
+    case V4L2_PIX_FMT_ARGB555X:
+        kind = Unpack1555BE;
+        break;
+    case V4L2_PIX_FMT_RGBX555:
+    case V4L2_PIX_FMT_RGBA555:
+    case V4L2_PIX_FMT_BGRX555:
+    case V4L2_PIX_FMT_BGRA555:
+        kind = Unpack5551;
+        break;
+    case V4L2_PIX_FMT_RGB332:
+        kind = Unpack332;
+        break;
+    case V4L2_PIX_FMT_BGR666:
+        kind = Unpack8888Rev;
+        break;
+    case V4L2_PIX_FMT_RGB565X:
+        kind = Swap565;
+        m_bpp = 2;
+        break;
+    default:
+        m_bpp = 0;
+        return false;
+    }
+
+    m_row = rowFuncs()[kind];
+    return true;
+}
+
+void RagnaConvert::convert(const __u8 *src, unsigned srcBpl, __u8 *dst,
+                           unsigned width, unsigned height) const
+{
+    unsigned dstBpl = width * m_bpp;
+
+    for (unsigned y = 0; y < height; y++, src += srcBpl, dst += dstBpl)
+        m_row(src, dst, width);
+}
+
+const char *RagnaConvert::isaName()
+{
+    const char *name;
+
+    rowFuncs(&name);
+    return name;
+}
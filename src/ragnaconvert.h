@@ -0,0 +1,42 @@
+#ifndef RAGNACONVERT_H
+# define RAGNACONVERT_H
+# include <linux/types.h>
+
+/*
+ * Unpacks pixel formats that OpenGL ES can't upload (1555/5551 packed
+ * 16 bit, 3_3_2, BGRA 8_8_8_8_REV and byte swapped 565) on the CPU.
+ *
+ * The output is what desktop GL would have put in the texture for the
+ * original format, as RGBA8 (or RGB565 for RGB565X), with every channel
+ * rounded to the nearest 8 bit value, so the shader for the original pixel
+ * format samples it unchanged.
+ */
+class RagnaConvert
+{
+public:
+    RagnaConvert();
+
+    bool setup(__u32 pixfmt);
+    bool isValid() const { return m_row != 0; }
+
+    /* 4 means GL_RGBA/GL_UNSIGNED_BYTE, 2 GL_RGB/GL_UNSIGNED_SHORT_5_6_5. */
+    unsigned bytesPerPixel() const { return m_bpp; }
+    unsigned frameSize(unsigned width, unsigned height) const
+    {
+        return width * height * m_bpp;
+    }
+
+    /* dst is tightly packed, it must hold frameSize() bytes. */
+    void convert(const __u8 *src, unsigned srcBpl, __u8 *dst,
+                 unsigned width, unsigned height) const;
+
+    static const char *isaName();
+
+private:
+    typedef void (*RowFunc)(const __u8 *src, __u8 *dst, unsigned width);
+
+    RowFunc m_row;
+    unsigned m_bpp;
+};
+
+#endif
@@ -0,0 +1,591 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ragnacodecslices.h"
+#include "ragnafilesource.h"
+#include "ragnalatency.h"
+#include "ragnarecorder.h"
+#include "v4l-stream.h"
+
+/* Like the capture thread, don't let the ring fill with stale frames. */
+#define FILE_MAX_PENDING 2
+/* Timestamps further apart than this are a gap in the recording. */
+#define FILE_MAX_GAP_NS 1000000000ull
+
+static __u32 get(const __u8 *p)
+{
+    __u32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static bool sameFormat(const cv4l_fmt &a, const cv4l_fmt &b)
+{
+    if (a.g_pixelformat() != b.g_pixelformat() ||
+        a.g_width() != b.g_width() || a.g_height() != b.g_height() ||
+        a.g_field() != b.g_field() || a.g_num_planes() != b.g_num_planes() ||
+        a.g_colorspace() != b.g_colorspace() ||
+        a.g_ycbcr_enc() != b.g_ycbcr_enc() ||
+        a.g_quantization() != b.g_quantization() ||
+        a.g_xfer_func() != b.g_xfer_func())
+        return false;
+
+    for (unsigned p = 0; p < a.g_num_planes(); p++)
+        if (a.g_bytesperline(p) != b.g_bytesperline(p) ||
+            a.g_sizeimage(p) != b.g_sizeimage(p))
+            return false;
+    return true;
+}
+
+/*
+ * Raw records only carry the bytes used. One that has the layout of the
+ * current format but fewer bytes in a plane was cut short, it is not a
+ * new format.
+ */
+static bool cutShort(const cv4l_fmt &fmt, const cv4l_fmt &cur)
+{
+    cv4l_fmt full = fmt;
+    bool shorter = false;
+
+    if (fmt.g_num_planes() != cur.g_num_planes())
+        return false;
+
+    for (unsigned p = 0; p < fmt.g_num_planes(); p++) {
+        if (fmt.g_sizeimage(p) < cur.g_sizeimage(p)) {
+            full.s_sizeimage(cur.g_sizeimage(p), p);
+            shorter = true;
+        }
+    }
+    return shorter && sameFormat(full, cur);
+}
+
+RagnaFileSource::RagnaFileSource()
+    : m_kind(KindRaw),
+      m_segment(-1),
+      m_map(NULL),
+      m_mapSize(0),
+      m_offset(0),
+      m_benchmark(false),
+      m_fps(30),
+      m_codec(NULL),
+      m_next(0),
+      m_outstanding(0),
+      m_delivered(0),
+      m_skipped(0)
+{
+}
+
+RagnaFileSource::~RagnaFileSource()
+{
+    stop();
+    unmapFile();
+    if (m_codec)
+        fwht_free(m_codec);
+}
+
+bool RagnaFileSource::mapFile(const QString &path)
+{
+    QByteArray name = path.toLocal8Bit();
+    int fd = ::open(name.data(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0) {
+        /* Running out of segments is how a recording ends. */
+        if (errno != ENOENT || m_segment <= 0)
+            perror(name.data());
+        return false;
+    }
+    if (fstat(fd, &st) || st.st_size == 0) {
+        fprintf(stderr, "%s is empty\n", name.data());
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(name.data());
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    m_map = (__u8 *)map;
+    m_mapSize = st.st_size;
+    m_offset = 0;
+    return true;
+}
+
+void RagnaFileSource::unmapFile()
+{
+    if (m_map)
+        munmap(m_map, m_mapSize);
+    m_map = NULL;
+    m_mapSize = 0;
+    for (const Retired &retired : m_retired)
+        munmap(retired.map, retired.size);
+    m_retired.clear();
+}
+
+/*
+ * Frames handed to the renderer point into the mapping, so it's only
+ * unmapped once every frame delivered from it was released.
+ */
+bool RagnaFileSource::nextSegment()
+{
+    if (m_segment < 0)
+        return false;
+
+    Retired retired = { m_map, m_mapSize, m_delivered };
+
+    m_retired.push_back(retired);
+    m_map = NULL;
+    m_mapSize = 0;
+    m_segment++;
+    return mapFile(QString("%1.%2").arg(m_path).arg(m_segment, 4, 10, QChar('0')));
+}
+
+bool RagnaFileSource::open(const QString &path)
+{
+    QString first = path;
+    int dot = path.lastIndexOf('.');
+    bool isSegment = false;
+    unsigned segment = 0;
+
+    /* foo.0003 plays from that segment on, foo plays foo.0000 and on. */
+    if (dot >= 0 && path.length() - dot == 5)
+        segment = path.mid(dot + 1).toUInt(&isSegment, 10);
+    if (isSegment) {
+        m_path = path.left(dot);
+        m_segment = segment;
+    } else if (access(path.toLocal8Bit().data(), F_OK) &&
+               access((path + ".0000").toLocal8Bit().data(), F_OK) == 0) {
+        m_path = path;
+        m_segment = 0;
+        first = path + ".0000";
+    }
+    if (!mapFile(first))
+        return false;
+
+    if (m_mapSize >= sizeof(RagnaRecordHeader) &&
+        ((RagnaRecordHeader *)m_map)->magic == RAGNA_RECORD_MAGIC) {
+        m_kind = KindRaw;
+        rawFormat((RagnaRecordHeader *)m_map, m_fileFmt);
+    } else if (m_mapSize >= 16 && get(m_map) == V4L_STREAM_ID &&
+               get(m_map + 4) == V4L_STREAM_VERSION &&
+               get(m_map + 8) == V4L_STREAM_PACKET_FMT_VIDEO &&
+               readStreamFmt(m_map + 16, qMin((size_t)get(m_map + 12), m_mapSize - 16),
+                             m_fileFmt)) {
+        m_kind = KindStream;
+        /* A stream has nothing else to do with segments. */
+        m_segment = -1;
+        m_offset = 8;
+    } else {
+        fprintf(stderr, "%s is not a ragna recording or a v4l2 stream\n",
+                first.toLocal8Bit().data());
+        return false;
+    }
+    m_fmt = m_fileFmt;
+    return true;
+}
+
+bool RagnaFileSource::format(cv4l_fmt &fmt)
+{
+    QMutexLocker lock(&m_fmtLock);
+
+    fmt = m_fmt;
+    return true;
+}
+
+void RagnaFileSource::rawFormat(const RagnaRecordHeader *hdr, cv4l_fmt &fmt)
+{
+    unsigned planes = qMin(hdr->numPlanes, (__u32)VIDEO_MAX_PLANES);
+
+    fmt = cv4l_fmt(planes > 1 ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE :
+                                V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    fmt.s_pixelformat(hdr->pixelformat);
+    fmt.s_width(hdr->width);
+    fmt.s_height(hdr->height);
+    fmt.s_field(hdr->field);
+    fmt.s_colorspace(hdr->colorspace);
+    fmt.s_ycbcr_enc(hdr->ycbcrEnc);
+    fmt.s_quantization(hdr->quantization);
+    fmt.s_xfer_func(hdr->xferFunc);
+    fmt.s_num_planes(planes);
+    for (unsigned p = 0; p < planes; p++) {
+        fmt.s_bytesperline(hdr->bytesperline[p], p);
+        fmt.s_sizeimage(hdr->bytesused[p], p);
+    }
+}
+
+bool RagnaFileSource::readStreamFmt(const __u8 *p, unsigned size, cv4l_fmt &fmt)
+{
+    /* Everything up to and including xfer_func is needed. */
+    if (size < 4 + 9 * 4)
+        return false;
+
+    unsigned sizeFmt = get(p);
+    unsigned planes = get(p + 4);
+
+    if (sizeFmt < 9 * 4 || 4 + sizeFmt > size ||
+        planes == 0 || planes > VIDEO_MAX_PLANES)
+        return false;
+
+    fmt = cv4l_fmt(planes > 1 ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE :
+                                V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    fmt.s_num_planes(planes);
+    fmt.s_pixelformat(get(p + 8));
+    fmt.s_width(get(p + 12));
+    fmt.s_height(get(p + 16));
+    fmt.s_field(get(p + 20));
+    fmt.s_colorspace(get(p + 24));
+    fmt.s_ycbcr_enc(get(p + 28));
+    fmt.s_quantization(get(p + 32));
+    fmt.s_xfer_func(get(p + 36));
+
+    unsigned off = 4 + sizeFmt;
+
+    for (unsigned i = 0; i < planes; i++) {
+        if (off + 4 > size)
+            return false;
+
+        unsigned sizePlane = get(p + off);
+
+        if (sizePlane < 2 * 4 || off + 4 + sizePlane > size)
+            return false;
+        fmt.s_sizeimage(get(p + off + 4), i);
+        fmt.s_bytesperline(get(p + off + 8), i);
+        off += 4 + sizePlane;
+    }
+    return true;
+}
+
+/*
+ * A new format is only announced once the renderer took every frame in
+ * the old one, sourceChanged is then handled before the next frameReady.
+ */
+void RagnaFileSource::changeFormat(const cv4l_fmt &fmt)
+{
+    while (m_ready.count() && !m_stop) {
+        waitWake(1000000);
+        drainReleased();
+    }
+    m_fileFmt = fmt;
+    {
+        QMutexLocker lock(&m_fmtLock);
+
+        m_fmt = fmt;
+    }
+    emit sourceChanged();
+}
+
+bool RagnaFileSource::readRaw(Pending &pending)
+{
+    for (;;) {
+        const RagnaRecordHeader *hdr = (const RagnaRecordHeader *)(m_map + m_offset);
+        size_t left = m_mapSize - m_offset;
+
+        /*
+         * A record always moves the offset on by a whole number of
+         * blocks, anything else is corrupt and ends the segment.
+         */
+        if (left < sizeof(*hdr) || hdr->magic != RAGNA_RECORD_MAGIC ||
+            hdr->headerSize < sizeof(*hdr) ||
+            hdr->recordSize < hdr->headerSize ||
+            hdr->recordSize % RAGNA_RECORD_ALIGN ||
+            hdr->recordSize > left ||
+            hdr->numPlanes == 0 || hdr->numPlanes > VIDEO_MAX_PLANES) {
+            if (!nextSegment())
+                return false;
+            continue;
+        }
+
+        RagnaFrame &frame = pending.frame;
+        size_t off = hdr->headerSize;
+        bool fits = true;
+
+        frame.num_planes = hdr->numPlanes;
+        for (unsigned p = 0; p < frame.num_planes; p++) {
+            if (hdr->bytesused[p] > hdr->recordSize - off) {
+                fits = false;
+                break;
+            }
+            frame.data[p] = m_map + m_offset + off;
+            frame.size[p] = hdr->bytesused[p];
+            off += hdr->bytesused[p];
+        }
+        m_offset += hdr->recordSize;
+        if (!fits)
+            continue;
+
+        cv4l_fmt fmt;
+
+        rawFormat(hdr, fmt);
+        if (cutShort(fmt, m_fileFmt)) {
+            m_skipped++;
+            continue;
+        }
+        /* A longer record also changes the format, so it is the largest seen. */
+        if (!sameFormat(fmt, m_fileFmt))
+            changeFormat(fmt);
+
+        pending.timestamp = hdr->timestampSec * 1000000000ull +
+                            hdr->timestampUsec * 1000ull;
+        pending.haveTimestamp = pending.timestamp != 0;
+        return true;
+    }
+}
+
+bool RagnaFileSource::decodeStreamFrame(__u32 id, const __u8 *p, unsigned size,
+                                        Pending &pending)
+{
+    if (size < 4 || get(p) > size - 4)
+        return false;
+
+    const cv4l_fmt &fmt = m_fileFmt;
+    RagnaFrame &frame = pending.frame;
+    std::vector<__u8> &out = m_decodeBuf[m_next % RAGNA_FILE_SLOTS];
+    unsigned off = 4 + get(p);
+    unsigned total = 0;
+
+    for (unsigned i = 0; i < fmt.g_num_planes(); i++)
+        total += fmt.g_sizeimage(i);
+    out.resize(total);
+
+    total = 0;
+    frame.num_planes = fmt.g_num_planes();
+    for (unsigned i = 0; i < frame.num_planes; i++) {
+        if (off + 4 > size || get(p + off) < 2 * 4 ||
+            get(p + off) > size - off - 4)
+            return false;
+
+        unsigned bytesused = get(p + off + 4);
+        unsigned dataSize = get(p + off + 8);
+        const __u8 *data = p + off + 4 + get(p + off);
+        __u8 *dst = out.data() + total;
+
+        if (dataSize > size - (data - p) || bytesused > fmt.g_sizeimage(i))
+            return false;
+
+        if (id == V4L_STREAM_PACKET_FRAME_VIDEO_FWHT) {
+            if (m_codec == NULL ||
+                !fwht_decompress(m_codec, (__u8 *)data, dataSize, dst, bytesused))
+                return false;
+        } else {
+            /* The encoded data is unpacked in place from the end. */
+            if (dataSize > bytesused)
+                return false;
+            memcpy(dst + bytesused - dataSize, data, dataSize);
+            rle_decompress(dst, bytesused, dataSize,
+                           rle_calc_bpl(fmt.g_bytesperline(i), fmt.g_pixelformat()));
+        }
+        frame.data[i] = dst;
+        frame.size[i] = bytesused;
+        total += fmt.g_sizeimage(i);
+        off = data + dataSize - p;
+    }
+    pending.haveTimestamp = false;
+    return true;
+}
+
+bool RagnaFileSource::readStream(Pending &pending)
+{
+    while (m_offset + 8 <= m_mapSize) {
+        __u32 id = get(m_map + m_offset);
+        __u32 size = get(m_map + m_offset + 4);
+        const __u8 *p = m_map + m_offset + 8;
+
+        if (size > m_mapSize - m_offset - 8 || id == V4L_STREAM_PACKET_END)
+            return false;
+        m_offset += 8 + size;
+
+        if (id == V4L_STREAM_PACKET_FMT_VIDEO) {
+            cv4l_fmt fmt;
+
+            if (!readStreamFmt(p, size, fmt))
+                return false;
+            if (!sameFormat(fmt, m_fileFmt))
+                changeFormat(fmt);
+
+            /*
+             * FWHT reference frames don't carry over a format packet, but
+             * the buffers do as long as the new format fits in them.
+             */
+            if (!m_codec ||
+                !fwht_set_format(m_codec, fmt.g_pixelformat(), fmt.g_width(), fmt.g_height(),
+                                 fmt.g_width(), fmt.g_height(), fmt.g_field(),
+                                 fmt.g_colorspace(), fmt.g_xfer_func(),
+                                 fmt.g_ycbcr_enc(), fmt.g_quantization())) {
+                if (m_codec)
+                    fwht_free(m_codec);
+                m_codec = fwht_alloc(fmt.g_pixelformat(), fmt.g_width(), fmt.g_height(),
+                                     fmt.g_width(), fmt.g_height(), fmt.g_field(),
+                                     fmt.g_colorspace(), fmt.g_xfer_func(),
+                                     fmt.g_ycbcr_enc(), fmt.g_quantization());
+                if (m_codec)
+                    RagnaCodecSlices::enable(m_codec, QThreadPool::globalInstance());
+            }
+        } else if (id == V4L_STREAM_PACKET_FRAME_VIDEO_RLE ||
+                   id == V4L_STREAM_PACKET_FRAME_VIDEO_FWHT) {
+            if (decodeStreamFrame(id, p, size, pending))
+                return true;
+            fprintf(stderr, "Skipping a frame that couldn't be decoded\n");
+        }
+    }
+    return false;
+}
+
+bool RagnaFileSource::readFrame(Pending &pending)
+{
+    pending.frame.index = m_next % RAGNA_FILE_SLOTS;
+    if (m_kind == KindRaw)
+        return readRaw(pending);
+    return readStream(pending);
+}
+
+void RagnaFileSource::drainReleased()
+{
+    int index;
+
+    while (m_released.pop(index))
+        if (m_outstanding)
+            m_outstanding--;
+
+    /* Frames are released in the order they were delivered. */
+    uint64_t released = m_delivered - m_outstanding;
+
+    while (!m_retired.empty() && m_retired.front().delivered <= released) {
+        munmap(m_retired.front().map, m_retired.front().size);
+        m_retired.erase(m_retired.begin());
+    }
+}
+
+/* Sleeps for ns, or until woken. A negative ns waits for a wake. */
+void RagnaFileSource::waitWake(int64_t ns)
+{
+    struct pollfd fd = { m_wakeFd, POLLIN, 0 };
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    if (ppoll(&fd, 1, ns < 0 ? NULL : &ts, NULL) > 0) {
+        uint64_t count;
+
+        if (read(m_wakeFd, &count, sizeof(count)) < 0) {
+            /* Raced with another read, nothing to drain. */
+        }
+    }
+}
+
+void RagnaFileSource::deliver(Pending &pending)
+{
+    RagnaFrame &frame = pending.frame;
+
+    /* Capture time means nothing here, leave latency reporting out of it. */
+    frame.timestamp = 0;
+    frame.dequeued = RagnaLatency::now();
+    frame.converted = convertFrame(frame);
+    m_ready.push(frame);
+    m_outstanding++;
+    m_next++;
+    m_delivered++;
+    emit frameReady();
+}
+
+void RagnaFileSource::report()
+{
+    printf("Played %llu frames, skipped %llu\n",
+           (unsigned long long)m_delivered, (unsigned long long)m_skipped);
+}
+
+void RagnaFileSource::run()
+{
+    Pending pending;
+    bool havePending = false;
+    uint64_t lastTimestamp = 0;
+    uint64_t fileBase = 0;
+    uint64_t wallBase = 0;
+    bool based = false;
+    uint64_t start = RagnaLatency::now();
+
+    while (m_stop == false) {
+        drainReleased();
+
+        if (!havePending) {
+            /* Decoding reuses a slot, it must not still be on screen. */
+            if (m_outstanding >= RAGNA_FILE_SLOTS - 1) {
+                waitWake(-1);
+                continue;
+            }
+            if (!readFrame(pending))
+                break;
+            if (!pending.haveTimestamp)
+                pending.timestamp = lastTimestamp + 1000000000ull / m_fps;
+            havePending = true;
+        }
+
+        if (m_benchmark) {
+            /*
+             * One at a time, so the renderer draws every one of them. It
+             * holds on to the frame it shows, so up to two are out, and
+             * only releasing one wakes this thread up.
+             */
+            if (m_ready.count() || m_outstanding >= 2) {
+                waitWake(m_ready.count() ? 1000000 : -1);
+                continue;
+            }
+            deliver(pending);
+            havePending = false;
+            continue;
+        }
+
+        uint64_t now = RagnaLatency::now();
+
+        if (!based || pending.timestamp < lastTimestamp ||
+            pending.timestamp - lastTimestamp > FILE_MAX_GAP_NS) {
+            fileBase = pending.timestamp;
+            wallBase = now;
+            based = true;
+        }
+        lastTimestamp = pending.timestamp;
+
+        uint64_t due = wallBase + (pending.timestamp - fileBase);
+
+        if (now < due) {
+            waitWake(due - now);
+            /* Woken early, try again with the same frame. */
+            if (RagnaLatency::now() < due)
+                continue;
+        }
+
+        if (m_ready.count() >= FILE_MAX_PENDING || !shouldDeliver())
+            m_skipped++;
+        else
+            deliver(pending);
+        havePending = false;
+    }
+
+    if (m_stop)
+        return;
+
+    /* The last frame is drawn once the renderer took it. */
+    while (m_ready.count() && !m_stop) {
+        waitWake(1000000);
+        drainReleased();
+    }
+
+    double secs = (RagnaLatency::now() - start) / 1e9;
+
+    report();
+    if (m_benchmark && secs > 0)
+        printf("Benchmark: %.3f s, %.1f frames per second\n",
+               secs, m_delivered / secs);
+    emit finished();
+}
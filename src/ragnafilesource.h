@@ -0,0 +1,100 @@
+#ifndef RAGNAFILESOURCE_H
+# define RAGNAFILESOURCE_H
+# include <QString>
+
+# include "ragnaframesource.h"
+
+struct codec_ctx;
+struct RagnaRecordHeader;
+
+/* Frame indices cycle through this many, that's how many can be in use. */
+# define RAGNA_FILE_SLOTS 8
+
+/*
+ * Plays back a recording made with --record (every segment of it) or a
+ * v4l2-ctl style stream file such as --record-fwht writes. The file is
+ * mapped and raw frames are handed to the renderer straight from the
+ * mapping; only compressed frames are decoded into buffers first.
+ *
+ * Frames are paced by their recorded timestamps, or by the given rate for
+ * streams, which have none. In benchmark mode they're handed over as fast
+ * as the renderer takes them instead, one at a time so that every frame
+ * is drawn, and finished() is emitted at the end of the file.
+ */
+class RagnaFileSource : public RagnaFrameSource
+{
+    Q_OBJECT
+public:
+    RagnaFileSource();
+    ~RagnaFileSource();
+
+    bool open(const QString &path);
+    bool format(cv4l_fmt &fmt) override;
+    void setBenchmark(bool benchmark) { m_benchmark = benchmark; }
+    void setFps(unsigned fps) { m_fps = fps ? fps : 1; }
+
+signals:
+    void finished();
+
+private:
+    enum Kind {
+        KindRaw,
+        KindStream,
+    };
+
+    /* A segment that's done but may still have frames on screen. */
+    struct Retired
+    {
+        __u8 *map;
+        size_t size;
+        uint64_t delivered;
+    };
+
+    struct Pending
+    {
+        RagnaFrame frame;
+        uint64_t timestamp;
+        bool haveTimestamp;
+    };
+
+    void run() override;
+    bool mapFile(const QString &path);
+    void unmapFile();
+    bool nextSegment();
+    bool readFrame(Pending &pending);
+    bool readRaw(Pending &pending);
+    bool readStream(Pending &pending);
+    bool readStreamFmt(const __u8 *p, unsigned size, cv4l_fmt &fmt);
+    bool decodeStreamFrame(__u32 id, const __u8 *p, unsigned size,
+                           Pending &pending);
+    void rawFormat(const RagnaRecordHeader *hdr, cv4l_fmt &fmt);
+    void changeFormat(const cv4l_fmt &fmt);
+    void drainReleased();
+    void waitWake(int64_t ns);
+    void deliver(Pending &pending);
+    void report();
+
+    Kind m_kind;
+    QString m_path;
+    int m_segment;
+    __u8 *m_map;
+    size_t m_mapSize;
+    size_t m_offset;
+    std::vector<Retired> m_retired;
+    bool m_benchmark;
+    unsigned m_fps;
+
+    QMutex m_fmtLock;
+    cv4l_fmt m_fmt;
+    /* Only used by this thread, m_fmt is what the renderer was told. */
+    cv4l_fmt m_fileFmt;
+    codec_ctx *m_codec;
+    std::vector<__u8> m_decodeBuf[RAGNA_FILE_SLOTS];
+
+    unsigned m_next;
+    unsigned m_outstanding;
+    uint64_t m_delivered;
+    uint64_t m_skipped;
+};
+
+#endif
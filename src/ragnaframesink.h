@@ -0,0 +1,20 @@
+#ifndef RAGNAFRAMESINK_H
+# define RAGNAFRAMESINK_H
+# include "cv4l-helpers.h"
+
+/*
+ * Something that wants every frame the capture thread dequeues, such as a
+ * recorder. submit() runs on the capture thread and must never block: if
+ * the sink can't take a frame right now, it drops it and returns false.
+ * setFormat() is called from the GUI thread whenever the format changes.
+ */
+class RagnaFrameSink
+{
+public:
+    virtual ~RagnaFrameSink() {}
+
+    virtual void setFormat(const cv4l_fmt &fmt) = 0;
+    virtual bool submit(const cv4l_buffer &buf, cv4l_queue *q) = 0;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "ragnaframesource.h"
+#include "ragnalatency.h"
+
+RagnaFrameSource::RagnaFrameSource()
+    : m_stop(false),
+      m_deliver(true),
+      m_minInterval(0),
+      m_lastDelivered(0),
+      m_skippedHidden(0),
+      m_skippedThrottled(0),
+      m_convertWidth(0),
+      m_convertHeight(0),
+      m_convertBpl(0)
+{
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+RagnaFrameSource::~RagnaFrameSource()
+{
+    stop();
+    close(m_wakeFd);
+}
+
+void RagnaFrameSource::wake()
+{
+    uint64_t one = 1;
+
+    if (write(m_wakeFd, &one, sizeof(one)) < 0) {
+        /* The counter is already non-zero, so the thread will wake. */
+    }
+}
+
+void RagnaFrameSource::stop()
+{
+    if (isRunning() == false)
+        return;
+
+    m_stop = true;
+    wake();
+    wait();
+}
+
+bool RagnaFrameSource::popFrame(RagnaFrame &frame)
+{
+    return m_ready.pop(frame);
+}
+
+void RagnaFrameSource::releaseFrame(int index)
+{
+    if (index < 0)
+        return;
+
+    m_released.push(index);
+    wake();
+}
+
+void RagnaFrameSource::setDelivery(bool deliver, uint64_t minIntervalNs)
+{
+    m_deliver = deliver;
+    m_minInterval = minIntervalNs;
+}
+
+void RagnaFrameSource::takeSkipped(uint64_t &hidden, uint64_t &throttled)
+{
+    hidden = m_skippedHidden.exchange(0);
+    throttled = m_skippedThrottled.exchange(0);
+}
+
+bool RagnaFrameSource::shouldDeliver()
+{
+    if (m_deliver == false) {
+        m_skippedHidden++;
+        return false;
+    }
+
+    uint64_t interval = m_minInterval;
+    uint64_t now = RagnaLatency::now();
+
+    if (interval && now - m_lastDelivered < interval) {
+        m_skippedThrottled++;
+        return false;
+    }
+
+    m_lastDelivered = now;
+    return true;
+}
+
+void RagnaFrameSource::setConversion(const RagnaConvert &convert,
+                                       unsigned width, unsigned height,
+                                       unsigned bytesperline)
+{
+    QMutexLocker lock(&m_convertLock);
+
+    m_convert = convert;
+    m_convertWidth = width;
+    m_convertHeight = height;
+    m_convertBpl = bytesperline;
+}
+
+void RagnaFrameSource::clearConversion()
+{
+    QMutexLocker lock(&m_convertLock);
+
+    m_convert = RagnaConvert();
+}
+
+bool RagnaFrameSource::convertFrame(RagnaFrame &frame)
+{
+    QMutexLocker lock(&m_convertLock);
+
+    if (!m_convert.isValid())
+        return false;
+
+    std::vector<__u8> &out = m_convertBuf[frame.index];
+    unsigned size = m_convert.frameSize(m_convertWidth, m_convertHeight);
+
+    if (frame.size[0] < m_convertBpl * m_convertHeight)
+        return false;
+
+    out.resize(size);
+    m_convert.convert(frame.data[0], m_convertBpl, out.data(),
+                      m_convertWidth, m_convertHeight);
+    frame.data[0] = out.data();
+    frame.size[0] = size;
+    return true;
+}
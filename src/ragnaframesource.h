@@ -0,0 +1,89 @@
+#ifndef RAGNAFRAMESOURCE_H
+# define RAGNAFRAMESOURCE_H
+# include <atomic>
+# include <vector>
+# include <QMutex>
+# include <QThread>
+
+# include "cv4l-helpers.h"
+# include "ragnaconvert.h"
+# include "ragnaring.h"
+
+struct RagnaFrame
+{
+    int index;
+    unsigned num_planes;
+    __u8 *data[VIDEO_MAX_PLANES];
+    unsigned size[VIDEO_MAX_PLANES];
+    /* CLOCK_MONOTONIC ns, timestamp is 0 if the driver's isn't monotonic. */
+    uint64_t timestamp;
+    uint64_t dequeued;
+    /* data[0] was unpacked by the conversion set with setConversion. */
+    bool converted;
+};
+
+/*
+ * A thread that produces frames for the renderer. Frames are handed over
+ * through one ring, and the renderer hands back their indices through
+ * another once it's done with them, so a frame's memory stays valid until
+ * then. Formats the context can't sample are unpacked here too, and the
+ * governor set with setDelivery decides which frames are worth handing
+ * over at all.
+ */
+class RagnaFrameSource : public QThread
+{
+    Q_OBJECT
+public:
+    RagnaFrameSource();
+    ~RagnaFrameSource();
+
+    bool popFrame(RagnaFrame &);
+    void releaseFrame(int);
+    void stop();
+    void setConversion(const RagnaConvert &, unsigned width, unsigned height,
+                       unsigned bytesperline);
+    void clearConversion();
+    void setDelivery(bool deliver, uint64_t minIntervalNs);
+    void takeSkipped(uint64_t &hidden, uint64_t &throttled);
+
+    /* The format frames are in now, read after sourceChanged. */
+    virtual bool format(cv4l_fmt &fmt) = 0;
+
+signals:
+    void frameReady();
+    void sourceChanged();
+
+protected:
+    bool convertFrame(RagnaFrame &);
+    bool shouldDeliver();
+    void wake();
+
+    int m_wakeFd;
+    std::atomic<bool> m_stop;
+    RagnaRing<RagnaFrame, VIDEO_MAX_FRAME> m_ready;
+    RagnaRing<int, VIDEO_MAX_FRAME> m_released;
+
+private:
+    /*
+     * While the window can't be seen frames are skipped, and while it's
+     * unfocused at most one is handed over per m_minInterval ns.
+     */
+    std::atomic<bool> m_deliver;
+    std::atomic<uint64_t> m_minInterval;
+    uint64_t m_lastDelivered;
+    std::atomic<uint64_t> m_skippedHidden;
+    std::atomic<uint64_t> m_skippedThrottled;
+
+    /*
+     * Set from the GUI thread. Every frame index gets its own output so
+     * a frame stays valid until the renderer releases that index.
+     */
+    QMutex m_convertLock;
+    RagnaConvert m_convert;
+    unsigned m_convertWidth;
+    unsigned m_convertHeight;
+    unsigned m_convertBpl;
+    std::vector<__u8> m_convertBuf[VIDEO_MAX_FRAME];
+};
+
+#endif
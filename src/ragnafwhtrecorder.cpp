@@ -0,0 +1,414 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "ragnacodecslices.h"
+#include "ragnafwhtrecorder.h"
+#include "v4l-stream.h"
+#include "v4l2-info.h"
+
+static void put(std::vector<__u8> &out, __u32 v)
+{
+    v = htonl(v);
+    out.insert(out.end(), (__u8 *)&v, (__u8 *)&v + sizeof(v));
+}
+
+static void putZeroes(std::vector<__u8> &out, unsigned count)
+{
+    out.insert(out.end(), count, 0);
+}
+
+static void putFmt(std::vector<__u8> &out, const cv4l_fmt &fmt)
+{
+    put(out, V4L_STREAM_PACKET_FMT_VIDEO);
+    put(out, V4L_STREAM_PACKET_FMT_VIDEO_SIZE(1));
+    put(out, V4L_STREAM_PACKET_FMT_VIDEO_SIZE_FMT);
+    put(out, 1);
+    put(out, fmt.g_pixelformat());
+    put(out, fmt.g_width());
+    put(out, fmt.g_height());
+    put(out, fmt.g_field());
+    put(out, fmt.g_colorspace());
+    put(out, fmt.g_ycbcr_enc());
+    put(out, fmt.g_quantization());
+    put(out, fmt.g_xfer_func());
+    put(out, fmt.g_flags());
+    /* There's no way to know the pixel aspect here, assume square. */
+    put(out, 1);
+    put(out, 1);
+    put(out, V4L_STREAM_PACKET_FMT_VIDEO_SIZE_FMT_PLANE);
+    put(out, fmt.g_sizeimage(0));
+    put(out, fmt.g_bytesperline(0));
+}
+
+static void putFrame(std::vector<__u8> &out, __u32 field, __u32 flags,
+                     unsigned bytesused, const __u8 *data, unsigned size)
+{
+    put(out, V4L_STREAM_PACKET_FRAME_VIDEO_FWHT);
+    put(out, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE(1) + size);
+    put(out, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE_HDR);
+    put(out, field);
+    put(out, flags);
+    putZeroes(out, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE_HDR - 2 * 4);
+    put(out, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE_PLANE_HDR);
+    put(out, bytesused);
+    put(out, size);
+    putZeroes(out, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE_PLANE_HDR - 2 * 4);
+    out.insert(out.end(), data, data + size);
+}
+
+RagnaFwhtRecorder::RagnaFwhtRecorder()
+    : m_file(NULL),
+      m_gopSize(0),
+      m_kbps(0),
+      m_latencyMs(0),
+      m_maxInFlight(0),
+      m_inFlight(0),
+      m_fmtChanged(false),
+      m_canEncode(false),
+      m_current(NULL),
+      m_nextNumber(0),
+      m_lastTimestamp(0),
+      m_frameNs(0),
+      m_qp(0),
+      m_nextWrite(0),
+      m_rateBytes(0),
+      m_rateNs(0),
+      m_rateMinQp(~0U),
+      m_rateMaxQp(0),
+      m_failed(false),
+      m_written(0),
+      m_dropped(0),
+      m_rawBytes(0),
+      m_bytes(0)
+{
+}
+
+RagnaFwhtRecorder::~RagnaFwhtRecorder()
+{
+    stop();
+}
+
+bool RagnaFwhtRecorder::open(const QString &path, unsigned gopSize,
+                             unsigned kbps, unsigned latencyMs)
+{
+    QByteArray name = path.toLocal8Bit();
+
+    m_file = fopen(name.data(), "wb");
+    if (m_file == NULL) {
+        perror(name.data());
+        return false;
+    }
+
+    std::vector<__u8> out;
+
+    put(out, V4L_STREAM_ID);
+    put(out, V4L_STREAM_VERSION);
+    fwrite(out.data(), 1, out.size(), m_file);
+
+    m_path = path;
+    m_gopSize = gopSize ? gopSize : 1;
+    m_kbps = kbps;
+    m_latencyMs = latencyMs;
+    m_rateTimer.start();
+    /* One segment per worker, one being filled and one spare. */
+    m_maxInFlight = m_pool.maxThreadCount() + 2;
+    return true;
+}
+
+void RagnaFwhtRecorder::setFormat(const cv4l_fmt &fmt)
+{
+    QMutexLocker lock(&m_formatLock);
+
+    m_newFmt = fmt;
+    m_fmtChanged = true;
+}
+
+bool RagnaFwhtRecorder::canEncode(const cv4l_fmt &fmt)
+{
+    const v4l2_fwht_pixfmt_info *info = v4l2_fwht_find_pixfmt(fmt.g_pixelformat());
+
+    /* The codec wants no padding at the end of lines. */
+    if (!info || fmt.g_num_planes() != 1 ||
+        fmt.g_bytesperline(0) != fmt.g_width() * info->bytesperline_mult)
+        return false;
+
+    /*
+     * Which sizes it takes is up to the codec, so ask it. This runs on the
+     * capture thread, the codec is only allocated by the worker.
+     */
+    return fwht_check_format(fmt.g_pixelformat(), fmt.g_width(), fmt.g_height());
+}
+
+codec_ctx *RagnaFwhtRecorder::allocCodec(const cv4l_fmt &fmt)
+{
+    return fwht_alloc(fmt.g_pixelformat(), fmt.g_width(), fmt.g_height(),
+                      fmt.g_width(), fmt.g_height(), fmt.g_field(),
+                      fmt.g_colorspace(), fmt.g_xfer_func(),
+                      fmt.g_ycbcr_enc(), fmt.g_quantization());
+}
+
+std::vector<__u8> RagnaFwhtRecorder::takeBuffer()
+{
+    QMutexLocker lock(&m_spareLock);
+    std::vector<__u8> buf;
+
+    if (!m_spare.empty()) {
+        buf.swap(m_spare.back());
+        m_spare.pop_back();
+    }
+    return buf;
+}
+
+void RagnaFwhtRecorder::giveBuffer(std::vector<__u8> &buf)
+{
+    QMutexLocker lock(&m_spareLock);
+
+    m_spare.push_back(std::vector<__u8>());
+    m_spare.back().swap(buf);
+}
+
+codec_ctx *RagnaFwhtRecorder::takeCodec(const cv4l_fmt &fmt)
+{
+    codec_ctx *ctx = NULL;
+
+    {
+        QMutexLocker lock(&m_spareLock);
+
+        if (!m_spareCodecs.empty()) {
+            ctx = m_spareCodecs.back();
+            m_spareCodecs.pop_back();
+        }
+    }
+    if (ctx && fwht_set_format(ctx, fmt.g_pixelformat(), fmt.g_width(), fmt.g_height(),
+                               fmt.g_width(), fmt.g_height(), fmt.g_field(),
+                               fmt.g_colorspace(), fmt.g_xfer_func(),
+                               fmt.g_ycbcr_enc(), fmt.g_quantization()))
+        return ctx;
+    if (ctx)
+        fwht_free(ctx);
+    return allocCodec(fmt);
+}
+
+void RagnaFwhtRecorder::giveCodec(codec_ctx *ctx)
+{
+    QMutexLocker lock(&m_spareLock);
+
+    m_spareCodecs.push_back(ctx);
+}
+
+void RagnaFwhtRecorder::startSegment()
+{
+    m_current = new Segment;
+    m_current->number = m_nextNumber++;
+    m_current->fmt = m_fmt;
+    m_current->frames.reserve(m_gopSize);
+    m_current->encoded = 0;
+    m_current->rawBytes = 0;
+    m_current->minQp = ~0U;
+    m_current->maxQp = 0;
+    m_inFlight++;
+}
+
+void RagnaFwhtRecorder::queueSegment()
+{
+    Segment *seg = m_current;
+
+    m_current = NULL;
+    /* Until there are timestamps to go by, assume 30 fps. */
+    seg->frameNs = m_frameNs ? m_frameNs : 1000000000 / 30;
+    m_pool.start([this, seg] { encode(seg); });
+}
+
+bool RagnaFwhtRecorder::submit(const cv4l_buffer &buf, cv4l_queue *q)
+{
+    if (m_file == NULL || m_failed)
+        return false;
+
+    {
+        QMutexLocker lock(&m_formatLock);
+
+        if (m_fmtChanged) {
+            m_fmtChanged = false;
+            m_fmt = m_newFmt;
+            m_canEncode = canEncode(m_fmt);
+            if (!m_canEncode)
+                fprintf(stderr, "Can't FWHT encode %s at %ux%u, frames are not recorded\n",
+                        fcc2s(m_fmt.g_pixelformat()).c_str(),
+                        m_fmt.g_width(), m_fmt.g_height());
+            /* A segment never changes format halfway. */
+            if (m_current)
+                queueSegment();
+        }
+    }
+
+    if (!m_canEncode) {
+        m_dropped++;
+        return false;
+    }
+    if (m_current == NULL) {
+        if (m_inFlight >= m_maxInFlight) {
+            m_dropped++;
+            return false;
+        }
+        startSegment();
+    }
+
+    unsigned size = buf.g_bytesused(0);
+
+    m_current->frames.push_back(Frame());
+
+    Frame &frame = m_current->frames.back();
+
+    /* The encoder reads a whole frame, even if the driver filled less. */
+    frame.data = takeBuffer();
+    frame.data.resize(std::max(size, m_fmt.g_sizeimage(0)));
+    memcpy(frame.data.data(), q->g_dataptr(buf.g_index(), 0), size);
+    frame.bytesused = size;
+    frame.field = buf.g_field();
+    frame.flags = buf.g_flags();
+    frame.timestamp = buf.g_timestamp_ns();
+
+    /* Rate control spreads the bitrate over the frame interval. */
+    if (m_lastTimestamp && frame.timestamp > m_lastTimestamp) {
+        uint64_t interval = frame.timestamp - m_lastTimestamp;
+
+        m_frameNs = m_frameNs ? (7 * m_frameNs + interval) / 8 : interval;
+    }
+    m_lastTimestamp = frame.timestamp;
+
+    if (m_current->frames.size() == m_gopSize)
+        queueSegment();
+    return true;
+}
+
+/* Runs on a worker thread. */
+void RagnaFwhtRecorder::encode(Segment *seg)
+{
+    const cv4l_fmt &fmt = seg->fmt;
+    codec_ctx *ctx = takeCodec(fmt);
+
+    if (ctx == NULL) {
+        fprintf(stderr, "Can't allocate an FWHT encoder, %zu frames are not recorded\n",
+                seg->frames.size());
+        m_dropped += seg->frames.size();
+    } else {
+        ctx->state.gop_size = m_gopSize;
+        if (m_kbps) {
+            double bytesPerSec = m_kbps * 1000.0 / 8;
+            fwht_rate rate = {};
+
+            rate.target_bytes = bytesPerSec * seg->frameNs / 1e9;
+            rate.buffer_bytes = bytesPerSec * m_latencyMs / 1000;
+            rate.qp = m_qp;
+            // Segments start with an I frame anyway, the GOP stays put.
+            rate.max_gop = m_gopSize;
+            fwht_set_rate(ctx, &rate);
+        }
+        // Without slices the segment is simply encoded on this worker.
+        RagnaCodecSlices::enable(ctx, &m_pool);
+        putFmt(seg->out, fmt);
+        for (Frame &frame : seg->frames) {
+            unsigned size;
+            __u8 *comp = fwht_compress(ctx, frame.data.data(),
+                                       frame.data.size(), &size);
+
+            /* v4l2_fwht_encode failed, its error came back as a size. */
+            if ((int)size < 0) {
+                m_dropped++;
+                continue;
+            }
+            putFrame(seg->out, frame.field, frame.flags, frame.bytesused,
+                     comp, size);
+            seg->encoded++;
+            seg->rawBytes += frame.bytesused;
+            seg->minQp = std::min(seg->minQp, ctx->stats.qp);
+            seg->maxQp = std::max(seg->maxQp, ctx->stats.qp);
+        }
+        if (seg->encoded)
+            m_qp = ctx->stats.qp;
+        giveCodec(ctx);
+    }
+    for (Frame &frame : seg->frames)
+        giveBuffer(frame.data);
+    seg->frames.clear();
+    writeInOrder(seg);
+}
+
+void RagnaFwhtRecorder::writeInOrder(Segment *seg)
+{
+    QMutexLocker lock(&m_writeLock);
+
+    m_done[seg->number] = seg;
+    for (auto it = m_done.find(m_nextWrite); it != m_done.end();
+         it = m_done.find(m_nextWrite)) {
+        Segment *s = it->second;
+
+        if (!m_failed && !s->out.empty()) {
+            if (fwrite(s->out.data(), 1, s->out.size(), m_file) != s->out.size()) {
+                perror(m_path.toLocal8Bit().data());
+                fprintf(stderr, "Recording stopped\n");
+                m_failed = true;
+            } else {
+                m_written += s->encoded;
+                m_rawBytes += s->rawBytes;
+                m_bytes += s->out.size();
+                if (m_kbps)
+                    reportRate(s);
+            }
+        }
+        m_done.erase(it);
+        delete s;
+        m_nextWrite++;
+        m_inFlight--;
+    }
+}
+
+/* Called with m_writeLock held, for every segment written. */
+void RagnaFwhtRecorder::reportRate(const Segment *seg)
+{
+    m_rateBytes += seg->out.size();
+    m_rateNs += seg->encoded * seg->frameNs;
+    if (seg->encoded) {
+        m_rateMinQp = std::min(m_rateMinQp, seg->minQp);
+        m_rateMaxQp = std::max(m_rateMaxQp, seg->maxQp);
+    }
+    if (m_rateTimer.elapsed() < 1000 || !m_rateNs)
+        return;
+
+    printf("FWHT recording: %.0f kbit/s (target %u), QP %u-%u, %llu frames dropped\n",
+           m_rateBytes * 8e6 / m_rateNs, m_kbps, m_rateMinQp, m_rateMaxQp,
+           (unsigned long long)m_dropped);
+    m_rateTimer.restart();
+    m_rateBytes = 0;
+    m_rateNs = 0;
+    m_rateMinQp = ~0U;
+    m_rateMaxQp = 0;
+}
+
+/* Call once the capture thread has stopped. */
+void RagnaFwhtRecorder::stop()
+{
+    if (m_file == NULL)
+        return;
+
+    if (m_current)
+        queueSegment();
+    m_pool.waitForDone();
+    for (codec_ctx *ctx : m_spareCodecs)
+        fwht_free(ctx);
+    m_spareCodecs.clear();
+
+    std::vector<__u8> out;
+
+    put(out, V4L_STREAM_PACKET_END);
+    put(out, 0);
+    fwrite(out.data(), 1, out.size(), m_file);
+    fclose(m_file);
+    m_file = NULL;
+
+    printf("Recorded %llu frames (%llu MiB, %.1fx smaller) to %s, %llu dropped\n",
+           (unsigned long long)m_written, (unsigned long long)(m_bytes >> 20),
+           m_bytes ? (double)m_rawBytes / m_bytes : 0.0,
+           m_path.toLocal8Bit().data(), (unsigned long long)m_dropped);
+}
@@ -0,0 +1,127 @@
+#ifndef RAGNAFWHTRECORDER_H
+# define RAGNAFWHTRECORDER_H
+# include <atomic>
+# include <map>
+# include <stdio.h>
+# include <vector>
+# include <QElapsedTimer>
+# include <QMutex>
+# include <QString>
+# include <QThreadPool>
+
+# include "ragnaframesink.h"
+
+struct codec_ctx;
+
+/*
+ * Records captured frames compressed with the FWHT codec, in the same
+ * stream layout v4l2-ctl uses (see v4l-stream.h).
+ *
+ * Frames are collected into GOP sized segments on the capture thread.
+ * Every segment starts with an I frame and gets its own codec_ctx, so
+ * segments are encoded in parallel on a pool of worker threads and only
+ * have to be written out in order. Codec contexts are handed from one
+ * segment to the next, so their buffers are only allocated once. When
+ * too many segments are waiting for a worker, new frames are dropped
+ * from the recording. Workers that are left idle help encode the slices
+ * of other segments' frames.
+ *
+ * With a bitrate, every segment is rate controlled to it, starting from
+ * the QP the last finished segment ended with, and the recorded bitrate
+ * and QPs are reported every second.
+ */
+class RagnaFwhtRecorder : public RagnaFrameSink
+{
+public:
+    RagnaFwhtRecorder();
+    ~RagnaFwhtRecorder();
+
+    bool open(const QString &path, unsigned gopSize, unsigned kbps = 0,
+              unsigned latencyMs = 1000);
+    void setFormat(const cv4l_fmt &fmt) override;
+    bool submit(const cv4l_buffer &buf, cv4l_queue *q) override;
+    void stop();
+
+private:
+    struct Frame
+    {
+        std::vector<__u8> data;
+        unsigned bytesused;
+        __u32 field;
+        __u32 flags;
+        __u64 timestamp;
+    };
+
+    struct Segment
+    {
+        unsigned number;
+        cv4l_fmt fmt;
+        std::vector<Frame> frames;
+        std::vector<__u8> out;
+        unsigned encoded;
+        uint64_t rawBytes;
+        uint64_t frameNs;
+        unsigned minQp;
+        unsigned maxQp;
+    };
+
+    bool canEncode(const cv4l_fmt &fmt);
+    codec_ctx *allocCodec(const cv4l_fmt &fmt);
+    void startSegment();
+    void queueSegment();
+    void encode(Segment *seg);
+    void writeInOrder(Segment *seg);
+    std::vector<__u8> takeBuffer();
+    void giveBuffer(std::vector<__u8> &buf);
+    codec_ctx *takeCodec(const cv4l_fmt &fmt);
+    void giveCodec(codec_ctx *ctx);
+    void reportRate(const Segment *seg);
+
+    QString m_path;
+    FILE *m_file;
+    unsigned m_gopSize;
+    unsigned m_kbps;
+    unsigned m_latencyMs;
+    QThreadPool m_pool;
+    unsigned m_maxInFlight;
+    std::atomic<unsigned> m_inFlight;
+
+    /* Set from the GUI thread, picked up by the capture thread. */
+    QMutex m_formatLock;
+    cv4l_fmt m_newFmt;
+    bool m_fmtChanged;
+
+    /* Only touched by the capture thread. */
+    cv4l_fmt m_fmt;
+    bool m_canEncode;
+    Segment *m_current;
+    unsigned m_nextNumber;
+    __u64 m_lastTimestamp;
+    uint64_t m_frameNs;
+
+    /* The QP the last finished segment ended with. */
+    std::atomic<unsigned> m_qp;
+
+    /* Finished segments wait here until every earlier one is written. */
+    QMutex m_writeLock;
+    std::map<unsigned, Segment *> m_done;
+    unsigned m_nextWrite;
+    QElapsedTimer m_rateTimer;
+    uint64_t m_rateBytes;
+    uint64_t m_rateNs;
+    unsigned m_rateMinQp;
+    unsigned m_rateMaxQp;
+
+    QMutex m_spareLock;
+    std::vector<std::vector<__u8> > m_spare;
+    std::vector<codec_ctx *> m_spareCodecs;
+
+    std::atomic<bool> m_failed;
+
+    std::atomic<uint64_t> m_written;
+    std::atomic<uint64_t> m_dropped;
+    uint64_t m_rawBytes;
+    uint64_t m_bytes;
+};
+
+#endif
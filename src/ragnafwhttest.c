@@ -0,0 +1,488 @@
+/*
+ * Checks the SIMD versions of the FWHT kernels against the plain C ones
+ * and times them. The kernels are static, so the codec is built into
+ * this program.
+ *
+ * Every level the CPU supports must give the same output bit for bit as
+ * the C code, for random blocks, every qp and the extreme inputs. The
+ * exit status is 1 if one doesn't.
+ *
+ * rlc() and derlc() are checked and timed the same way, against the
+ * coefficient by coefficient versions they replaced.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "v4l-common/codec-fwht.c"
+
+#define TEST_BLOCKS 200000
+#define TIME_BLOCKS 200000
+
+static unsigned long long rngState = 0x9e3779b97f4a7c15ULL;
+
+static unsigned rng(void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState >> 32;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned failures;
+
+static void check(const char *what, const void *c, const void *simd,
+                  size_t size, unsigned block)
+{
+    if (!memcmp(c, simd, size))
+        return;
+    if (failures++ < 10)
+        printf("  %s differs on block %u\n", what, block);
+}
+
+/* The run-length coder as it was before it used a bitmask. */
+static int rlc_ref(const s16 *in, __be16 *output, int blocktype)
+{
+    s16 block[8 * 8];
+    s16 *wp = block;
+    int i = 0;
+    int x, y;
+    int ret = 0;
+    int lastzero_run = 0;
+    int to_encode;
+
+    for (y = 0; y < 8; y++) {
+        for (x = 0; x < 8; x++) {
+            *wp = in[x + y * 8];
+            wp++;
+        }
+    }
+
+    for (i = 63; i >= 0 && !block[zigzag[i]]; i--)
+        lastzero_run++;
+
+    *output++ = (blocktype == PBLOCK ? htons(PFRAME_BIT) : 0);
+    ret++;
+
+    to_encode = 8 * 8 - (lastzero_run > 14 ? lastzero_run : 0);
+
+    i = 0;
+    while (i < to_encode) {
+        int cnt = 0;
+        int tmp;
+
+        while ((tmp = block[zigzag[i]]) == 0 && cnt < 14) {
+            cnt++;
+            i++;
+            if (i == to_encode) {
+                cnt--;
+                break;
+            }
+        }
+        *output++ = htons((cnt | tmp << 4));
+        i++;
+        ret++;
+    }
+    if (lastzero_run > 14) {
+        *output = htons(ALL_ZEROS | 0);
+        ret++;
+    }
+
+    return ret;
+}
+
+/* And the decoder that went with it. */
+static u16 derlc_ref(const __be16 **rlc_in, s16 *dwht_out,
+                     const __be16 *end_of_input)
+{
+    const __be16 *input = *rlc_in;
+    u16 stat;
+    int dec_count = 0;
+    s16 block[8 * 8 + 16];
+    s16 *wp = block;
+    int i;
+
+    if (input > end_of_input)
+        return OVERFLOW_BIT;
+    stat = ntohs(*input++);
+
+    while (dec_count < 8 * 8) {
+        s16 in;
+        int length;
+        int coeff;
+
+        if (input > end_of_input)
+            return OVERFLOW_BIT;
+        in = ntohs(*input++);
+        length = in & 0xf;
+        coeff = in >> 4;
+
+        if (length == 15) {
+            for (i = 0; i < 64 - dec_count; i++)
+                *wp++ = 0;
+            break;
+        }
+
+        for (i = 0; i < length; i++)
+            *wp++ = 0;
+        *wp++ = coeff;
+        dec_count += length + 1;
+    }
+
+    wp = block;
+    for (i = 0; i < 64; i++) {
+        int pos = zigzag[i];
+
+        dwht_out[pos % 8 + pos / 8 * 8] = *wp++;
+    }
+    *rlc_in = input;
+    return stat;
+}
+
+/* Random, flat and checkerboard pixels, at the given step. */
+static void fillPixels(u8 *pix, unsigned stride, unsigned step, unsigned kind)
+{
+    unsigned x, y;
+
+    for (y = 0; y < 8; y++) {
+        for (x = 0; x < 8; x++) {
+            u8 *p = pix + y * stride + x * step;
+
+            switch (kind) {
+            case 0:
+                *p = 0;
+                break;
+            case 1:
+                *p = 255;
+                break;
+            case 2:
+                *p = (x + y) & 1 ? 255 : 0;
+                break;
+            default:
+                *p = rng();
+                break;
+            }
+        }
+    }
+}
+
+/* Differences between two frames lie within -255..255. */
+static void fillDeltas(s16 *delta, unsigned kind)
+{
+    unsigned i;
+
+    for (i = 0; i < 64; i++) {
+        switch (kind) {
+        case 0:
+            delta[i] = -255;
+            break;
+        case 1:
+            delta[i] = 255;
+            break;
+        case 2:
+            delta[i] = ((i >> 3) + i) & 1 ? 255 : -255;
+            break;
+        default:
+            delta[i] = (int)(rng() % 511) - 255;
+            break;
+        }
+    }
+}
+
+/* Any s16 at all, the kernels must wrap like the C code. */
+static void fillCoeffs(s16 *coeff, unsigned kind)
+{
+    unsigned i;
+
+    for (i = 0; i < 64; i++) {
+        switch (kind) {
+        case 0:
+            coeff[i] = -32768;
+            break;
+        case 1:
+            coeff[i] = 32767;
+            break;
+        case 2:
+            coeff[i] = i & 1 ? 32767 : -32768;
+            break;
+        default:
+            coeff[i] = rng();
+            break;
+        }
+    }
+}
+
+static void checkTransforms(void)
+{
+    u8 pix[8 * 8 * 4];
+    s16 in[64], c[64], simd[64];
+    unsigned n;
+
+    for (n = 0; n < TEST_BLOCKS; n++) {
+        unsigned kind = n < 16 ? n % 4 : 3;
+        unsigned step = 1 + n % 4;
+        bool intra = n & 1;
+
+        fillPixels(pix, 8 * step, step, kind);
+        fwht_c(pix, c, 8 * step, step, intra);
+        fwht(pix, simd, 8 * step, step, intra);
+        check("fwht", c, simd, sizeof(c), n);
+
+        fillDeltas(in, kind);
+        fwht16_c(in, c, 8, intra);
+        fwht16(in, simd, 8, intra);
+        check("fwht16", c, simd, sizeof(c), n);
+
+        fillCoeffs(in, kind);
+        ifwht_c(in, c, intra);
+        ifwht(in, simd, intra);
+        check("ifwht", c, simd, sizeof(c), n);
+    }
+}
+
+static void checkQuantizers(void)
+{
+    s16 coeff[2][64], de_coeff[2][64];
+    unsigned n, qp;
+
+    for (n = 0; n < 64; n++) {
+        s16 in[64];
+        unsigned kind = n < 4 ? n : 3;
+
+        fillCoeffs(in, kind);
+        for (qp = 0; qp <= 0xffff; qp++) {
+            memcpy(coeff[0], in, sizeof(in));
+            memcpy(coeff[1], in, sizeof(in));
+            memset(de_coeff, 0x55, sizeof(de_coeff));
+            quantize_intra_c(coeff[0], de_coeff[0], qp);
+            quantize_intra(coeff[1], de_coeff[1], qp);
+            check("quantize_intra", coeff[0], coeff[1], sizeof(coeff[0]), n);
+            check("quantize_intra de_coeff", de_coeff[0], de_coeff[1],
+                  sizeof(de_coeff[0]), n);
+
+            memcpy(coeff[0], in, sizeof(in));
+            memcpy(coeff[1], in, sizeof(in));
+            memset(de_coeff, 0x55, sizeof(de_coeff));
+            quantize_inter_c(coeff[0], de_coeff[0], qp);
+            quantize_inter(coeff[1], de_coeff[1], qp);
+            check("quantize_inter", coeff[0], coeff[1], sizeof(coeff[0]), n);
+            check("quantize_inter de_coeff", de_coeff[0], de_coeff[1],
+                  sizeof(de_coeff[0]), n);
+        }
+    }
+
+    for (n = 0; n < TEST_BLOCKS; n++) {
+        fillCoeffs(coeff[0], n < 16 ? n % 4 : 3);
+        memcpy(coeff[1], coeff[0], sizeof(coeff[0]));
+        dequantize_intra_c(coeff[0]);
+        dequantize_intra(coeff[1]);
+        check("dequantize_intra", coeff[0], coeff[1], sizeof(coeff[0]), n);
+
+        fillCoeffs(coeff[0], n < 16 ? n % 4 : 3);
+        memcpy(coeff[1], coeff[0], sizeof(coeff[0]));
+        dequantize_inter_c(coeff[0]);
+        dequantize_inter(coeff[1]);
+        check("dequantize_inter", coeff[0], coeff[1], sizeof(coeff[0]), n);
+    }
+}
+
+/*
+ * Quantized coefficients: any density of zeros, from none to all of
+ * them, so every run length and ending shows up. Most are within the
+ * 12 bits a code keeps, the rest any s16 to check the truncation.
+ */
+static void fillSparse(s16 *coeff, unsigned n)
+{
+    unsigned density = n % 66;
+    bool wide = n % 7 == 0;
+    unsigned i;
+
+    for (i = 0; i < 64; i++) {
+        s16 v = wide ? (s16)rng() : (s16)(rng() % 4095) - 2047;
+
+        coeff[i] = rng() % 64 < density ? 0 : v;
+    }
+}
+
+static void checkEntropy(void)
+{
+    __be16 c[65 + 1], fast[65 + 1];
+    s16 in[64], out[2][64];
+    unsigned n;
+
+    for (n = 0; n < TEST_BLOCKS; n++) {
+        const __be16 *rp[2] = { c, fast };
+        int blocktype = n & 1 ? PBLOCK : IBLOCK;
+        int len[2];
+        long used[2];
+        u16 stat[2];
+        u32 hash;
+
+        fillSparse(in, n);
+        len[0] = rlc_ref(in, c, blocktype);
+        len[1] = rlc(in, fast, blocktype, &hash);
+        check("rlc length", &len[0], &len[1], sizeof(len[0]), n);
+        check("rlc", c, fast, len[0] * sizeof(c[0]), n);
+
+        stat[0] = derlc_ref(&rp[0], out[0], c + len[0] - 1);
+        stat[1] = derlc(&rp[1], out[1], fast + len[1] - 1);
+        check("derlc", out[0], out[1], sizeof(out[0]), n);
+        check("derlc stat", &stat[0], &stat[1], sizeof(stat[0]), n);
+        used[0] = rp[0] - c;
+        used[1] = rp[1] - fast;
+        check("derlc end", &used[0], &used[1], sizeof(used[0]), n);
+        /* Within 12 bits the coefficients come back as they were. */
+        if (n % 7)
+            check("rlc round trip", in, out[1], sizeof(in), n);
+    }
+
+    /*
+     * Malformed codes: runs that go past the end of the block, missing
+     * ALL_ZEROS and streams that end early must decode the same.
+     */
+    for (n = 0; n < TEST_BLOCKS; n++) {
+        const __be16 *rp[2] = { c, c };
+        const __be16 *end = c + rng() % 66;
+        u16 stat[2];
+        unsigned i;
+
+        for (i = 0; i < 66; i++)
+            c[i] = rng();
+        memset(out, 0x55, sizeof(out));
+        stat[0] = derlc_ref(&rp[0], out[0], end);
+        stat[1] = derlc(&rp[1], out[1], end);
+        check("derlc malformed stat", &stat[0], &stat[1], sizeof(stat[0]), n);
+        if (stat[0] & OVERFLOW_BIT)
+            continue;
+        check("derlc malformed", out[0], out[1], sizeof(out[0]), n);
+        check("derlc malformed end", &rp[0], &rp[1], sizeof(rp[0]), n);
+    }
+}
+
+/* rlc() and derlc() per block, over the same quantized blocks. */
+static void timeEntropy(const s16 *coeffs, bool ref, double *enc, double *dec)
+{
+    static __be16 codes[64][65];
+    s16 out[64];
+    double start = now();
+    unsigned n;
+    int sum = 0;
+    u32 hash;
+
+    for (n = 0; n < TIME_BLOCKS; n++) {
+        const s16 *in = coeffs + (n % 64) * 64;
+
+        if (ref)
+            sum += rlc_ref(in, codes[n % 64], IBLOCK);
+        else
+            sum += rlc(in, codes[n % 64], IBLOCK, &hash);
+    }
+    *enc = (now() - start) * 1e9 / TIME_BLOCKS;
+
+    start = now();
+    for (n = 0; n < TIME_BLOCKS; n++) {
+        const __be16 *rp = codes[n % 64];
+
+        if (ref)
+            derlc_ref(&rp, out, codes[n % 64] + 64);
+        else
+            derlc(&rp, out, codes[n % 64] + 64);
+        sum += out[n % 64];
+    }
+    *dec = (now() - start) * 1e9 / TIME_BLOCKS;
+    if (sum == 0x7fffffff)
+        printf("\n");
+}
+
+/* What one intra block costs the encoder and decoder, in ns. */
+static double timeBlocks(const u8 *pix)
+{
+    s16 coeff[64], de_coeff[64], out[64];
+    double start = now();
+    unsigned n;
+    int sum = 0;
+
+    for (n = 0; n < TIME_BLOCKS; n++) {
+        const u8 *p = pix + (n % 64) * 64;
+
+        fwht(p, coeff, 8, 1, true);
+        quantize_intra(coeff, de_coeff, 20);
+        dequantize_intra(coeff);
+        ifwht(coeff, out, 1);
+        sum += out[n % 64];
+    }
+    /* Keep the loop from being optimized away. */
+    if (sum == 0x7fffffff)
+        printf("\n");
+    return (now() - start) * 1e9 / TIME_BLOCKS;
+}
+
+int main(void)
+{
+    enum fwht_simd supported = fwht_simd_supported();
+    static u8 pix[64 * 64];
+    static s16 sparse[64 * 64], dense[64 * 64];
+    enum fwht_simd simd;
+    unsigned i;
+
+    for (i = 0; i < sizeof(pix); i++)
+        pix[i] = rng();
+
+    fwht_set_simd(FWHT_SIMD_NONE);
+    printf("%-8s %6.1f ns per block\n", fwht_simd_name(FWHT_SIMD_NONE),
+           timeBlocks(pix));
+
+    for (simd = FWHT_SIMD_SSE41; simd <= supported; simd++) {
+        unsigned before = failures;
+
+        fwht_set_simd(simd);
+        checkTransforms();
+        checkQuantizers();
+        printf("%-8s %6.1f ns per block, %s\n", fwht_simd_name(simd),
+               timeBlocks(pix), failures == before ? "matches C" : "DIFFERS");
+    }
+    if (supported == FWHT_SIMD_NONE)
+        printf("No SIMD support on this CPU, nothing to compare\n");
+
+    /*
+     * Quantized intra blocks: a smooth gradient with a little noise gives
+     * the sparse blocks of a typical frame, random pixels dense ones.
+     */
+    for (i = 0; i < 64; i++) {
+        s16 de_coeff[64];
+        u8 smooth[64];
+        unsigned j;
+
+        for (j = 0; j < 64; j++)
+            smooth[j] = 100 + j % 8 * 3 + j / 8 * 2 + rng() % (1 + i % 16);
+        fwht(smooth, sparse + i * 64, 8, 1, true);
+        quantize_intra(sparse + i * 64, de_coeff, 20);
+        fwht(pix + i * 64, dense + i * 64, 8, 1, true);
+        quantize_intra(dense + i * 64, de_coeff, 20);
+    }
+    {
+        unsigned before = failures;
+        double enc[2], dec[2], encRef[2], decRef[2];
+
+        checkEntropy();
+        timeEntropy(sparse, true, &encRef[0], &decRef[0]);
+        timeEntropy(sparse, false, &enc[0], &dec[0]);
+        timeEntropy(dense, true, &encRef[1], &decRef[1]);
+        timeEntropy(dense, false, &enc[1], &dec[1]);
+        printf("rlc      %6.1f ns per sparse block, was %.1f, "
+               "dense %.1f, was %.1f\n", enc[0], encRef[0], enc[1], encRef[1]);
+        printf("derlc    %6.1f ns per sparse block, was %.1f, "
+               "dense %.1f, was %.1f, %s\n", dec[0], decRef[0], dec[1],
+               decRef[1], failures == before ? "matches" : "DIFFERS");
+    }
+    return failures ? 1 : 0;
+}
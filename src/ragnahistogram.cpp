@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <stdio.h>
+
+#include "ragnahistogram.h"
+
+RagnaHistogram::RagnaHistogram(uint64_t bucketNs, unsigned buckets)
+    : m_bucketNs(bucketNs),
+      m_buckets(buckets, 0),
+      m_count(0),
+      m_max(0)
+{
+}
+
+void RagnaHistogram::add(uint64_t ns)
+{
+    uint64_t index = ns / m_bucketNs;
+
+    if (index >= m_buckets.size())
+        index = m_buckets.size() - 1;
+
+    m_buckets[index]++;
+    m_count++;
+    if (ns > m_max)
+        m_max = ns;
+}
+
+void RagnaHistogram::reset()
+{
+    std::fill(m_buckets.begin(), m_buckets.end(), 0);
+    m_count = 0;
+    m_max = 0;
+}
+
+/* Returns the upper edge of the bucket holding the given percentile. */
+uint64_t RagnaHistogram::percentile(unsigned pct) const
+{
+    uint64_t target = ((uint64_t)m_count * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    if (m_count == 0)
+        return 0;
+
+    for (unsigned i = 0; i < m_buckets.size(); i++) {
+        seen += m_buckets[i];
+        if (seen >= target) {
+            uint64_t edge = (i + 1) * m_bucketNs;
+
+            return edge < m_max ? edge : m_max;
+        }
+    }
+
+    return m_max;
+}
+
+void RagnaHistogram::report(const char *label) const
+{
+    if (m_count == 0) {
+        printf("%s: no samples\n", label);
+        return;
+    }
+
+    printf("%s: %u samples, p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           label, m_count,
+           percentile(50) / 1e6, percentile(95) / 1e6,
+           percentile(99) / 1e6, m_max / 1e6);
+}
@@ -0,0 +1,30 @@
+#ifndef RAGNAHISTOGRAM_H
+# define RAGNAHISTOGRAM_H
+# include <stdint.h>
+# include <vector>
+
+/*
+ * Collects durations (in nanoseconds) into fixed-width buckets so that
+ * percentiles can be reported without keeping every sample. Values past
+ * the last bucket are counted in it, max() is always exact.
+ */
+class RagnaHistogram
+{
+public:
+    RagnaHistogram(uint64_t bucketNs = 10000, unsigned buckets = 10000);
+
+    void add(uint64_t ns);
+    void reset();
+    unsigned count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+    uint64_t percentile(unsigned pct) const;
+    void report(const char *label) const;
+
+private:
+    uint64_t m_bucketNs;
+    std::vector<unsigned> m_buckets;
+    unsigned m_count;
+    uint64_t m_max;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "ragnalatency.h"
+
+static const char *stage_names[LatencyStageCount] = {
+    "Latency capture->dqbuf",
+    "Latency dqbuf->upload",
+    "Latency upload",
+    "Latency upload->draw",
+    "Latency draw->gpu done",
+    "Latency draw->swap",
+    "Latency capture->photon",
+};
+
+RagnaLatency::RagnaLatency()
+    : m_lastReport(0)
+{
+}
+
+uint64_t RagnaLatency::now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void RagnaLatency::add(const RagnaLatencyRecord &r)
+{
+    uint64_t done = r.gpuDone > r.swapped ? r.gpuDone : r.swapped;
+    uint64_t start = r.timestamp ? r.timestamp : r.dequeued;
+
+    if (r.timestamp && r.dequeued >= r.timestamp)
+        m_stages[LatencyCapture].add(r.dequeued - r.timestamp);
+
+    m_stages[LatencyQueue].add(r.uploadStart - r.dequeued);
+    m_stages[LatencyUpload].add(r.uploadEnd - r.uploadStart);
+    m_stages[LatencySubmit].add(r.submitted - r.uploadEnd);
+    m_stages[LatencyGpu].add(r.gpuDone - r.submitted);
+    m_stages[LatencySwap].add(r.swapped - r.submitted);
+    if (done >= start)
+        m_stages[LatencyTotal].add(done - start);
+}
+
+void RagnaLatency::reportIfDue(unsigned intervalMs)
+{
+    uint64_t t = now();
+
+    if (m_lastReport == 0) {
+        m_lastReport = t;
+        return;
+    }
+
+    if (t - m_lastReport < (uint64_t)intervalMs * 1000000ull)
+        return;
+
+    for (int i = 0; i < LatencyStageCount; i++) {
+        m_stages[i].report(stage_names[i]);
+        m_stages[i].reset();
+    }
+
+    m_lastReport = t;
+}
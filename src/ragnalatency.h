@@ -0,0 +1,50 @@
+#ifndef RAGNALATENCY_H
+# define RAGNALATENCY_H
+# include <stdint.h>
+
+# include "ragnahistogram.h"
+
+enum RagnaLatencyStage
+{
+    LatencyCapture,     /* Buffer timestamp to dqbuf. */
+    LatencyQueue,       /* dqbuf to the start of the texture upload. */
+    LatencyUpload,      /* Texture upload. */
+    LatencySubmit,      /* End of upload to the draw call returning. */
+    LatencyGpu,         /* Draw call to the GPU signaling its fence. */
+    LatencySwap,        /* Draw call to the buffer swap finishing. */
+    LatencyTotal,       /* Buffer timestamp to the later of the last two. */
+    LatencyStageCount
+};
+
+/*
+ * Times (CLOCK_MONOTONIC, in nanoseconds) one frame passes on its way to
+ * the screen. Zero means the point hasn't been reached yet, or, for the
+ * timestamp, that the driver's timestamps aren't monotonic.
+ */
+struct RagnaLatencyRecord
+{
+    uint64_t timestamp;
+    uint64_t dequeued;
+    uint64_t uploadStart;
+    uint64_t uploadEnd;
+    uint64_t submitted;
+    uint64_t gpuDone;
+    uint64_t swapped;
+};
+
+class RagnaLatency
+{
+public:
+    RagnaLatency();
+
+    static uint64_t now();
+
+    void add(const RagnaLatencyRecord &);
+    void reportIfDue(unsigned intervalMs);
+
+private:
+    RagnaHistogram m_stages[LatencyStageCount];
+    uint64_t m_lastReport;
+};
+
+#endif
@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "ragnarecorder.h"
+
+static size_t alignUp(size_t size)
+{
+    return (size + RAGNA_RECORD_ALIGN - 1) & ~(size_t)(RAGNA_RECORD_ALIGN - 1);
+}
+
+RagnaRecorder::RagnaRecorder()
+    : m_segmentSize(0),
+      m_segment(0),
+      m_fd(-1),
+      m_offset(0),
+      m_stop(false),
+      m_failed(false),
+      m_written(0),
+      m_dropped(0),
+      m_bytes(0)
+{
+    m_wakeFd = eventfd(0, EFD_CLOEXEC);
+    for (int i = 0; i < RAGNA_RECORD_SLOTS; i++) {
+        m_slots[i].data = NULL;
+        m_slots[i].capacity = 0;
+        m_slots[i].size = 0;
+        m_free.push(i);
+    }
+}
+
+RagnaRecorder::~RagnaRecorder()
+{
+    stop();
+    closeSegment();
+    for (int i = 0; i < RAGNA_RECORD_SLOTS; i++)
+        free(m_slots[i].data);
+    close(m_wakeFd);
+}
+
+bool RagnaRecorder::open(const QString &path, uint64_t segmentSize)
+{
+    m_path = path;
+    m_segmentSize = alignUp(segmentSize);
+    m_segment = 0;
+    return openSegment();
+}
+
+void RagnaRecorder::setFormat(const cv4l_fmt &fmt)
+{
+    QMutexLocker lock(&m_formatLock);
+
+    m_fmt = fmt;
+}
+
+void RagnaRecorder::wake()
+{
+    uint64_t one = 1;
+
+    if (write(m_wakeFd, &one, sizeof(one)) < 0) {
+        /* The counter is already non-zero, so the thread will wake. */
+    }
+}
+
+void RagnaRecorder::stop()
+{
+    if (isRunning() == false)
+        return;
+
+    m_stop = true;
+    wake();
+    wait();
+    printf("Recorded %llu frames (%llu MiB) to %s, %llu dropped\n",
+           (unsigned long long)m_written, (unsigned long long)(m_bytes >> 20),
+           m_path.toLocal8Bit().data(), (unsigned long long)m_dropped);
+}
+
+bool RagnaRecorder::submit(const cv4l_buffer &buf, cv4l_queue *q)
+{
+    int index;
+
+    if (m_failed)
+        return false;
+    if (!m_free.pop(index)) {
+        m_dropped++;
+        return false;
+    }
+
+    Slot &slot = m_slots[index];
+    unsigned planes = q->g_num_planes();
+    size_t used = sizeof(RagnaRecordHeader);
+
+    for (unsigned p = 0; p < planes; p++)
+        used += buf.g_bytesused(p);
+    slot.size = alignUp(used);
+
+    if (slot.capacity < slot.size) {
+        void *data;
+
+        free(slot.data);
+        slot.data = NULL;
+        slot.capacity = 0;
+        if (posix_memalign(&data, RAGNA_RECORD_ALIGN, slot.size) == 0) {
+            slot.data = (__u8 *)data;
+            slot.capacity = slot.size;
+        }
+    }
+    if (slot.data == NULL) {
+        /* Hand it over empty, the writer passes it straight back. */
+        slot.size = 0;
+        m_dropped++;
+        m_ready.push(index);
+        wake();
+        return false;
+    }
+
+    RagnaRecordHeader *hdr = (RagnaRecordHeader *)slot.data;
+    __u8 *out = slot.data + sizeof(*hdr);
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = RAGNA_RECORD_MAGIC;
+    hdr->version = RAGNA_RECORD_VERSION;
+    hdr->headerSize = sizeof(*hdr);
+    hdr->recordSize = slot.size;
+    {
+        QMutexLocker lock(&m_formatLock);
+
+        hdr->pixelformat = m_fmt.g_pixelformat();
+        hdr->width = m_fmt.g_width();
+        hdr->height = m_fmt.g_height();
+        hdr->colorspace = m_fmt.g_colorspace();
+        hdr->ycbcrEnc = m_fmt.g_ycbcr_enc();
+        hdr->quantization = m_fmt.g_quantization();
+        hdr->xferFunc = m_fmt.g_xfer_func();
+        for (unsigned p = 0; p < planes; p++)
+            hdr->bytesperline[p] = m_fmt.g_bytesperline(p);
+    }
+    hdr->field = buf.g_field();
+    hdr->numPlanes = planes;
+    hdr->timestampSec = buf.g_timestamp().tv_sec;
+    hdr->timestampUsec = buf.g_timestamp().tv_usec;
+    hdr->sequence = buf.g_sequence();
+    hdr->flags = buf.g_flags();
+
+    for (unsigned p = 0; p < planes; p++) {
+        unsigned size = buf.g_bytesused(p);
+
+        hdr->bytesused[p] = size;
+        memcpy(out, q->g_dataptr(buf.g_index(), p), size);
+        out += size;
+    }
+    memset(out, 0, slot.data + slot.size - out);
+
+    m_ready.push(index);
+    wake();
+    return true;
+}
+
+bool RagnaRecorder::openSegment()
+{
+    QByteArray name = QString("%1.%2").arg(m_path)
+                          .arg(m_segment, 4, 10, QChar('0')).toLocal8Bit();
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+    m_fd = ::open(name.data(), flags | O_DIRECT, 0644);
+    if (m_fd < 0 && errno == EINVAL) {
+        /* tmpfs and some network filesystems refuse O_DIRECT. */
+        m_fd = ::open(name.data(), flags, 0644);
+    }
+    if (m_fd < 0) {
+        perror(name.data());
+        return false;
+    }
+
+    if (fallocate(m_fd, 0, 0, m_segmentSize)) {
+        /* Not every filesystem can, it only avoids fragmentation. */
+    }
+    m_offset = 0;
+    m_segment++;
+    return true;
+}
+
+void RagnaRecorder::closeSegment()
+{
+    if (m_fd < 0)
+        return;
+
+    /* Drop what was preallocated but never written. */
+    if (ftruncate(m_fd, m_offset))
+        perror("recording");
+    close(m_fd);
+    m_fd = -1;
+}
+
+bool RagnaRecorder::writeSlot(const Slot &slot)
+{
+    if (m_fd < 0 || (m_offset && m_offset + slot.size > m_segmentSize)) {
+        closeSegment();
+        if (!openSegment())
+            return false;
+    }
+
+    size_t done = 0;
+
+    while (done < slot.size) {
+        ssize_t ret = pwrite(m_fd, slot.data + done, slot.size - done,
+                             m_offset + done);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("recording");
+            return false;
+        }
+        done += ret;
+    }
+    m_offset += slot.size;
+    m_bytes += slot.size;
+    m_written++;
+    return true;
+}
+
+void RagnaRecorder::run()
+{
+    for (;;) {
+        int index;
+
+        while (m_ready.pop(index)) {
+            const Slot &slot = m_slots[index];
+
+            if (slot.size && !m_failed && !writeSlot(slot)) {
+                fprintf(stderr, "Recording stopped\n");
+                m_failed = true;
+            }
+            m_free.push(index);
+        }
+        if (m_stop)
+            break;
+
+        uint64_t count;
+
+        if (read(m_wakeFd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            perror("recorder");
+            break;
+        }
+    }
+    closeSegment();
+}
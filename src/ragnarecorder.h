@@ -0,0 +1,110 @@
+#ifndef RAGNARECORDER_H
+# define RAGNARECORDER_H
+# include <atomic>
+# include <QMutex>
+# include <QString>
+# include <QThread>
+
+# include "cv4l-helpers.h"
+# include "ragnaframesink.h"
+# include "ragnaring.h"
+
+# define RAGNA_RECORD_MAGIC 0x524e4752 /* "RGNR" */
+# define RAGNA_RECORD_VERSION 1
+
+/*
+ * Every record in a recording starts with this header. The planes follow
+ * it back to back, starting at headerSize, and the record is padded with
+ * zeroes to recordSize, a multiple of RAGNA_RECORD_ALIGN. All fields are
+ * in host byte order.
+ */
+struct RagnaRecordHeader
+{
+    __u32 magic;
+    __u16 version;
+    __u16 headerSize;
+    __u32 recordSize;
+    __u32 pixelformat;
+    __u32 width;
+    __u32 height;
+    __u32 field;
+    __u32 colorspace;
+    __u32 ycbcrEnc;
+    __u32 quantization;
+    __u32 xferFunc;
+    __u32 numPlanes;
+    __u32 bytesperline[VIDEO_MAX_PLANES];
+    __u32 bytesused[VIDEO_MAX_PLANES];
+    __u64 timestampSec;
+    __u32 timestampUsec;
+    __u32 sequence;
+    __u32 flags;
+    __u32 reserved[5];
+};
+
+/* O_DIRECT needs buffers, lengths and offsets aligned to the block size. */
+# define RAGNA_RECORD_ALIGN 4096
+# define RAGNA_RECORD_SLOTS 8
+
+/*
+ * Writes every captured frame to disk, as it came from the driver, on its
+ * own thread. The capture thread copies each frame into a free slot and
+ * moves on; when every slot is still waiting for the disk the frame is
+ * dropped from the recording instead, so a slow disk never holds back the
+ * driver or the display.
+ *
+ * The recording is split over segment files named <path>.0000,
+ * <path>.0001 and so on, each preallocated to the segment size and
+ * written with O_DIRECT where the filesystem allows it.
+ */
+class RagnaRecorder : public QThread, public RagnaFrameSink
+{
+public:
+    RagnaRecorder();
+    ~RagnaRecorder();
+
+    bool open(const QString &path, uint64_t segmentSize);
+    void setFormat(const cv4l_fmt &fmt) override;
+    bool submit(const cv4l_buffer &buf, cv4l_queue *q) override;
+    void stop();
+
+    uint64_t written() const { return m_written; }
+    uint64_t dropped() const { return m_dropped; }
+
+private:
+    struct Slot
+    {
+        __u8 *data;
+        size_t capacity;
+        size_t size;
+    };
+
+    void run() override;
+    bool writeSlot(const Slot &slot);
+    bool openSegment();
+    void closeSegment();
+    void wake();
+
+    QString m_path;
+    uint64_t m_segmentSize;
+    unsigned m_segment;
+    int m_fd;
+    uint64_t m_offset;
+    int m_wakeFd;
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_failed;
+
+    /* Owned by the capture thread while free, by this thread while ready. */
+    Slot m_slots[RAGNA_RECORD_SLOTS];
+    RagnaRing<int, RAGNA_RECORD_SLOTS> m_free;
+    RagnaRing<int, RAGNA_RECORD_SLOTS> m_ready;
+
+    QMutex m_formatLock;
+    cv4l_fmt m_fmt;
+
+    std::atomic<uint64_t> m_written;
+    std::atomic<uint64_t> m_dropped;
+    uint64_t m_bytes;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef RAGNARING_H
+# define RAGNARING_H
+# include <atomic>
+
+/*
+ * A bounded lock-free ring for passing values from exactly one producer
+ * thread to exactly one consumer thread. Size must be a power of two.
+ *
+ * head is only written by the producer and tail only by the consumer, so
+ * each side only needs an acquire load of the other side's index.
+ */
+template <typename T, unsigned Size>
+class RagnaRing
+{
+    static_assert(Size && (Size & (Size - 1)) == 0,
+                  "RagnaRing size must be a power of two");
+
+public:
+    RagnaRing() : m_head(0), m_tail(0) {}
+
+    bool push(const T &value)
+    {
+        unsigned head = m_head.load(std::memory_order_relaxed);
+
+        if (head - m_tail.load(std::memory_order_acquire) == Size)
+            return false;
+
+        m_slots[head & (Size - 1)] = value;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value)
+    {
+        unsigned tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+
+        value = m_slots[tail & (Size - 1)];
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    unsigned count() const
+    {
+        return m_head.load(std::memory_order_acquire) -
+               m_tail.load(std::memory_order_acquire);
+    }
+
+private:
+    alignas(64) std::atomic<unsigned> m_head;
+    alignas(64) std::atomic<unsigned> m_tail;
+    alignas(64) T m_slots[Size];
+};
+
+#endif
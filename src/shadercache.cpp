@@ -0,0 +1,97 @@
+#include <string.h>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+
+#include "capture.h"
+
+#define RAGNA_SHADER_CACHE_DIR ".config/ragna/shadercache/"
+
+/*
+ * Linked programs are stored as <sha1>.bin, where the hash covers the
+ * shader sources and the GL implementation that produced the binary. A
+ * driver update therefore never loads a stale binary, it just misses.
+ * Returns an empty path if the implementation can't save binaries.
+ */
+QString CaptureWin::programCachePath(const QString &fragment, const QString &vertex)
+{
+	GLint formats = 0;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats == 0)
+		return QString();
+
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+
+	hash.addData((const char *)glGetString(GL_VENDOR));
+	hash.addData((const char *)glGetString(GL_RENDERER));
+	hash.addData((const char *)glGetString(GL_VERSION));
+	hash.addData(vertex.toUtf8());
+	hash.addData(fragment.toUtf8());
+
+	return QDir::homePath() + "/" RAGNA_SHADER_CACHE_DIR +
+		hash.result().toHex() + ".bin";
+}
+
+bool CaptureWin::loadProgramBinary(QOpenGLShaderProgram *program, const QString &path)
+{
+	QFile f(path);
+
+	if (f.open(QIODevice::ReadOnly) == false)
+		return false;
+
+	QByteArray ba = f.readAll();
+	GLenum format;
+	GLint linked = 0;
+
+	if (ba.size() <= (int)sizeof(format))
+		return false;
+
+	memcpy(&format, ba.constData(), sizeof(format));
+	program->create();
+	glProgramBinary(program->programId(), format,
+			ba.constData() + sizeof(format), ba.size() - sizeof(format));
+	glGetProgramiv(program->programId(), GL_LINK_STATUS, &linked);
+
+	if (!linked) {
+		// Rejected by the driver, rebuild it from source instead.
+		while (glGetError() != GL_NO_ERROR)
+			;
+		return false;
+	}
+
+	if (m_verbose)
+		printf("Loaded shader program from %s\n", path.toUtf8().data());
+
+	// With no shaders attached, link() just picks up the link status.
+	return program->link();
+}
+
+void CaptureWin::saveProgramBinary(QOpenGLShaderProgram *program, const QString &path)
+{
+	GLint length = 0;
+	GLenum format;
+
+	glGetProgramiv(program->programId(), GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	QByteArray ba(sizeof(format) + length, 0);
+
+	glGetProgramBinary(program->programId(), length, &length, &format,
+			   ba.data() + sizeof(format));
+	memcpy(ba.data(), &format, sizeof(format));
+	ba.resize(sizeof(format) + length);
+
+	if (QDir(QDir::homePath()).mkpath(RAGNA_SHADER_CACHE_DIR) == false)
+		return;
+
+	QSaveFile f(path);
+
+	if (f.open(QIODevice::WriteOnly) == false)
+		return;
+
+	f.write(ba);
+	f.commit();
+}
@@ -0,0 +1,165 @@
+#include <string.h>
+
+#include "capture.h"
+
+// Planes are packed into one unpack buffer, each starting on this boundary.
+#define UPLOAD_PLANE_ALIGN 256
+
+// How long to wait for the GPU to release a ring slot before giving up.
+#define UPLOAD_FENCE_TIMEOUT_NS 1000000000ull
+
+static unsigned uploadPlaneSize(unsigned size)
+{
+	return (size + UPLOAD_PLANE_ALIGN - 1) & ~(UPLOAD_PLANE_ALIGN - 1);
+}
+
+void CaptureWin::initUploadRing(unsigned size)
+{
+	bool persistent = context()->hasExtension("GL_ARB_buffer_storage") ||
+			  context()->hasExtension("GL_EXT_buffer_storage");
+
+	freeUploadRing();
+	glGenBuffers(UPLOAD_RING_SIZE, m_uploadBuf);
+
+	for (unsigned i = 0; i < UPLOAD_RING_SIZE; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_uploadBuf[i]);
+		if (persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT |
+					   GL_MAP_PERSISTENT_BIT |
+					   GL_MAP_COHERENT_BIT;
+
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+			m_uploadMap[i] = (__u8 *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+								  0, size, flags);
+		} else {
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	checkError("initUploadRing");
+
+	m_uploadSlot = 0;
+	m_uploadSlotSize = size;
+
+	if (m_verbose)
+		printf("Upload ring: %u x %u bytes%s\n", UPLOAD_RING_SIZE, size,
+		       persistent ? " (persistently mapped)" : "");
+}
+
+void CaptureWin::freeUploadRing()
+{
+	if (m_uploadSlotSize == 0)
+		return;
+
+	for (unsigned i = 0; i < UPLOAD_RING_SIZE; i++) {
+		if (m_uploadFence[i])
+			glDeleteSync(m_uploadFence[i]);
+		if (m_uploadMap[i]) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_uploadBuf[i]);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		m_uploadFence[i] = 0;
+		m_uploadMap[i] = 0;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glDeleteBuffers(UPLOAD_RING_SIZE, m_uploadBuf);
+	m_uploadSlotSize = 0;
+}
+
+void CaptureWin::uploadBegin()
+{
+	unsigned planes = m_v4l_fmt.g_num_planes();
+	unsigned planeSize[MAX_TEXTURES_NEEDED];
+	unsigned size = 0;
+
+	m_uploadBound = false;
+	for (unsigned i = 0; i < planes; i++)
+		m_texData[i] = m_curData[i];
+
+	if (m_uploadMode != UploadPBO)
+		return;
+
+	for (unsigned i = 0; i < planes; i++) {
+		planeSize[i] = m_v4l_fmt.g_sizeimage(i);
+		if (m_cpuConvert)
+			planeSize[i] = m_convert.frameSize(m_v4l_fmt.g_width(),
+							   m_v4l_fmt.g_height());
+		size += uploadPlaneSize(planeSize[i]);
+	}
+
+	if (size != m_uploadSlotSize)
+		initUploadRing(size);
+
+	// The slot was last used UPLOAD_RING_SIZE frames ago, so this normally
+	// returns at once. The copy below then overlaps with the GPU still
+	// working on the previous frames.
+	unsigned slot = m_uploadSlot;
+
+	if (m_uploadFence[slot]) {
+		GLenum ret = glClientWaitSync(m_uploadFence[slot],
+					      GL_SYNC_FLUSH_COMMANDS_BIT,
+					      UPLOAD_FENCE_TIMEOUT_NS);
+
+		if (ret == GL_TIMEOUT_EXPIRED || ret == GL_WAIT_FAILED) {
+			// The GPU may still read the slot, so leave it alone
+			// and upload straight from the capture buffer. A slot
+			// that timed out keeps its fence for the next frame.
+			if (ret == GL_WAIT_FAILED) {
+				glDeleteSync(m_uploadFence[slot]);
+				m_uploadFence[slot] = 0;
+			}
+			if (m_verbose)
+				printf("Upload ring slot %u is busy, uploading directly\n",
+				       slot);
+			checkError("uploadBegin wait");
+			return;
+		}
+		glDeleteSync(m_uploadFence[slot]);
+		m_uploadFence[slot] = 0;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_uploadBuf[slot]);
+
+	__u8 *dst = m_uploadMap[slot];
+
+	if (dst == NULL)
+		dst = (__u8 *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+					       GL_MAP_WRITE_BIT |
+					       GL_MAP_INVALIDATE_BUFFER_BIT |
+					       GL_MAP_UNSYNCHRONIZED_BIT);
+
+	if (dst == NULL) {
+		// Mapping failed, upload straight from the capture buffer.
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		checkError("uploadBegin map");
+		return;
+	}
+
+	uintptr_t offset = 0;
+
+	for (unsigned i = 0; i < planes; i++) {
+		// Short frames are dropped in acquireFrame, but never copy
+		// more than the frame holds.
+		memcpy(dst + offset, m_curData[i],
+		       qMin(planeSize[i], m_curSize[i]));
+		m_texData[i] = (__u8 *)offset;
+		offset += uploadPlaneSize(planeSize[i]);
+	}
+
+	if (m_uploadMap[slot] == NULL)
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	m_uploadBound = true;
+	checkError("uploadBegin");
+}
+
+void CaptureWin::uploadEnd()
+{
+	if (m_uploadBound == false)
+		return;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	m_uploadFence[m_uploadSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	m_uploadSlot = (m_uploadSlot + 1) % UPLOAD_RING_SIZE;
+	m_uploadBound = false;
+}
@@ -29,6 +29,10 @@
 
 #define ALL_ZEROS 15
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static const uint8_t zigzag[64] = {
 	0,
 	1,  8,
@@ -48,124 +52,145 @@ static const uint8_t zigzag[64] = {
 };
 
 /*
- * noinline_for_stack to work around
- * https://bugs.llvm.org/show_bug.cgi?id=38809
+ * Bit i of the result is set when zz[i] is not zero, so that rlc() can
+ * find the runs of zeros with ctz instead of testing one coefficient at a
+ * time.
  */
-static int noinline_for_stack
-rlc(const s16 *in, __be16 *output, int blocktype)
-{
-	s16 block[8 * 8];
-	s16 *wp = block;
-	int i = 0;
-	int x, y;
-	int ret = 0;
-
-	/* read in block from framebuffer */
-	int lastzero_run = 0;
-	int to_encode;
-
-	for (y = 0; y < 8; y++) {
-		for (x = 0; x < 8; x++) {
-			*wp = in[x + y * 8];
-			wp++;
-		}
+static inline u64 nonzero_mask(const s16 *zz)
+{
+	u64 mask = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i < 64; i += 16) {
+		__m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(zz + i)),
+					    zero);
+		__m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(zz + i + 8)),
+					    zero);
+
+		mask |= (u64)(u16)~_mm_movemask_epi8(_mm_packs_epi16(a, b)) << i;
+	}
+#else
+	int i;
+
+	for (i = 0; i < 64; i++)
+		mask |= (u64)(zz[i] != 0) << i;
+#endif
+	return mask;
+}
+
+/*
+ * Cheap fingerprint of an rlc() code minus its header, so encode_rows()
+ * only compares the codes of blocks that are likely duplicates. It takes
+ * four codes per multiply, one per code would cost dense blocks more than
+ * the bitmask saves.
+ */
+static inline u32 rlc_hash(const __be16 *code, unsigned int n)
+{
+	u64 h = 0xcbf29ce484222325ULL;
+	u64 w;
+
+	for (; n >= 4; code += 4, n -= 4) {
+		memcpy(&w, code, sizeof(w));
+		h = (h ^ w) * 0x100000001b3ULL;
 	}
+	for (; n; code++, n--)
+		h = (h ^ *code) * 0x100000001b3ULL;
+	return h ^ h >> 32;
+}
+
+/*
+ * Writes the run-length code of a block and returns its length. Runs of
+ * zeros are found with the bitmask of nonzero coefficients, the output is
+ * the same as the coefficient by coefficient loop this replaced, quirks
+ * included: a run longer than 14 is cut at 14 and the zero after it coded
+ * as a coefficient, and a block ending in 14 zeros or fewer codes them as
+ * a run with a zero coefficient rather than as ALL_ZEROS.
+ */
+static int rlc(const s16 *in, __be16 *output, int blocktype, u32 *hash)
+{
+	s16 block[8 * 8] __attribute__((aligned(16)));
+	__be16 *start = output;
+	unsigned int pos = 0;
+	unsigned int to_encode = 8 * 8;
+	u64 mask;
+	int i;
 
-	/* keep track of amount of trailing zeros */
-	for (i = 63; i >= 0 && !block[zigzag[i]]; i--)
-		lastzero_run++;
+	for (i = 0; i < 64; i++)
+		block[i] = in[zigzag[i]];
+	mask = nonzero_mask(block);
 
 	*output++ = (blocktype == PBLOCK ? htons(PFRAME_BIT) : 0);
-	ret++;
-
-	to_encode = 8 * 8 - (lastzero_run > 14 ? lastzero_run : 0);
-
-	i = 0;
-	while (i < to_encode) {
-		int cnt = 0;
-		int tmp;
-
-		/* count leading zeros */
-		while ((tmp = block[zigzag[i]]) == 0 && cnt < 14) {
-			cnt++;
-			i++;
-			if (i == to_encode) {
-				cnt--;
-				break;
-			}
-		}
+
+	/* more than 14 trailing zeros end the block with ALL_ZEROS */
+	if (!mask || __builtin_clzll(mask) > 14)
+		to_encode = mask ? 64 - __builtin_clzll(mask) : 0;
+
+	/*
+	 * One code per nonzero coefficient, taken lowest bit first so that
+	 * dense blocks don't wait on pos. Runs of more than 14 zeros are cut
+	 * into codes of 14 zeros and a zero coefficient.
+	 */
+	while (mask) {
+		unsigned int next = __builtin_ctzll(mask);
+
+		mask &= mask - 1;
+		for (; next - pos > 14; pos += 15)
+			*output++ = htons(14);
 		/* 4 bits for run, 12 for coefficient (quantization by 4) */
-		*output++ = htons((cnt | tmp << 4));
-		i++;
-		ret++;
-	}
-	if (lastzero_run > 14) {
-		*output = htons(ALL_ZEROS | 0);
-		ret++;
+		*output++ = htons((next - pos) | (u16)block[next] << 4);
+		pos = next + 1;
 	}
-
-	return ret;
+	/* the zeros left before to_encode end in a zero coefficient */
+	if (pos < to_encode)
+		*output++ = htons(to_encode - pos - 1);
+	if (to_encode < 64)
+		*output++ = htons(ALL_ZEROS | 0);
+
+	*hash = rlc_hash(start + 1, output - start - 1);
+	return output - start;
 }
 
 /*
  * This function will worst-case increase rlc_in by 65*2 bytes:
  * one s16 value for the header and 8 * 8 coefficients of type s16.
  */
-static noinline_for_stack u16
-derlc(const __be16 **rlc_in, s16 *dwht_out, const __be16 *end_of_input)
+static u16 derlc(const __be16 **rlc_in, s16 *dwht_out,
+		 const __be16 *end_of_input)
 {
 	/* header */
 	const __be16 *input = *rlc_in;
+	unsigned int pos = 0;
 	u16 stat;
-	int dec_count = 0;
-	s16 block[8 * 8 + 16];
-	s16 *wp = block;
-	int i;
 
 	if (input > end_of_input)
 		return OVERFLOW_BIT;
 	stat = ntohs(*input++);
 
 	/*
-	 * Now de-compress, it expands one byte to up to 15 bytes
-	 * (or fills the remainder of the 64 bytes with zeroes if it
-	 * is the last byte to expand).
-	 *
-	 * So block has to be 8 * 8 + 16 bytes, the '+ 16' is to
-	 * allow for overflow if the incoming data was malformed.
+	 * Now de-compress. Every code skips up to 14 zeros and places one
+	 * coefficient, or ends the block. Coefficients that malformed data
+	 * would place past the end of the block are dropped.
 	 */
-	while (dec_count < 8 * 8) {
+	memset(dwht_out, 0, 8 * 8 * sizeof(*dwht_out));
+	while (pos < 8 * 8) {
 		s16 in;
-		int length;
-		int coeff;
+		unsigned int length;
 
 		if (input > end_of_input)
 			return OVERFLOW_BIT;
 		in = ntohs(*input++);
 		length = in & 0xf;
-		coeff = in >> 4;
 
-		/* fill remainder with zeros */
-		if (length == 15) {
-			for (i = 0; i < 64 - dec_count; i++)
-				*wp++ = 0;
+		/* the remainder is all zeros */
+		if (length == 15)
 			break;
-		}
-
-		for (i = 0; i < length; i++)
-			*wp++ = 0;
-		*wp++ = coeff;
-		dec_count += length + 1;
-	}
-
-	wp = block;
-
-	for (i = 0; i < 64; i++) {
-		int pos = zigzag[i];
-		int y = pos / 8;
-		int x = pos % 8;
 
-		dwht_out[x + y * 8] = *wp++;
+		pos += length;
+		if (pos < 8 * 8)
+			dwht_out[zigzag[pos]] = in >> 4;
+		pos++;
 	}
 	*rlc_in = input;
 	return stat;
@@ -193,7 +218,7 @@ static const int quant_table_p[] = {
 	3, 3, 3, 6, 6, 9,  9,  10,
 };
 
-static void quantize_intra(s16 *coeff, s16 *de_coeff, u16 qp)
+static void quantize_intra_c(s16 *coeff, s16 *de_coeff, u16 qp)
 {
 	const int *quant = quant_table;
 	int i, j;
@@ -209,7 +234,7 @@ static void quantize_intra(s16 *coeff, s16 *de_coeff, u16 qp)
 	}
 }
 
-static void dequantize_intra(s16 *coeff)
+static void dequantize_intra_c(s16 *coeff)
 {
 	const int *quant = quant_table;
 	int i, j;
@@ -219,7 +244,7 @@ static void dequantize_intra(s16 *coeff)
 			*coeff <<= *quant;
 }
 
-static void quantize_inter(s16 *coeff, s16 *de_coeff, u16 qp)
+static void quantize_inter_c(s16 *coeff, s16 *de_coeff, u16 qp)
 {
 	const int *quant = quant_table_p;
 	int i, j;
@@ -235,7 +260,7 @@ static void quantize_inter(s16 *coeff, s16 *de_coeff, u16 qp)
 	}
 }
 
-static void dequantize_inter(s16 *coeff)
+static void dequantize_inter_c(s16 *coeff)
 {
 	const int *quant = quant_table_p;
 	int i, j;
@@ -245,9 +270,9 @@ static void dequantize_inter(s16 *coeff)
 			*coeff <<= *quant;
 }
 
-static void noinline_for_stack fwht(const u8 *block, s16 *output_block,
-				    unsigned int stride,
-				    unsigned int input_step, bool intra)
+static void noinline_for_stack fwht_c(const u8 *block, s16 *output_block,
+				      unsigned int stride,
+				      unsigned int input_step, bool intra)
 {
 	/* we'll need more than 8 bits for the transformed coefficients */
 	s32 workspace1[8], workspace2[8];
@@ -380,7 +405,7 @@ static void noinline_for_stack fwht(const u8 *block, s16 *output_block,
  * works with 16 signed data
  */
 static void noinline_for_stack
-fwht16(const s16 *block, s16 *output_block, int stride, int intra)
+fwht16_c(const s16 *block, s16 *output_block, int stride, int intra)
 {
 	/* we'll need more than 8 bits for the transformed coefficients */
 	s32 workspace1[8], workspace2[8];
@@ -464,7 +489,7 @@ fwht16(const s16 *block, s16 *output_block, int stride, int intra)
 }
 
 static noinline_for_stack void
-ifwht(const s16 *block, s16 *output_block, int intra)
+ifwht_c(const s16 *block, s16 *output_block, int intra)
 {
 	/*
 	 * we'll need more than 8 bits for the transformed coefficients
@@ -574,6 +599,384 @@ ifwht(const s16 *block, s16 *output_block, int intra)
 	}
 }
 
+/*
+ * SIMD versions of the transforms and the quantizers. An 8x8 block of s16
+ * is exactly eight 128 bit registers, so a pass of the transform is the
+ * butterfly above done on whole rows at once, with a transpose in between
+ * to turn the row pass into a column pass.
+ *
+ * The scalar code stores every pass into s16, so the results are taken
+ * modulo 2^16 along the way. The transforms are sums and differences
+ * only, which wrapping 16 bit arithmetic reproduces exactly, so these
+ * give the same output bit for bit.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define FWHT_TARGET(isa) __attribute__((target(isa)))
+
+/* Multipliers that do the per coefficient shifts of the quantizers. */
+static s16 quant_rmul[2][64] __attribute__((aligned(32)));
+static s16 quant_lmul[2][64] __attribute__((aligned(32)));
+
+static void init_quant_mul(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 64; i++) {
+		/* mulhi by 2^(16 - q) is >> q, the tables stay within 2..10 */
+		quant_rmul[IBLOCK][i] = 1 << (16 - quant_table[i]);
+		quant_rmul[PBLOCK][i] = 1 << (16 - quant_table_p[i]);
+		quant_lmul[IBLOCK][i] = 1 << quant_table[i];
+		quant_lmul[PBLOCK][i] = 1 << quant_table_p[i];
+	}
+}
+
+static inline FWHT_TARGET("sse4.1") void
+transpose_sse41(__m128i *r)
+{
+	__m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+	__m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+	__m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+	__m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+	__m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+	__m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+	__m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+	__m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+	__m128i b0 = _mm_unpacklo_epi32(a0, a2);
+	__m128i b1 = _mm_unpackhi_epi32(a0, a2);
+	__m128i b2 = _mm_unpacklo_epi32(a1, a3);
+	__m128i b3 = _mm_unpackhi_epi32(a1, a3);
+	__m128i b4 = _mm_unpacklo_epi32(a4, a6);
+	__m128i b5 = _mm_unpackhi_epi32(a4, a6);
+	__m128i b6 = _mm_unpacklo_epi32(a5, a7);
+	__m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+	r[0] = _mm_unpacklo_epi64(b0, b4);
+	r[1] = _mm_unpackhi_epi64(b0, b4);
+	r[2] = _mm_unpacklo_epi64(b1, b5);
+	r[3] = _mm_unpackhi_epi64(b1, b5);
+	r[4] = _mm_unpacklo_epi64(b2, b6);
+	r[5] = _mm_unpackhi_epi64(b2, b6);
+	r[6] = _mm_unpacklo_epi64(b3, b7);
+	r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+/* Stages 1 to 3 of the scalar code, on eight columns at a time. */
+static inline FWHT_TARGET("sse4.1") void
+butterfly_sse41(__m128i *r)
+{
+	__m128i w0 = _mm_add_epi16(r[0], r[1]);
+	__m128i w1 = _mm_sub_epi16(r[0], r[1]);
+	__m128i w2 = _mm_add_epi16(r[2], r[3]);
+	__m128i w3 = _mm_sub_epi16(r[2], r[3]);
+	__m128i w4 = _mm_add_epi16(r[4], r[5]);
+	__m128i w5 = _mm_sub_epi16(r[4], r[5]);
+	__m128i w6 = _mm_add_epi16(r[6], r[7]);
+	__m128i w7 = _mm_sub_epi16(r[6], r[7]);
+	__m128i x0 = _mm_add_epi16(w0, w2);
+	__m128i x1 = _mm_sub_epi16(w0, w2);
+	__m128i x2 = _mm_sub_epi16(w1, w3);
+	__m128i x3 = _mm_add_epi16(w1, w3);
+	__m128i x4 = _mm_add_epi16(w4, w6);
+	__m128i x5 = _mm_sub_epi16(w4, w6);
+	__m128i x6 = _mm_sub_epi16(w5, w7);
+	__m128i x7 = _mm_add_epi16(w5, w7);
+
+	r[0] = _mm_add_epi16(x0, x4);
+	r[1] = _mm_sub_epi16(x0, x4);
+	r[2] = _mm_sub_epi16(x1, x5);
+	r[3] = _mm_add_epi16(x1, x5);
+	r[4] = _mm_add_epi16(x2, x6);
+	r[5] = _mm_sub_epi16(x2, x6);
+	r[6] = _mm_sub_epi16(x3, x7);
+	r[7] = _mm_add_epi16(x3, x7);
+}
+
+/* Row pass, then column pass, like the scalar code. */
+static inline FWHT_TARGET("sse4.1") void
+transform_sse41(__m128i *r)
+{
+	transpose_sse41(r);
+	butterfly_sse41(r);
+	transpose_sse41(r);
+	butterfly_sse41(r);
+}
+
+static FWHT_TARGET("sse4.1") void
+fwht_sse41(const u8 *block, s16 *output_block, unsigned int stride,
+	   unsigned int input_step, bool intra)
+{
+	__m128i r[8];
+	unsigned int i, j;
+
+	for (i = 0; i < 8; i++, block += stride) {
+		if (input_step == 1) {
+			r[i] = _mm_cvtepu8_epi16(
+				_mm_loadl_epi64((const __m128i *)block));
+		} else {
+			/* Interleaved, a wider load could read past the end. */
+			s16 row[8];
+
+			for (j = 0; j < 8; j++)
+				row[j] = block[j * input_step];
+			r[i] = _mm_loadu_si128((const __m128i *)row);
+		}
+		/* The scalar code subtracts 256 from every pair sum. */
+		if (intra)
+			r[i] = _mm_sub_epi16(r[i], _mm_set1_epi16(128));
+	}
+	transform_sse41(r);
+	for (i = 0; i < 8; i++)
+		_mm_storeu_si128((__m128i *)(output_block + i * 8), r[i]);
+}
+
+static FWHT_TARGET("sse4.1") void
+fwht16_sse41(const s16 *block, s16 *output_block, int stride, int intra)
+{
+	__m128i r[8];
+	int i;
+
+	/* Unused, like in fwht16_c. */
+	(void)intra;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm_loadu_si128((const __m128i *)(block + i * stride));
+	transform_sse41(r);
+	for (i = 0; i < 8; i++)
+		_mm_storeu_si128((__m128i *)(output_block + i * 8), r[i]);
+}
+
+static FWHT_TARGET("sse4.1") void
+ifwht_sse41(const s16 *block, s16 *output_block, int intra)
+{
+	__m128i r[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm_loadu_si128((const __m128i *)(block + i * 8));
+	transform_sse41(r);
+	for (i = 0; i < 8; i++) {
+		r[i] = _mm_srai_epi16(r[i], 6);
+		if (intra)
+			r[i] = _mm_add_epi16(r[i], _mm_set1_epi16(128));
+		_mm_storeu_si128((__m128i *)(output_block + i * 8), r[i]);
+	}
+}
+
+static FWHT_TARGET("sse4.1") void
+quantize_sse41(s16 *coeff, s16 *de_coeff, u16 qp, int blocktype)
+{
+	const s16 *rmul = quant_rmul[blocktype];
+	const s16 *lmul = quant_lmul[blocktype];
+	__m128i max = _mm_set1_epi16(qp);
+	__m128i min = _mm_set1_epi16(-qp);
+	int i;
+
+	for (i = 0; i < 64; i += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(coeff + i));
+		__m128i keep;
+
+		c = _mm_mulhi_epi16(c, _mm_load_si128((const __m128i *)(rmul + i)));
+		keep = _mm_or_si128(_mm_cmpgt_epi16(c, max),
+				    _mm_cmplt_epi16(c, min));
+		c = _mm_and_si128(c, keep);
+		_mm_storeu_si128((__m128i *)(coeff + i), c);
+		c = _mm_mullo_epi16(c, _mm_load_si128((const __m128i *)(lmul + i)));
+		_mm_storeu_si128((__m128i *)(de_coeff + i), c);
+	}
+}
+
+static FWHT_TARGET("sse4.1") void
+dequantize_sse41(s16 *coeff, int blocktype)
+{
+	const s16 *lmul = quant_lmul[blocktype];
+	int i;
+
+	for (i = 0; i < 64; i += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(coeff + i));
+
+		c = _mm_mullo_epi16(c, _mm_load_si128((const __m128i *)(lmul + i)));
+		_mm_storeu_si128((__m128i *)(coeff + i), c);
+	}
+}
+
+static FWHT_TARGET("avx2") void
+quantize_avx2(s16 *coeff, s16 *de_coeff, u16 qp, int blocktype)
+{
+	const s16 *rmul = quant_rmul[blocktype];
+	const s16 *lmul = quant_lmul[blocktype];
+	__m256i max = _mm256_set1_epi16(qp);
+	__m256i min = _mm256_set1_epi16(-qp);
+	int i;
+
+	for (i = 0; i < 64; i += 16) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(coeff + i));
+		__m256i keep;
+
+		c = _mm256_mulhi_epi16(c, _mm256_load_si256((const __m256i *)(rmul + i)));
+		keep = _mm256_or_si256(_mm256_cmpgt_epi16(c, max),
+				       _mm256_cmpgt_epi16(min, c));
+		c = _mm256_and_si256(c, keep);
+		_mm256_storeu_si256((__m256i *)(coeff + i), c);
+		c = _mm256_mullo_epi16(c, _mm256_load_si256((const __m256i *)(lmul + i)));
+		_mm256_storeu_si256((__m256i *)(de_coeff + i), c);
+	}
+}
+
+static FWHT_TARGET("avx2") void
+dequantize_avx2(s16 *coeff, int blocktype)
+{
+	const s16 *lmul = quant_lmul[blocktype];
+	int i;
+
+	for (i = 0; i < 64; i += 16) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(coeff + i));
+
+		c = _mm256_mullo_epi16(c, _mm256_load_si256((const __m256i *)(lmul + i)));
+		_mm256_storeu_si256((__m256i *)(coeff + i), c);
+	}
+}
+
+/* Beyond this -qp no longer fits in an s16 lane. */
+#define SIMD_MAX_QP 0x7fff
+
+static void quantize_intra_sse41(s16 *coeff, s16 *de_coeff, u16 qp)
+{
+	if (qp > SIMD_MAX_QP)
+		quantize_intra_c(coeff, de_coeff, qp);
+	else
+		quantize_sse41(coeff, de_coeff, qp, IBLOCK);
+}
+
+static void quantize_inter_sse41(s16 *coeff, s16 *de_coeff, u16 qp)
+{
+	if (qp > SIMD_MAX_QP)
+		quantize_inter_c(coeff, de_coeff, qp);
+	else
+		quantize_sse41(coeff, de_coeff, qp, PBLOCK);
+}
+
+static void dequantize_intra_sse41(s16 *coeff)
+{
+	dequantize_sse41(coeff, IBLOCK);
+}
+
+static void dequantize_inter_sse41(s16 *coeff)
+{
+	dequantize_sse41(coeff, PBLOCK);
+}
+
+static void quantize_intra_avx2(s16 *coeff, s16 *de_coeff, u16 qp)
+{
+	if (qp > SIMD_MAX_QP)
+		quantize_intra_c(coeff, de_coeff, qp);
+	else
+		quantize_avx2(coeff, de_coeff, qp, IBLOCK);
+}
+
+static void quantize_inter_avx2(s16 *coeff, s16 *de_coeff, u16 qp)
+{
+	if (qp > SIMD_MAX_QP)
+		quantize_inter_c(coeff, de_coeff, qp);
+	else
+		quantize_avx2(coeff, de_coeff, qp, PBLOCK);
+}
+
+static void dequantize_intra_avx2(s16 *coeff)
+{
+	dequantize_avx2(coeff, IBLOCK);
+}
+
+static void dequantize_inter_avx2(s16 *coeff)
+{
+	dequantize_avx2(coeff, PBLOCK);
+}
+#endif
+
+/* The implementations in use, see fwht_set_simd(). */
+static void (*fwht)(const u8 *block, s16 *output_block, unsigned int stride,
+		    unsigned int input_step, bool intra) = fwht_c;
+static void (*fwht16)(const s16 *block, s16 *output_block, int stride,
+		      int intra) = fwht16_c;
+static void (*ifwht)(const s16 *block, s16 *output_block, int intra) = ifwht_c;
+static void (*quantize_intra)(s16 *coeff, s16 *de_coeff, u16 qp) = quantize_intra_c;
+static void (*quantize_inter)(s16 *coeff, s16 *de_coeff, u16 qp) = quantize_inter_c;
+static void (*dequantize_intra)(s16 *coeff) = dequantize_intra_c;
+static void (*dequantize_inter)(s16 *coeff) = dequantize_inter_c;
+static enum fwht_simd simd_level = FWHT_SIMD_NONE;
+
+enum fwht_simd fwht_simd_supported(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return FWHT_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return FWHT_SIMD_SSE41;
+#endif
+	return FWHT_SIMD_NONE;
+}
+
+enum fwht_simd fwht_set_simd(enum fwht_simd simd)
+{
+	enum fwht_simd supported = fwht_simd_supported();
+
+	if (simd > supported)
+		simd = supported;
+
+	fwht = fwht_c;
+	fwht16 = fwht16_c;
+	ifwht = ifwht_c;
+	quantize_intra = quantize_intra_c;
+	quantize_inter = quantize_inter_c;
+	dequantize_intra = dequantize_intra_c;
+	dequantize_inter = dequantize_inter_c;
+#if defined(__x86_64__) || defined(__i386__)
+	init_quant_mul();
+	if (simd >= FWHT_SIMD_SSE41) {
+		fwht = fwht_sse41;
+		fwht16 = fwht16_sse41;
+		ifwht = ifwht_sse41;
+		quantize_intra = quantize_intra_sse41;
+		quantize_inter = quantize_inter_sse41;
+		dequantize_intra = dequantize_intra_sse41;
+		dequantize_inter = dequantize_inter_sse41;
+	}
+	if (simd >= FWHT_SIMD_AVX2) {
+		quantize_intra = quantize_intra_avx2;
+		quantize_inter = quantize_inter_avx2;
+		dequantize_intra = dequantize_intra_avx2;
+		dequantize_inter = dequantize_inter_avx2;
+	}
+#endif
+	simd_level = simd;
+	return simd;
+}
+
+enum fwht_simd fwht_get_simd(void)
+{
+	return simd_level;
+}
+
+const char *fwht_simd_name(enum fwht_simd simd)
+{
+	switch (simd) {
+	case FWHT_SIMD_SSE41:
+		return "sse4.1";
+	case FWHT_SIMD_AVX2:
+		return "avx2";
+	default:
+		return "none";
+	}
+}
+
+/* Pick the best implementation before anything can encode or decode. */
+static void __attribute__((constructor)) fwht_init_simd(void)
+{
+	fwht_set_simd(FWHT_SIMD_AVX2);
+}
+
 static void fill_encoder_block(const u8 *input, s16 *dst,
 			       unsigned int stride, unsigned int input_step)
 {
@@ -640,12 +1043,12 @@ decide_blocktype(const u8 *cur, const u8 *reference, s16 *deltablock,
 	return vari <= vard ? IBLOCK : PBLOCK;
 }
 
-static void fill_decoder_block(u8 *dst, const s16 *input, int stride,
-			       unsigned int dst_step)
+static void fill_decoder_rows(u8 *dst, const s16 *input, int stride,
+			      unsigned int dst_step, unsigned int rows)
 {
 	int i, j;
 
-	for (i = 0; i < 8; i++) {
+	for (i = 0; i < rows; i++) {
 		for (j = 0; j < 8; j++, input++, dst += dst_step) {
 			if (*input < 0)
 				*dst = 0;
@@ -658,6 +1061,12 @@ static void fill_decoder_block(u8 *dst, const s16 *input, int stride,
 	}
 }
 
+static void fill_decoder_block(u8 *dst, const s16 *input, int stride,
+			       unsigned int dst_step)
+{
+	fill_decoder_rows(dst, input, stride, dst_step, 8);
+}
+
 static void add_deltas(s16 *deltas, const u8 *ref, int stride,
 		       unsigned int ref_step)
 {
@@ -681,56 +1090,137 @@ static void add_deltas(s16 *deltas, const u8 *ref, int stride,
 	}
 }
 
-static u32 encode_plane(u8 *input, u8 *refp, __be16 **rlco, __be16 *rlco_max,
-			struct fwht_cframe *cf, u32 height, u32 width,
+/*
+ * Keeps a copy of the input block in last, which is laid out like the
+ * encoder's reference frame. Returns true if the block was already there.
+ */
+static bool update_last_block(const u8 *input, u8 *last, unsigned int stride,
+			      unsigned int input_step)
+{
+	bool unchanged = true;
+	unsigned int i, j;
+
+	if (input_step == 1) {
+		/* A whole row of the block at a time. */
+		for (i = 0; i < 8; i++, input += stride, last += 8) {
+			u64 cur, old;
+
+			memcpy(&cur, input, sizeof(cur));
+			memcpy(&old, last, sizeof(old));
+			if (cur != old) {
+				memcpy(last, &cur, sizeof(cur));
+				unchanged = false;
+			}
+		}
+		return unchanged;
+	}
+
+	for (i = 0; i < 8; i++, input += stride) {
+		for (j = 0; j < 8; j++, last++) {
+			if (*last != input[j * input_step]) {
+				*last = input[j * input_step];
+				unchanged = false;
+			}
+		}
+	}
+	return unchanged;
+}
+
+/*
+ * The code of a block that is the same as in the reference frame: a
+ * P-block without deltas, which is what rlc() would write for it.
+ */
+static int rlc_skip(__be16 *output, u32 *hash)
+{
+	output[0] = htons(PFRAME_BIT);
+	output[1] = htons(ALL_ZEROS | 0);
+	*hash = rlc_hash(output + 1, 1);
+	return 2;
+}
+
+/* Transforms and quantizes one block, and updates the reference frame. */
+static int encode_block(u8 *input, u8 *refp, struct fwht_cframe *cf,
 			u32 stride, unsigned int input_step,
 			bool is_intra, bool next_is_intra)
 {
-	u8 *input_start = input;
-	__be16 *rlco_start = *rlco;
 	s16 deltablock[64];
+	/* intra code, first frame is always intra coded. */
+	int blocktype = IBLOCK;
+
+	if (!is_intra)
+		blocktype = decide_blocktype(input, refp, deltablock, stride,
+					     input_step);
+	if (blocktype == IBLOCK) {
+		fwht(input, cf->coeffs, stride, input_step, 1);
+		quantize_intra(cf->coeffs, cf->de_coeffs, cf->i_frame_qp);
+	} else {
+		/* inter code */
+		fwht16(deltablock, cf->coeffs, 8, 0);
+		quantize_inter(cf->coeffs, cf->de_coeffs, cf->p_frame_qp);
+	}
+	if (!next_is_intra) {
+		ifwht(cf->de_coeffs, cf->de_fwht, blocktype);
+
+		if (blocktype == PBLOCK)
+			add_deltas(cf->de_fwht, refp, 8, 1);
+		fill_decoder_block(refp, cf->de_fwht, 8, 1);
+	}
+	return blocktype;
+}
+
+/*
+ * Encodes rows macroblock rows starting at input. *first_size and
+ * *last_size return the size of the first and the last code written, so
+ * that runs of duplicate blocks can be joined across slices.
+ *
+ * With lastp, blocks of a P-frame that are the same as in the previous
+ * frame skip the transform and are coded as an unchanged P-block, which
+ * leaves the reference frame as it is.
+ */
+static u32 encode_rows(u8 *input, u8 *refp, u8 *lastp, __be16 **rlco,
+		       __be16 *rlco_max, struct fwht_cframe *cf, u32 rows,
+		       u32 width, u32 stride, unsigned int input_step,
+		       bool is_intra, bool next_is_intra,
+		       unsigned int *first_size, unsigned int *last_size)
+{
+	u8 *input_start = input;
 	__be16 pframe_bit = htons(PFRAME_BIT);
 	u32 encoding = 0;
-	unsigned int last_size = 0;
+	unsigned int size = 0;
+	u32 hash, last_hash = 0;
 	unsigned int i, j;
 
-	width = round_up(width, 8);
-	height = round_up(height, 8);
-
-	for (j = 0; j < height / 8; j++) {
+	*first_size = 0;
+	*last_size = 0;
+	for (j = 0; j < rows; j++) {
 		input = input_start + j * 8 * stride;
 		for (i = 0; i < width / 8; i++) {
-			/* intra code, first frame is always intra coded. */
-			int blocktype = IBLOCK;
-			unsigned int size;
-
-			if (!is_intra)
-				blocktype = decide_blocktype(input, refp,
-					deltablock, stride, input_step);
-			if (blocktype == IBLOCK) {
-				fwht(input, cf->coeffs, stride, input_step, 1);
-				quantize_intra(cf->coeffs, cf->de_coeffs,
-					       cf->i_frame_qp);
-			} else {
-				/* inter code */
-				encoding |= FWHT_FRAME_PCODED;
-				fwht16(deltablock, cf->coeffs, 8, 0);
-				quantize_inter(cf->coeffs, cf->de_coeffs,
-					       cf->p_frame_qp);
+			bool unchanged = false;
+			int blocktype;
+
+			if (lastp) {
+				unchanged = update_last_block(input, lastp,
+							      stride,
+							      input_step);
+				lastp += 8 * 8;
 			}
-			if (!next_is_intra) {
-				ifwht(cf->de_coeffs, cf->de_fwht, blocktype);
-
+			if (!is_intra && unchanged) {
+				encoding |= FWHT_FRAME_PCODED;
+				size = rlc_skip(*rlco, &hash);
+			} else {
+				blocktype = encode_block(input, refp, cf,
+							 stride, input_step,
+							 is_intra,
+							 next_is_intra);
 				if (blocktype == PBLOCK)
-					add_deltas(cf->de_fwht, refp, 8, 1);
-				fill_decoder_block(refp, cf->de_fwht, 8, 1);
+					encoding |= FWHT_FRAME_PCODED;
+				size = rlc(cf->coeffs, *rlco, blocktype, &hash);
 			}
 
 			input += 8 * input_step;
 			refp += 8 * 8;
 
-			size = rlc(cf->coeffs, *rlco, blocktype);
-			if (last_size == size &&
+			if (*last_size == size && last_hash == hash &&
 			    !memcmp(*rlco + 1, *rlco - size + 1, 2 * size - 2)) {
 				__be16 *last_rlco = *rlco - size;
 				s16 hdr = ntohs(*last_rlco);
@@ -743,34 +1233,368 @@ static u32 encode_plane(u8 *input, u8 *refp, __be16 **rlco, __be16 *rlco_max,
 			} else {
 				*rlco += size;
 			}
-			if (*rlco >= rlco_max) {
-				encoding |= FWHT_FRAME_UNENCODED;
-				goto exit_loop;
-			}
-			last_size = size;
+			if (*rlco >= rlco_max)
+				return encoding | FWHT_FRAME_UNENCODED;
+			if (!*first_size)
+				*first_size = size;
+			*last_size = size;
+			last_hash = hash;
 		}
 	}
+	return encoding;
+}
+
+/*
+ * The compressed stream should never contain the magic header, so when we
+ * copy the YUV data we replace 0xff by 0xfe. Since YUV is limited range
+ * such values shouldn't appear anyway.
+ *
+ * The decoder takes the copy as its next reference, so unless refp is
+ * NULL the encoder's reference, macroblock by macroblock, gets the same.
+ * Whatever encoding the plane left there before giving up is gone then.
+ * lastp gets the input as it is, encoding may have stopped before
+ * updating all of it.
+ */
+static void copy_plane_unencoded(u8 *input, u8 *refp, u8 *lastp,
+				 __be16 **rlco, u32 height, u32 width,
+				 u32 stride, unsigned int input_step)
+{
+	u8 *out = (u8 *)*rlco;
+	u8 *p;
+	unsigned int i, j, k;
+
+	if (lastp)
+		for (j = 0; j < height; j += 8)
+			for (i = 0; i < width; i += 8, lastp += 8 * 8)
+				update_last_block(input + j * stride +
+						  i * input_step, lastp,
+						  stride, input_step);
+	for (j = 0; j < height; j++) {
+		for (i = 0, p = input; i < width; i++, p += input_step)
+			*out++ = (*p == 0xff) ? 0xfe : *p;
+		input += stride;
+	}
+	if (refp) {
+		const u8 *plane = (const u8 *)*rlco;
+
+		for (j = 0; j < height; j += 8)
+			for (i = 0; i < width; i += 8)
+				for (k = 0; k < 8; k++, refp += 8)
+					memcpy(refp, plane + (j + k) * width + i,
+					       8);
+	}
+	*rlco = (__be16 *)out;
+}
+
+static u32 encode_plane(u8 *input, u8 *refp, u8 *lastp, __be16 **rlco,
+			__be16 *rlco_max, struct fwht_cframe *cf, u32 height,
+			u32 width, u32 stride, unsigned int input_step,
+			bool is_intra, bool next_is_intra)
+{
+	__be16 *rlco_start = *rlco;
+	unsigned int first_size, last_size;
+	u32 encoding;
+
+	width = round_up(width, 8);
+	height = round_up(height, 8);
 
-exit_loop:
+	encoding = encode_rows(input, refp, lastp, rlco, rlco_max, cf,
+			       height / 8, width, stride, input_step, is_intra,
+			       next_is_intra, &first_size, &last_size);
 	if (encoding & FWHT_FRAME_UNENCODED) {
-		u8 *out = (u8 *)rlco_start;
-		u8 *p;
+		*rlco = rlco_start;
+		copy_plane_unencoded(input, next_is_intra ? NULL : refp, lastp,
+				     rlco, height, width, stride, input_step);
+		encoding &= ~FWHT_FRAME_PCODED;
+	}
+	return encoding;
+}
+
+/* Worst case, every block takes a header and 64 coefficients. */
+#define MAX_BLOCK_RLC 65
+
+unsigned int fwht_max_rlc_size(unsigned int width, unsigned int height,
+			       unsigned int width_div, unsigned int height_div,
+			       unsigned int components_num)
+{
+	unsigned int luma = round_up(width, 8) / 8 * (round_up(height, 8) / 8);
+	unsigned int chroma = round_up(width / width_div, 8) / 8 *
+			      (round_up(height / height_div, 8) / 8);
+	unsigned int blocks = luma;
 
-		input = input_start;
+	if (components_num >= 3)
+		blocks += 2 * chroma;
+	if (components_num == 4)
+		blocks += luma;
+	return blocks * MAX_BLOCK_RLC * sizeof(__be16);
+}
+
+struct slice_plane {
+	u8 *input;
+	u8 *ref;
+	u8 *last;
+	u32 height;
+	u32 width;
+	u32 stride;
+	unsigned int input_step;
+	u32 unencoded;
+	unsigned int first_slice;
+	unsigned int slices;
+};
+
+struct slice {
+	struct slice_plane *plane;
+	u32 row;
+	u32 rows;
+	__be16 *start;
+	__be16 *end;
+	unsigned int first_size;
+	unsigned int last_size;
+	u32 encoding;
+};
+
+struct slice_job {
+	struct fwht_cframe *cf;
+	bool is_intra;
+	bool next_is_intra;
+	unsigned int base;
+	struct slice slice[FWHT_MAX_SLICES];
+};
+
+static void encode_slice(void *arg, unsigned int i)
+{
+	struct slice_job *job = arg;
+	struct slice *s = &job->slice[job->base + i];
+	struct slice_plane *p = s->plane;
+	u32 width = round_up(p->width, 8);
+	struct fwht_cframe cf;
+
+	/* Every slice needs its own scratch blocks. */
+	cf.i_frame_qp = job->cf->i_frame_qp;
+	cf.p_frame_qp = job->cf->p_frame_qp;
+	s->end = s->start;
+	s->encoding = encode_rows(p->input + s->row * 8 * p->stride,
+				  p->ref + s->row * 8 * width,
+				  p->last ? p->last + s->row * 8 * width : NULL,
+				  &s->end, s->start + s->rows * (width / 8) *
+				  MAX_BLOCK_RLC + 1, &cf, s->rows, width,
+				  p->stride, p->input_step, job->is_intra,
+				  job->next_is_intra, &s->first_size,
+				  &s->last_size);
+}
+
+/*
+ * Appends a slice to the plane written so far. When the plane ends with
+ * the same block the slice starts with, the run of duplicates carries on
+ * like it would have had the plane been encoded in one go: the last code
+ * takes as many copies as it can hold, and what doesn't fit starts the
+ * next code. Nothing is appended once rlco_max is reached, where the plane
+ * gets stored unencoded anyway.
+ */
+static void append_slice(__be16 **rlco, __be16 *plane_start,
+			 __be16 *rlco_max, unsigned int *last_size,
+			 const struct slice *s)
+{
+	const __be16 *src = s->start;
+	unsigned int len = s->end - s->start;
+	unsigned int size = s->first_size;
+
+	if (!len || *rlco >= rlco_max)
+		return;
+	while (len >= size && *rlco > plane_start && *rlco < rlco_max &&
+	       *last_size == size) {
+		__be16 *last = *rlco - size;
+		u16 hdr = ntohs(*last);
+		u16 first = ntohs(*src);
+		/* copies the last code still has room for */
+		unsigned int room = (DUPS_MASK - (hdr & DUPS_MASK)) / 2;
+		/* blocks the first code of the slice stands for */
+		unsigned int blocks = (first & DUPS_MASK) / 2 + 1;
+
+		if (((hdr ^ first) & PFRAME_BIT) ||
+		    memcmp(last + 1, src + 1, 2 * size - 2))
+			break;
+		if (blocks > room) {
+			*last = htons(hdr + 2 * room);
+			memcpy(*rlco, src, size * sizeof(*src));
+			**rlco = htons(first - 2 * room);
+			*rlco += size;
+		} else {
+			*last = htons(hdr + 2 * blocks);
+		}
+		src += size;
+		len -= size;
+	}
+	if (*rlco >= rlco_max)
+		return;
+	if (len > rlco_max - *rlco)
+		len = rlco_max - *rlco;
+	memcpy(*rlco, src, len * sizeof(*src));
+	*rlco += len;
+	*last_size = s->last_size;
+}
+
+static u32 encode_frame_slices(struct fwht_raw_frame *frm,
+			       struct fwht_raw_frame *ref_frm,
+			       struct fwht_cframe *cf,
+			       bool is_intra, bool next_is_intra,
+			       unsigned int width, unsigned int height,
+			       unsigned int stride, unsigned int chroma_stride)
+{
+	struct fwht_slices *slices = cf->slices;
+	struct fwht_raw_frame *last = cf->last_frm;
+	struct slice_plane planes[4];
+	struct slice_job job;
+	unsigned int num_planes = 0;
+	unsigned int mb_rows = 0;
+	bool aligned = true;
+	unsigned int rows = slices->rows ? slices->rows : 1;
+	unsigned int count = 0;
+	__be16 *scratch = slices->scratch;
+	__be16 *rlco = cf->rlc_data;
+	u32 encoding = 0;
+	unsigned int i, k;
+
+	planes[num_planes++] = (struct slice_plane) {
+		.input = frm->luma,
+		.ref = ref_frm->luma,
+		.last = last ? last->luma : NULL,
+		.height = height,
+		.width = width,
+		.stride = stride,
+		.input_step = frm->luma_alpha_step,
+		.unencoded = FWHT_LUMA_UNENCODED,
+		.first_slice = 0,
+		.slices = 0,
+	};
+	if (frm->components_num >= 3) {
+		u32 chroma_h = height / frm->height_div;
+		u32 chroma_w = width / frm->width_div;
+
+		planes[num_planes++] = (struct slice_plane) {
+			.input = frm->cb,
+			.ref = ref_frm->cb,
+			.last = last ? last->cb : NULL,
+			.height = chroma_h,
+			.width = chroma_w,
+			.stride = chroma_stride,
+			.input_step = frm->chroma_step,
+			.unencoded = FWHT_CB_UNENCODED,
+			.first_slice = 0,
+			.slices = 0,
+		};
+		planes[num_planes++] = (struct slice_plane) {
+			.input = frm->cr,
+			.ref = ref_frm->cr,
+			.last = last ? last->cr : NULL,
+			.height = chroma_h,
+			.width = chroma_w,
+			.stride = chroma_stride,
+			.input_step = frm->chroma_step,
+			.unencoded = FWHT_CR_UNENCODED,
+			.first_slice = 0,
+			.slices = 0,
+		};
+	}
+	if (frm->components_num == 4)
+		planes[num_planes++] = (struct slice_plane) {
+			.input = frm->alpha,
+			.ref = ref_frm->alpha,
+			.last = last ? last->alpha : NULL,
+			.height = height,
+			.width = width,
+			.stride = stride,
+			.input_step = frm->luma_alpha_step,
+			.unencoded = FWHT_ALPHA_UNENCODED,
+			.first_slice = 0,
+			.slices = 0,
+		};
+
+	for (i = 0; i < num_planes; i++) {
+		mb_rows += round_up(planes[i].height, 8) / 8;
+		if (planes[i].height % 8 || planes[i].width % 8)
+			aligned = false;
+	}
+	/*
+	 * Fewer, taller slices if there would be too many. Every plane can
+	 * end with a short one.
+	 */
+	if (mb_rows > rows * (FWHT_MAX_SLICES - num_planes))
+		rows = (mb_rows + FWHT_MAX_SLICES - num_planes - 1) /
+		       (FWHT_MAX_SLICES - num_planes);
+
+	job.cf = cf;
+	job.is_intra = is_intra;
+	job.next_is_intra = next_is_intra;
+	for (i = 0; i < num_planes; i++) {
+		struct slice_plane *p = &planes[i];
+		u32 width = round_up(p->width, 8);
+		u32 plane_rows;
+
+		plane_rows = round_up(p->height, 8) / 8;
+		p->first_slice = count;
+		p->slices = 0;
+		for (k = 0; k < plane_rows; k += rows, count++, p->slices++) {
+			struct slice *s = &job.slice[count];
+
+			s->plane = p;
+			s->row = k;
+			s->rows = plane_rows - k < rows ? plane_rows - k : rows;
+			s->start = scratch;
+			scratch += s->rows * (width / 8) * MAX_BLOCK_RLC;
+		}
+	}
+
+	/*
+	 * The reference of a plane that isn't whole macroblocks spills into
+	 * the next plane's, which has to wait for it then like it does when
+	 * encoding serially.
+	 */
+	if (aligned) {
+		job.base = 0;
+		slices->run(slices->priv, encode_slice, &job, count);
+	} else {
+		for (i = 0; i < num_planes; i++) {
+			job.base = planes[i].first_slice;
+			slices->run(slices->priv, encode_slice, &job,
+				    planes[i].slices);
+		}
+	}
+
+	for (i = 0; i < num_planes; i++) {
+		struct slice_plane *p = &planes[i];
+		/* The same budget encode_plane() gets. */
+		unsigned int plane_size = p->height * p->width;
+		__be16 *rlco_max = rlco + plane_size / 2 - 256;
+		__be16 *plane_start = rlco;
+		unsigned int last_size = 0;
+		u32 plane_encoding = 0;
+
+		for (k = 0; k < p->slices; k++) {
+			const struct slice *s = &job.slice[p->first_slice + k];
+
+			append_slice(&rlco, plane_start, rlco_max, &last_size,
+				     s);
+			plane_encoding |= s->encoding;
+		}
 		/*
-		 * The compressed stream should never contain the magic
-		 * header, so when we copy the YUV data we replace 0xff
-		 * by 0xfe. Since YUV is limited range such values
-		 * shouldn't appear anyway.
+		 * Sizes only grow, so this is where encoding the plane in
+		 * one go would have given up too.
 		 */
-		for (j = 0; j < height; j++) {
-			for (i = 0, p = input; i < width; i++, p += input_step)
-				*out++ = (*p == 0xff) ? 0xfe : *p;
-			input += stride;
+		if (rlco >= rlco_max) {
+			rlco = plane_start;
+			copy_plane_unencoded(p->input,
+					     next_is_intra ? NULL : p->ref,
+					     p->last, &rlco,
+					     round_up(p->height, 8),
+					     round_up(p->width, 8),
+					     p->stride, p->input_step);
+			plane_encoding = p->unencoded;
 		}
-		*rlco = (__be16 *)out;
-		encoding &= ~FWHT_FRAME_PCODED;
+		encoding |= plane_encoding;
 	}
+
+	cf->size = (rlco - cf->rlc_data) * sizeof(*rlco);
 	return encoding;
 }
 
@@ -782,12 +1606,19 @@ u32 fwht_encode_frame(struct fwht_raw_frame *frm,
 		      unsigned int stride, unsigned int chroma_stride)
 {
 	unsigned int size = height * width;
+	struct fwht_raw_frame *last = cf->last_frm;
 	__be16 *rlco = cf->rlc_data;
 	__be16 *rlco_max;
 	u32 encoding;
 
+	if (cf->slices && cf->slices->run)
+		return encode_frame_slices(frm, ref_frm, cf, is_intra,
+					   next_is_intra, width, height,
+					   stride, chroma_stride);
+
 	rlco_max = rlco + size / 2 - 256;
-	encoding = encode_plane(frm->luma, ref_frm->luma, &rlco, rlco_max, cf,
+	encoding = encode_plane(frm->luma, ref_frm->luma,
+				last ? last->luma : NULL, &rlco, rlco_max, cf,
 				height, width, stride,
 				frm->luma_alpha_step, is_intra, next_is_intra);
 	if (encoding & FWHT_FRAME_UNENCODED)
@@ -800,7 +1631,8 @@ u32 fwht_encode_frame(struct fwht_raw_frame *frm,
 		unsigned int chroma_size = chroma_h * chroma_w;
 
 		rlco_max = rlco + chroma_size / 2 - 256;
-		encoding |= encode_plane(frm->cb, ref_frm->cb, &rlco, rlco_max,
+		encoding |= encode_plane(frm->cb, ref_frm->cb,
+					 last ? last->cb : NULL, &rlco, rlco_max,
 					 cf, chroma_h, chroma_w,
 					 chroma_stride, frm->chroma_step,
 					 is_intra, next_is_intra);
@@ -808,7 +1640,8 @@ u32 fwht_encode_frame(struct fwht_raw_frame *frm,
 			encoding |= FWHT_CB_UNENCODED;
 		encoding &= ~FWHT_FRAME_UNENCODED;
 		rlco_max = rlco + chroma_size / 2 - 256;
-		encoding |= encode_plane(frm->cr, ref_frm->cr, &rlco, rlco_max,
+		encoding |= encode_plane(frm->cr, ref_frm->cr,
+					 last ? last->cr : NULL, &rlco, rlco_max,
 					 cf, chroma_h, chroma_w,
 					 chroma_stride, frm->chroma_step,
 					 is_intra, next_is_intra);
@@ -819,7 +1652,8 @@ u32 fwht_encode_frame(struct fwht_raw_frame *frm,
 
 	if (frm->components_num == 4) {
 		rlco_max = rlco + size / 2 - 256;
-		encoding |= encode_plane(frm->alpha, ref_frm->alpha, &rlco,
+		encoding |= encode_plane(frm->alpha, ref_frm->alpha,
+					 last ? last->alpha : NULL, &rlco,
 					 rlco_max, cf, height, width,
 					 stride, frm->luma_alpha_step,
 					 is_intra, next_is_intra);
@@ -832,32 +1666,57 @@ u32 fwht_encode_frame(struct fwht_raw_frame *frm,
 	return encoding;
 }
 
-static bool decode_plane(struct fwht_cframe *cf, const __be16 **rlco,
-			 u32 height, u32 width, const u8 *ref, u32 ref_stride,
-			 unsigned int ref_step, u8 *dst,
-			 unsigned int dst_stride, unsigned int dst_step,
-			 bool uncompressed, const __be16 *end_of_rlco_buf)
+/* Where decoding a plane, or a slice of one, starts in the stream. */
+struct decode_pos {
+	const __be16 *rlco;
+	/* The code still being repeated and how many more times. */
+	const __be16 *run;
+	unsigned int copies;
+};
+
+struct decode_plane_info {
+	u32 height;
+	u32 width;
+	u8 *ref;
+	u32 ref_stride;
+	unsigned int ref_step;
+	u8 *dst;
+	u32 dst_stride;
+	unsigned int dst_step;
+	bool uncompressed;
+	bool update_ref;
+};
+
+/*
+ * Decodes rows macroblock rows starting at row, from pos on. Only the
+ * lines inside the plane are written, the rest of the last macroblock
+ * row belongs to whatever follows the plane. With update_ref the
+ * reference frame gets the same lines as dst.
+ */
+static bool decode_rows(struct fwht_cframe *cf, struct decode_pos *pos,
+			const struct decode_plane_info *p, u32 row, u32 rows,
+			const __be16 *end_of_rlco_buf)
 {
-	unsigned int copies = 0;
+	unsigned int copies = pos->copies;
 	s16 copy[8 * 8];
-	u16 stat;
+	u16 stat = 0;
 	unsigned int i, j;
-	bool is_intra = !ref;
+	u32 width = round_up(p->width, 8);
+	bool is_intra = !p->ref;
 
-	width = round_up(width, 8);
-	height = round_up(height, 8);
-
-	if (uncompressed) {
-		int i;
+	if (copies) {
+		/* Resume a run of duplicates that started in an earlier slice. */
+		const __be16 *run = pos->run;
 
-		if (end_of_rlco_buf + 1 < *rlco + width * height / 2)
+		stat = derlc(&run, cf->coeffs, end_of_rlco_buf);
+		if (stat & OVERFLOW_BIT)
 			return false;
-		for (i = 0; i < height; i++) {
-			memcpy(dst, *rlco, width);
-			dst += dst_stride;
-			*rlco += width / 2;
-		}
-		return true;
+		if ((stat & PFRAME_BIT) && !is_intra)
+			dequantize_inter(cf->coeffs);
+		else
+			dequantize_intra(cf->coeffs);
+		ifwht(cf->coeffs, copy,
+		      ((stat & PFRAME_BIT) && !is_intra) ? 0 : 1);
 	}
 
 	/*
@@ -866,50 +1725,251 @@ static bool decode_plane(struct fwht_cframe *cf, const __be16 **rlco,
 	 * To avoid overflow the buffer has to be 65/64th of the actual raw
 	 * image size, just in case someone feeds it malicious data.
 	 */
-	for (j = 0; j < height / 8; j++) {
+	for (j = row; j < row + rows; j++) {
+		unsigned int lines = p->height - j * 8 < 8 ? p->height - j * 8 : 8;
+
 		for (i = 0; i < width / 8; i++) {
-			const u8 *refp = ref + j * 8 * ref_stride +
-				i * 8 * ref_step;
-			u8 *dstp = dst + j * 8 * dst_stride + i * 8 * dst_step;
+			u8 *refp = p->ref + j * 8 * p->ref_stride +
+				i * 8 * p->ref_step;
+			u8 *dstp = p->dst + j * 8 * p->dst_stride +
+				i * 8 * p->dst_step;
 
 			if (copies) {
 				memcpy(cf->de_fwht, copy, sizeof(copy));
 				if ((stat & PFRAME_BIT) && !is_intra)
 					add_deltas(cf->de_fwht, refp,
-						   ref_stride, ref_step);
-				fill_decoder_block(dstp, cf->de_fwht,
-						   dst_stride, dst_step);
+						   p->ref_stride, p->ref_step);
 				copies--;
-				continue;
+			} else {
+				stat = derlc(&pos->rlco, cf->coeffs,
+					     end_of_rlco_buf);
+				if (stat & OVERFLOW_BIT)
+					return false;
+				if ((stat & PFRAME_BIT) && !is_intra)
+					dequantize_inter(cf->coeffs);
+				else
+					dequantize_intra(cf->coeffs);
+
+				ifwht(cf->coeffs, cf->de_fwht,
+				      ((stat & PFRAME_BIT) && !is_intra) ? 0 : 1);
+
+				copies = (stat & DUPS_MASK) >> 1;
+				if (copies)
+					memcpy(copy, cf->de_fwht, sizeof(copy));
+				if ((stat & PFRAME_BIT) && !is_intra)
+					add_deltas(cf->de_fwht, refp,
+						   p->ref_stride, p->ref_step);
 			}
+			fill_decoder_rows(dstp, cf->de_fwht, p->dst_stride,
+					  p->dst_step, lines);
+			/* add_deltas() above was the last look at this block. */
+			if (p->update_ref)
+				fill_decoder_rows(refp, cf->de_fwht,
+						  p->ref_stride, p->ref_step,
+						  lines);
+		}
+	}
+	pos->copies = copies;
+	return true;
+}
+
+/* Planes are stored unencoded without the step of interleaved formats. */
+static void copy_line_unencoded(u8 *out, const u8 *in, u32 width,
+				unsigned int step)
+{
+	unsigned int i;
+
+	if (step == 1) {
+		memcpy(out, in, width);
+		return;
+	}
+	for (i = 0; i < width; i++, out += step)
+		*out = in[i];
+}
+
+static bool decode_uncompressed(const __be16 **rlco,
+				const struct decode_plane_info *p,
+				const __be16 *end_of_rlco_buf)
+{
+	u32 width = round_up(p->width, 8);
+	u32 height = round_up(p->height, 8);
+	u8 *dst = p->dst;
+	u8 *ref = p->ref;
+	unsigned int i;
+
+	if (end_of_rlco_buf + 1 < *rlco + width * height / 2)
+		return false;
+	for (i = 0; i < height; i++) {
+		if (i < p->height) {
+			copy_line_unencoded(dst, (const u8 *)*rlco, width,
+					    p->dst_step);
+			if (p->update_ref)
+				copy_line_unencoded(ref, (const u8 *)*rlco,
+						    width, p->ref_step);
+		}
+		dst += p->dst_stride;
+		ref += p->ref_stride;
+		*rlco += width / 2;
+	}
+	return true;
+}
+
+static bool decode_plane(struct fwht_cframe *cf, const __be16 **rlco,
+			 const struct decode_plane_info *p,
+			 const __be16 *end_of_rlco_buf)
+{
+	struct decode_pos pos = { *rlco, NULL, 0 };
+
+	if (p->uncompressed)
+		return decode_uncompressed(rlco, p, end_of_rlco_buf);
+	if (!decode_rows(cf, &pos, p, 0, round_up(p->height, 8) / 8,
+			 end_of_rlco_buf))
+		return false;
+	*rlco = pos.rlco;
+	return true;
+}
 
-			stat = derlc(rlco, cf->coeffs, end_of_rlco_buf);
+/* Steps over one code like derlc() reads it, without decoding it. */
+static u16 skip_rlc(const __be16 **rlc_in, const __be16 *end_of_input)
+{
+	const __be16 *input = *rlc_in;
+	int dec_count = 0;
+	u16 stat;
+
+	if (input > end_of_input)
+		return OVERFLOW_BIT;
+	stat = ntohs(*input++);
+	while (dec_count < 8 * 8) {
+		s16 in;
+
+		if (input > end_of_input)
+			return OVERFLOW_BIT;
+		in = ntohs(*input++);
+		if ((in & 0xf) == 15)
+			break;
+		dec_count += (in & 0xf) + 1;
+	}
+	*rlc_in = input;
+	return stat;
+}
+
+struct decode_slice {
+	const struct decode_plane_info *plane;
+	struct decode_pos pos;
+	u32 row;
+	u32 rows;
+	bool ok;
+};
+
+struct decode_job {
+	const __be16 *end_of_rlco_buf;
+	struct decode_slice slice[FWHT_MAX_SLICES];
+};
+
+static void decode_slice(void *arg, unsigned int i)
+{
+	struct decode_job *job = arg;
+	struct decode_slice *s = &job->slice[i];
+	struct fwht_cframe cf;
+
+	/* Every slice needs its own scratch blocks. */
+	if (s->plane->uncompressed)
+		s->ok = decode_uncompressed(&s->pos.rlco, s->plane,
+					    job->end_of_rlco_buf);
+	else
+		s->ok = decode_rows(&cf, &s->pos, s->plane, s->row, s->rows,
+				    job->end_of_rlco_buf);
+}
+
+/*
+ * Finds where every slice of a plane starts by stepping over the codes
+ * before it, and where the next plane starts.
+ */
+static bool find_slices(struct decode_job *job, unsigned int *count,
+			const struct decode_plane_info *p, unsigned int rows,
+			const __be16 **rlco)
+{
+	u32 width = round_up(p->width, 8);
+	u32 height = round_up(p->height, 8);
+	struct decode_pos pos = { *rlco, NULL, 0 };
+	unsigned int row_blocks = width / 8;
+	unsigned int j, i;
+
+	if (p->uncompressed) {
+		struct decode_slice *s = &job->slice[(*count)++];
+
+		if (job->end_of_rlco_buf + 1 < *rlco + width * height / 2)
+			return false;
+		s->plane = p;
+		s->pos = pos;
+		*rlco += width * height / 2;
+		return true;
+	}
+
+	for (j = 0; j < height / 8; j++) {
+		if (j % rows == 0) {
+			struct decode_slice *s = &job->slice[(*count)++];
+
+			s->plane = p;
+			s->pos = pos;
+			s->row = j;
+			s->rows = height / 8 - j < rows ? height / 8 - j : rows;
+		}
+		for (i = 0; i < row_blocks; i++) {
+			u16 stat;
+
+			if (pos.copies) {
+				pos.copies--;
+				continue;
+			}
+			pos.run = pos.rlco;
+			stat = skip_rlc(&pos.rlco, job->end_of_rlco_buf);
 			if (stat & OVERFLOW_BIT)
 				return false;
-			if ((stat & PFRAME_BIT) && !is_intra)
-				dequantize_inter(cf->coeffs);
-			else
-				dequantize_intra(cf->coeffs);
-
-			ifwht(cf->coeffs, cf->de_fwht,
-			      ((stat & PFRAME_BIT) && !is_intra) ? 0 : 1);
-
-			copies = (stat & DUPS_MASK) >> 1;
-			if (copies)
-				memcpy(copy, cf->de_fwht, sizeof(copy));
-			if ((stat & PFRAME_BIT) && !is_intra)
-				add_deltas(cf->de_fwht, refp,
-					   ref_stride, ref_step);
-			fill_decoder_block(dstp, cf->de_fwht, dst_stride,
-					   dst_step);
+			pos.copies = (stat & DUPS_MASK) >> 1;
 		}
 	}
+	*rlco = pos.rlco;
+	return true;
+}
+
+static bool decode_frame_slices(struct fwht_cframe *cf,
+				const struct decode_plane_info *planes,
+				unsigned int num_planes,
+				const __be16 *end_of_rlco_buf)
+{
+	struct fwht_slices *slices = cf->slices;
+	struct decode_job job;
+	const __be16 *rlco = cf->rlc_data;
+	unsigned int rows = slices->rows ? slices->rows : 1;
+	unsigned int mb_rows = 0;
+	unsigned int count = 0;
+	unsigned int i;
+
+	for (i = 0; i < num_planes; i++)
+		mb_rows += round_up(planes[i].height, 8) / 8;
+	/* Fewer, taller slices if there would be too many, see above. */
+	if (mb_rows > rows * (FWHT_MAX_SLICES - num_planes))
+		rows = (mb_rows + FWHT_MAX_SLICES - num_planes - 1) /
+		       (FWHT_MAX_SLICES - num_planes);
+
+	job.end_of_rlco_buf = end_of_rlco_buf;
+	for (i = 0; i < num_planes; i++)
+		if (!find_slices(&job, &count, &planes[i], rows, &rlco))
+			return false;
+
+	/* Planes only write their own lines, so they can't get in each other's way. */
+	slices->run(slices->priv, decode_slice, &job, count);
+
+	for (i = 0; i < count; i++)
+		if (!job.slice[i].ok)
+			return false;
 	return true;
 }
 
 bool fwht_decode_frame(struct fwht_cframe *cf, u32 hdr_flags,
 		       unsigned int components_num, unsigned int width,
-		       unsigned int height, const struct fwht_raw_frame *ref,
+		       unsigned int height, struct fwht_raw_frame *ref,
 		       unsigned int ref_stride, unsigned int ref_chroma_stride,
 		       struct fwht_raw_frame *dst, unsigned int dst_stride,
 		       unsigned int dst_chroma_stride)
@@ -917,13 +1977,16 @@ bool fwht_decode_frame(struct fwht_cframe *cf, u32 hdr_flags,
 	const __be16 *rlco = cf->rlc_data;
 	const __be16 *end_of_rlco_buf = cf->rlc_data +
 			(cf->size / sizeof(*rlco)) - 1;
+	struct decode_plane_info planes[4];
+	unsigned int num_planes = 0;
+	unsigned int i;
 
-	if (!decode_plane(cf, &rlco, height, width, ref->luma, ref_stride,
-			  ref->luma_alpha_step, dst->luma, dst_stride,
-			  dst->luma_alpha_step,
-			  hdr_flags & V4L2_FWHT_FL_LUMA_IS_UNCOMPRESSED,
-			  end_of_rlco_buf))
-		return false;
+	planes[num_planes++] = (struct decode_plane_info) {
+		height, width, ref->luma, ref_stride, ref->luma_alpha_step,
+		dst->luma, dst_stride, dst->luma_alpha_step,
+		hdr_flags & V4L2_FWHT_FL_LUMA_IS_UNCOMPRESSED,
+		cf->update_ref,
+	};
 
 	if (components_num >= 3) {
 		u32 h = height;
@@ -934,26 +1997,35 @@ bool fwht_decode_frame(struct fwht_cframe *cf, u32 hdr_flags,
 		if (!(hdr_flags & V4L2_FWHT_FL_CHROMA_FULL_WIDTH))
 			w /= 2;
 
-		if (!decode_plane(cf, &rlco, h, w, ref->cb, ref_chroma_stride,
-				  ref->chroma_step, dst->cb, dst_chroma_stride,
-				  dst->chroma_step,
-				  hdr_flags & V4L2_FWHT_FL_CB_IS_UNCOMPRESSED,
-				  end_of_rlco_buf))
-			return false;
-		if (!decode_plane(cf, &rlco, h, w, ref->cr, ref_chroma_stride,
-				  ref->chroma_step, dst->cr, dst_chroma_stride,
-				  dst->chroma_step,
-				  hdr_flags & V4L2_FWHT_FL_CR_IS_UNCOMPRESSED,
-				  end_of_rlco_buf))
-			return false;
+		planes[num_planes++] = (struct decode_plane_info) {
+			h, w, ref->cb, ref_chroma_stride, ref->chroma_step,
+			dst->cb, dst_chroma_stride, dst->chroma_step,
+			hdr_flags & V4L2_FWHT_FL_CB_IS_UNCOMPRESSED,
+			cf->update_ref,
+		};
+		planes[num_planes++] = (struct decode_plane_info) {
+			h, w, ref->cr, ref_chroma_stride, ref->chroma_step,
+			dst->cr, dst_chroma_stride, dst->chroma_step,
+			hdr_flags & V4L2_FWHT_FL_CR_IS_UNCOMPRESSED,
+			cf->update_ref,
+		};
 	}
 
 	if (components_num == 4)
-		if (!decode_plane(cf, &rlco, height, width, ref->alpha, ref_stride,
-				  ref->luma_alpha_step, dst->alpha, dst_stride,
-				  dst->luma_alpha_step,
-				  hdr_flags & V4L2_FWHT_FL_ALPHA_IS_UNCOMPRESSED,
-				  end_of_rlco_buf))
+		planes[num_planes++] = (struct decode_plane_info) {
+			height, width, ref->alpha, ref_stride,
+			ref->luma_alpha_step, dst->alpha, dst_stride,
+			dst->luma_alpha_step,
+			hdr_flags & V4L2_FWHT_FL_ALPHA_IS_UNCOMPRESSED,
+			cf->update_ref,
+		};
+
+	if (cf->slices && cf->slices->run)
+		return decode_frame_slices(cf, planes, num_planes,
+					   end_of_rlco_buf);
+
+	for (i = 0; i < num_planes; i++)
+		if (!decode_plane(cf, &rlco, &planes[i], end_of_rlco_buf))
 			return false;
 	return true;
 }
@@ -96,9 +96,39 @@ struct fwht_cframe_hdr {
 	__be32 size;
 };
 
+/* At most this many slices are made, taller ones if needed. */
+#define FWHT_MAX_SLICES 256
+
+/*
+ * Lets fwht_encode_frame() and fwht_decode_frame() split the planes into
+ * slices of rows macroblock rows each, and handle those at the same
+ * time. run() has to call job(arg, i) for every i below count, on
+ * whichever threads it likes, and return once they've all returned.
+ * Each slice is encoded into scratch first, which must hold
+ * fwht_max_rlc_size() bytes, then the slices are stitched together into
+ * one stream that decodes like any other. Decoding needs no scratch, it
+ * finds where every slice starts in the stream first.
+ */
+struct fwht_slices {
+	void (*run)(void *priv, void (*job)(void *arg, unsigned int i),
+		    void *arg, unsigned int count);
+	void *priv;
+	unsigned int rows;
+	__be16 *scratch;
+};
+
 struct fwht_cframe {
 	u16 i_frame_qp;
 	u16 p_frame_qp;
+	struct fwht_slices *slices;
+	/*
+	 * For fwht_encode_frame(), NULL or a copy of the previous input laid
+	 * out like the reference frame. Blocks that haven't changed since
+	 * skip the transform, the first frame has to be an I-frame.
+	 */
+	struct fwht_raw_frame *last_frm;
+	/* Have fwht_decode_frame() write the reference frame too. */
+	bool update_ref;
 	__be16 *rlc_data;
 	s16 coeffs[8 * 8];
 	s16 de_coeffs[8 * 8];
@@ -131,8 +161,28 @@ u32 fwht_encode_frame(struct fwht_raw_frame *frm,
 		      unsigned int stride, unsigned int chroma_stride);
 bool fwht_decode_frame(struct fwht_cframe *cf, u32 hdr_flags,
 		unsigned int components_num, unsigned int width,
-		unsigned int height, const struct fwht_raw_frame *ref,
+		unsigned int height, struct fwht_raw_frame *ref,
 		unsigned int ref_stride, unsigned int ref_chroma_stride,
 		struct fwht_raw_frame *dst, unsigned int dst_stride,
 		unsigned int dst_chroma_stride);
+unsigned int fwht_max_rlc_size(unsigned int width, unsigned int height,
+			       unsigned int width_div, unsigned int height_div,
+			       unsigned int components_num);
+
+
+/*
+ * Instruction sets the transforms and quantizers can use. The best one
+ * the CPU supports is picked at startup, every one of them produces the
+ * same output. Only change it while nothing is encoding or decoding.
+ */
+enum fwht_simd {
+	FWHT_SIMD_NONE,
+	FWHT_SIMD_SSE41,
+	FWHT_SIMD_AVX2,
+};
+
+enum fwht_simd fwht_simd_supported(void);
+enum fwht_simd fwht_set_simd(enum fwht_simd simd);
+enum fwht_simd fwht_get_simd(void);
+const char *fwht_simd_name(enum fwht_simd simd);
 #endif
@@ -235,6 +235,8 @@ int v4l2_fwht_encode(struct v4l2_fwht_state *state, u8 *p_in, u8 *p_out)
 
 	cf.i_frame_qp = state->i_frame_qp;
 	cf.p_frame_qp = state->p_frame_qp;
+	cf.slices = state->slices;
+	cf.last_frm = state->last_frame.buf ? &state->last_frame : NULL;
 	cf.rlc_data = (__be16 *)(p_out + sizeof(*p_hdr));
 
 	encoding = fwht_encode_frame(&rf, &state->ref_frame, &cf,
@@ -330,6 +332,8 @@ int v4l2_fwht_decode(struct v4l2_fwht_state *state, u8 *p_in, u8 *p_out)
 	state->xfer_func = ntohl(state->header.xfer_func);
 	state->ycbcr_enc = ntohl(state->header.ycbcr_enc);
 	state->quantization = ntohl(state->header.quantization);
+	cf.slices = state->slices;
+	cf.update_ref = true;
 	cf.rlc_data = (__be16 *)p_in;
 	cf.size = ntohl(state->header.size);
 
@@ -42,6 +42,10 @@ struct v4l2_fwht_state {
 	enum v4l2_quantization quantization;
 
 	struct fwht_raw_frame ref_frame;
+	/* The previous input for skipping unchanged blocks, or a NULL buf. */
+	struct fwht_raw_frame last_frame;
+	/* NULL to encode on the calling thread only. */
+	struct fwht_slices *slices;
 	struct fwht_cframe_hdr header;
 	u8 *compressed_frame;
 	u64 ref_frame_ts;
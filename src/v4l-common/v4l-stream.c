@@ -5,6 +5,7 @@
  * Copyright 2016 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
  */
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
@@ -17,6 +18,14 @@
 #define MIN_HEIGHT 64
 #define MAX_HEIGHT 2160
 
+/*
+ * The QP fwht_compress() uses without rate control, and the range rate
+ * control picks from. Beyond FWHT_MAX_QP every coefficient is cut.
+ */
+#define FWHT_DEFAULT_QP 20
+#define FWHT_MIN_QP 1
+#define FWHT_MAX_QP 1023
+
 /*
  * Since Bayer uses alternating lines of BG and GR color components
  * you cannot compare one line with the next to see if they are identical,
@@ -172,30 +181,156 @@ unsigned rle_compress(__u8 *b, unsigned size, unsigned bpl)
 	return (__u8 *)dst - b;
 }
 
-struct codec_ctx *fwht_alloc(unsigned pixfmt, unsigned visible_width, unsigned visible_height,
-			     unsigned coded_width, unsigned coded_height,
-			     unsigned field, unsigned colorspace, unsigned xfer_func,
-			     unsigned ycbcr_enc, unsigned quantization)
+static void fwht_set_planes(struct fwht_raw_frame *frm,
+			    const struct v4l2_fwht_pixfmt_info *info,
+			    unsigned size, unsigned chroma_size)
+{
+	frm->luma = frm->buf;
+	if (info->components_num >= 3) {
+		frm->cb = frm->luma + size;
+		frm->cr = frm->cb + chroma_size;
+	} else {
+		frm->cb = NULL;
+		frm->cr = NULL;
+	}
+
+	if (info->components_num == 4)
+		frm->alpha = frm->cr + chroma_size;
+	else
+		frm->alpha = NULL;
+}
+
+/* Whether the codec takes this format, without allocating anything. */
+bool fwht_check_format(unsigned pixfmt, unsigned coded_width, unsigned coded_height)
+{
+	const struct v4l2_fwht_pixfmt_info *info = v4l2_fwht_find_pixfmt(pixfmt);
+
+	// fwht expects macroblock alignment, check can be dropped once that
+	// restriction is lifted. Chroma planes that aren't whole macroblocks
+	// wide would spill into the next line, only their height may be cut
+	// short.
+	return info && coded_width % (8 * info->width_div) == 0 &&
+	       coded_height % 8 == 0;
+}
+
+/* Codec buffers start on a cache line, which suits any vector load. */
+#define FWHT_ARENA_ALIGN 64
+
+static size_t fwht_align(size_t size)
+{
+	return (size + FWHT_ARENA_ALIGN - 1) & ~(size_t)(FWHT_ARENA_ALIGN - 1);
+}
+
+/*
+ * Makes *buf hold at least size bytes. Buffers only ever grow, so once a
+ * context has seen its largest format, changing formats doesn't allocate
+ * or fault in fresh pages.
+ */
+static bool fwht_reserve(void **buf, size_t *buf_size, size_t size)
+{
+	void *p;
+
+	if (size <= *buf_size)
+		return true;
+	size = fwht_align(size);
+	p = aligned_alloc(FWHT_ARENA_ALIGN, size);
+	if (!p)
+		return false;
+	free(*buf);
+	*buf = p;
+	*buf_size = size;
+	return true;
+}
+
+/* Room for every slice of a frame of this size, see struct fwht_slices. */
+static bool fwht_reserve_scratch(struct codec_ctx *ctx,
+				 const struct v4l2_fwht_pixfmt_info *info,
+				 unsigned coded_width, unsigned coded_height)
+{
+	void *scratch = ctx->slices.scratch;
+	bool ok = fwht_reserve(&scratch, &ctx->scratch_size,
+			       fwht_max_rlc_size(coded_width, coded_height,
+						 info->width_div,
+						 info->height_div,
+						 info->components_num));
+
+	ctx->slices.scratch = scratch;
+	return ok;
+}
+
+/*
+ * Switches ctx to another format, in the buffers it already has if they
+ * are big enough. The next frame is an I-frame, slices and rate control
+ * settings carry over. On failure ctx keeps the format it had.
+ */
+bool fwht_set_format(struct codec_ctx *ctx, unsigned pixfmt,
+		     unsigned visible_width, unsigned visible_height,
+		     unsigned coded_width, unsigned coded_height,
+		     unsigned field, unsigned colorspace, unsigned xfer_func,
+		     unsigned ycbcr_enc, unsigned quantization)
 {
-	struct codec_ctx *ctx;
 	const struct v4l2_fwht_pixfmt_info *info = v4l2_fwht_find_pixfmt(pixfmt);
 	unsigned int chroma_div;
 	unsigned int size = coded_width * coded_height;
+	unsigned int frame_size;
+	unsigned int comp_size;
+	unsigned int in_size;
+	unsigned int chroma_ref;
+	unsigned int ref_stride;
+	size_t ref_size;
+	__u8 *arena;
 
-	// fwht expects macroblock alignment, check can be dropped once that
-	// restriction is lifted.
-	if (!info || coded_width % 8 || coded_height % 8)
-		return NULL;
+	if (!fwht_check_format(pixfmt, coded_width, coded_height))
+		return false;
+
+	chroma_div = info->width_div * info->height_div;
+	frame_size = size;
+	if (info->components_num == 4)
+		frame_size = 2 * size + 2 * (size / chroma_div);
+	else if (info->components_num == 3)
+		frame_size = size + 2 * (size / chroma_div);
+	/*
+	 * Planes that don't compress are stored as they are, padded to whole
+	 * macroblocks, which takes more than frame_size when a chroma plane
+	 * isn't a multiple of 8 lines high.
+	 */
+	comp_size = size;
+	if (info->components_num >= 3)
+		comp_size += 2 * coded_width / info->width_div *
+			     round_up(coded_height / info->height_div, 8);
+	if (info->components_num == 4)
+		comp_size += size;
+	comp_size += sizeof(struct fwht_cframe_hdr);
+	/*
+	 * Encoding reads those padded planes from the input too, past its
+	 * end for the last one, by less than 8 lines.
+	 */
+	in_size = frame_size;
+	if (comp_size > frame_size + sizeof(struct fwht_cframe_hdr))
+		in_size += 8 * coded_width * info->bytesperline_mult;
+	ref_stride = coded_width * info->luma_alpha_step;
+	/*
+	 * The encoder keeps its reference frame in whole macroblocks as well,
+	 * the last row of the last plane runs past its end. That also covers
+	 * the padded planes below. Encoding keeps the previous input in the
+	 * same layout to skip the blocks that haven't changed, decoding never
+	 * touches it.
+	 */
+	ref_size = fwht_align(frame_size + 8 * ref_stride);
+	if (ctx->slices.run &&
+	    !fwht_reserve_scratch(ctx, info, coded_width, coded_height))
+		return false;
+	if (!fwht_reserve(&ctx->arena, &ctx->arena_size,
+			  2 * ref_size + fwht_align(comp_size) +
+			  (in_size > frame_size ? in_size : 0)))
+		return false;
 
-	ctx = malloc(sizeof(*ctx));
-	if (!ctx)
-		return NULL;
 	ctx->state.coded_width = coded_width;
 	ctx->state.coded_height = coded_height;
 	ctx->state.visible_width = visible_width;
 	ctx->state.visible_height = visible_height;
 	ctx->state.stride = coded_width * info->bytesperline_mult;
-	ctx->state.ref_stride = coded_width * info->luma_alpha_step;
+	ctx->state.ref_stride = ref_stride;
 	ctx->state.info = info;
 	ctx->field = field;
 	ctx->state.colorspace = colorspace;
@@ -203,89 +338,209 @@ struct codec_ctx *fwht_alloc(unsigned pixfmt, unsigned visible_width, unsigned v
 	ctx->state.ycbcr_enc = ycbcr_enc;
 	ctx->state.quantization = quantization;
 	ctx->flags = 0;
-	chroma_div = info->width_div * info->height_div;
-	ctx->size = size;
-	if (info->components_num == 4)
-		ctx->size = 2 * size + 2 * (size / chroma_div);
-	else if (info->components_num == 3)
-		ctx->size = size + 2 * (size / chroma_div);
-	ctx->state.ref_frame.buf = malloc(ctx->size);
-	ctx->state.ref_frame.luma = ctx->state.ref_frame.buf;
-	ctx->comp_max_size = ctx->size + sizeof(struct fwht_cframe_hdr);
-	ctx->state.compressed_frame = malloc(ctx->comp_max_size);
-	if (!ctx->state.ref_frame.luma || !ctx->state.compressed_frame) {
-		free(ctx->state.ref_frame.luma);
-		free(ctx->state.compressed_frame);
-		free(ctx);
-		return NULL;
-	}
-	if (info->components_num >= 3) {
-		ctx->state.ref_frame.cb = ctx->state.ref_frame.luma + size;
-		ctx->state.ref_frame.cr = ctx->state.ref_frame.cb + size / chroma_div;
-	} else {
-		ctx->state.ref_frame.cb = NULL;
-		ctx->state.ref_frame.cr = NULL;
-	}
+	ctx->size = frame_size;
+	ctx->comp_max_size = comp_size;
+	ctx->in_size = in_size;
 
-	if (info->components_num == 4)
-		ctx->state.ref_frame.alpha =
-			ctx->state.ref_frame.cr + size / chroma_div;
-	else
-		ctx->state.ref_frame.alpha = NULL;
-	ctx->state.gop_size = 10;
+	arena = ctx->arena;
+	ctx->state.ref_frame.buf = arena;
+	ctx->state.last_frame.buf = arena + ref_size;
+	ctx->state.compressed_frame = arena + 2 * ref_size;
+	ctx->in_frame = NULL;
+	if (in_size > frame_size)
+		ctx->in_frame = arena + 2 * ref_size + fwht_align(comp_size);
+	/*
+	 * These are the encoder's planes, which it fills macroblock by
+	 * macroblock. A chroma plane that isn't whole macroblocks high needs
+	 * room for its last ones, or it overwrites the start of the next plane
+	 * and uses that as its reference for the next frame. The decoder lays
+	 * out the planes again for every frame.
+	 */
+	chroma_ref = coded_width / info->width_div *
+		     round_up(coded_height / info->height_div, 8);
+	fwht_set_planes(&ctx->state.ref_frame, info, size, chroma_ref);
+	fwht_set_planes(&ctx->state.last_frame, info, size, chroma_ref);
+
+	/* Start over with an I-frame, the rate control model starts over too. */
+	ctx->state.gop_size = ctx->min_gop;
 	ctx->state.gop_cnt = 0;
+	fwht_set_rate(ctx, &ctx->rate);
+	return true;
+}
+
+struct codec_ctx *fwht_alloc(unsigned pixfmt, unsigned visible_width, unsigned visible_height,
+			     unsigned coded_width, unsigned coded_height,
+			     unsigned field, unsigned colorspace, unsigned xfer_func,
+			     unsigned ycbcr_enc, unsigned quantization)
+{
+	struct codec_ctx *ctx = calloc(1, sizeof(*ctx));
+
+	if (!ctx)
+		return NULL;
+	ctx->state.gop_size = 10;
+	fwht_set_rate(ctx, &ctx->rate);
+	if (!fwht_set_format(ctx, pixfmt, visible_width, visible_height,
+			     coded_width, coded_height, field, colorspace,
+			     xfer_func, ycbcr_enc, quantization)) {
+		fwht_free(ctx);
+		return NULL;
+	}
 	return ctx;
 }
 
+/*
+ * Encode and decode slices of rows macroblock rows in parallel, run() is
+ * called for every frame with the slices to do, see struct fwht_slices.
+ */
+bool fwht_set_slices(struct codec_ctx *ctx,
+		     void (*run)(void *priv, void (*job)(void *arg, unsigned i),
+				 void *arg, unsigned count),
+		     void *priv, unsigned rows)
+{
+	if (!fwht_reserve_scratch(ctx, ctx->state.info, ctx->state.coded_width,
+				  ctx->state.coded_height))
+		return false;
+	ctx->slices.run = run;
+	ctx->slices.priv = priv;
+	ctx->slices.rows = rows;
+	ctx->state.slices = &ctx->slices;
+	return true;
+}
+
 void fwht_free(struct codec_ctx *ctx)
 {
-	free(ctx->state.ref_frame.luma);
-	free(ctx->state.compressed_frame);
+	free(ctx->slices.scratch);
+	free(ctx->arena);
 	free(ctx);
 }
 
-__u8 *fwht_compress(struct codec_ctx *ctx, __u8 *buf, unsigned uncomp_size, unsigned *comp_size)
+/* Call after changing state.gop_size, which becomes the shortest GOP. */
+void fwht_set_rate(struct codec_ctx *ctx, const struct fwht_rate *rate)
 {
-	ctx->state.i_frame_qp = ctx->state.p_frame_qp = 20;
-	*comp_size = v4l2_fwht_encode(&ctx->state, buf, ctx->state.compressed_frame);
-	return ctx->state.compressed_frame;
+	struct fwht_rate *r = &ctx->rate;
+
+	*r = *rate;
+	if (!r->max_qp || r->max_qp > FWHT_MAX_QP)
+		r->max_qp = FWHT_MAX_QP;
+	if (r->min_qp < FWHT_MIN_QP)
+		r->min_qp = FWHT_MIN_QP;
+	if (r->min_qp > r->max_qp)
+		r->min_qp = r->max_qp;
+	if (!r->qp)
+		r->qp = FWHT_DEFAULT_QP;
+	if (r->qp < r->min_qp)
+		r->qp = r->min_qp;
+	if (r->qp > r->max_qp)
+		r->qp = r->max_qp;
+	ctx->min_gop = ctx->state.gop_size;
+	if (r->max_gop < ctx->min_gop)
+		r->max_gop = ctx->min_gop;
+	if (!r->buffer_bytes)
+		r->buffer_bytes = r->target_bytes * ctx->min_gop;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->i_cost = 0;
+	ctx->p_cost = 0;
+	ctx->qp_root = 0;
 }
 
-static void copy_cap_to_ref(const u8 *cap, const struct v4l2_fwht_pixfmt_info *info,
-			    struct v4l2_fwht_state *state)
+/*
+ * Frame sizes go roughly with 1 / sqrt(QP), so the cost of a frame is its
+ * size times sqrt(QP). The QP is picked for the frames left in the GOP to
+ * fit in what is left of its budget, which takes the bytes the stream is
+ * ahead or behind into account. It moves by at most a factor 1.5 in
+ * sqrt(QP) per frame, so one odd frame doesn't throw it off.
+ */
+static unsigned fwht_pick_qp(struct codec_ctx *ctx)
 {
-	int plane_idx;
-	u8 *p_ref = state->ref_frame.buf;
-	unsigned int cap_stride = state->stride;
-	unsigned int ref_stride = state->ref_stride;
-
-	for (plane_idx = 0; plane_idx < info->planes_num; plane_idx++) {
-		int i;
-		unsigned int h_div = (plane_idx == 1 || plane_idx == 2) ?
-			info->height_div : 1;
-		const u8 *row_cap = cap;
-		u8 *row_ref = p_ref;
-
-		if (info->planes_num == 3 && plane_idx == 1) {
-			cap_stride /= 2;
-			ref_stride /= 2;
-		}
+	const struct fwht_rate *r = &ctx->rate;
+	unsigned left = ctx->state.gop_size - ctx->state.gop_cnt;
+	double p_cost = ctx->p_cost ? ctx->p_cost : ctx->i_cost / 2;
+	double cost, budget, root;
+	unsigned qp;
 
-		if (plane_idx == 1 &&
-		    (info->id == V4L2_PIX_FMT_NV24 ||
-		     info->id == V4L2_PIX_FMT_NV42)) {
-			cap_stride *= 2;
-			ref_stride *= 2;
-		}
+	if (!r->target_bytes || !ctx->i_cost)
+		return r->qp;
+	if (ctx->stats.fullness >= (int)r->buffer_bytes)
+		return r->max_qp;
 
-		for (i = 0; i < state->visible_height / h_div; i++) {
-			memcpy(row_ref, row_cap, ref_stride);
-			row_ref += ref_stride;
-			row_cap += cap_stride;
-		}
-		cap += cap_stride * (state->coded_height / h_div);
-		p_ref += ref_stride * (state->coded_height / h_div);
+	cost = (ctx->state.gop_cnt ? p_cost : ctx->i_cost) + (left - 1) * p_cost;
+	budget = (double)left * r->target_bytes - ctx->stats.fullness;
+	if (budget < left * r->target_bytes / 8.0)
+		budget = left * r->target_bytes / 8.0;
+	root = cost / budget;
+	if (ctx->qp_root && root > ctx->qp_root * 1.5)
+		root = ctx->qp_root * 1.5;
+	if (ctx->qp_root && root < ctx->qp_root / 1.5)
+		root = ctx->qp_root / 1.5;
+
+	qp = root * root + 0.5 < r->max_qp ? root * root + 0.5 : r->max_qp;
+	if (qp < r->min_qp)
+		qp = r->min_qp;
+	ctx->qp_root = sqrt(qp);
+	return qp;
+}
+
+static void fwht_rate_update(struct codec_ctx *ctx, unsigned qp, unsigned size)
+{
+	const struct fwht_cframe_hdr *hdr = (struct fwht_cframe_hdr *)ctx->state.compressed_frame;
+	const struct fwht_rate *r = &ctx->rate;
+	struct fwht_stats *st = &ctx->stats;
+	bool intra = ntohl(hdr->flags) & V4L2_FWHT_FL_I_FRAME;
+	double cost = size * sqrt(qp);
+	int fullness = st->fullness + (int)(size - r->target_bytes);
+
+	if (intra)
+		ctx->i_cost = ctx->i_cost ? (ctx->i_cost + cost) / 2 : cost;
+	else
+		ctx->p_cost = ctx->p_cost ? (3 * ctx->p_cost + cost) / 4 : cost;
+
+	st->frames++;
+	st->i_frames += intra;
+	st->bytes += size;
+	st->last_size = size;
+	st->qp = qp;
+	if (r->target_bytes) {
+		if (fullness > (int)r->buffer_bytes)
+			fullness = r->buffer_bytes;
+		if (fullness < -(int)r->buffer_bytes)
+			fullness = -(int)r->buffer_bytes;
+		st->fullness = fullness;
 	}
+
+	/*
+	 * A new GOP just started. I-frames are worth it while P-frames cost
+	 * a fair part of one, a static scene is better off with fewer.
+	 */
+	if (r->target_bytes && intra && ctx->p_cost) {
+		unsigned gop = ctx->state.gop_size;
+
+		if (ctx->p_cost * 8 < ctx->i_cost)
+			gop = gop * 2 < r->max_gop ? gop * 2 : r->max_gop;
+		else if (ctx->p_cost * 3 > ctx->i_cost)
+			gop = ctx->min_gop;
+		ctx->state.gop_size = gop;
+		if (ctx->state.gop_cnt >= gop)
+			ctx->state.gop_cnt = 0;
+	}
+	st->gop_size = ctx->state.gop_size;
+}
+
+__u8 *fwht_compress(struct codec_ctx *ctx, __u8 *buf, unsigned uncomp_size, unsigned *comp_size)
+{
+	unsigned qp = fwht_pick_qp(ctx);
+
+	if (ctx->in_frame && uncomp_size < ctx->in_size) {
+		unsigned copy = uncomp_size < ctx->size ? uncomp_size : ctx->size;
+
+		memcpy(ctx->in_frame, buf, copy);
+		memset(ctx->in_frame + copy, 0, ctx->in_size - copy);
+		buf = ctx->in_frame;
+	}
+	ctx->state.i_frame_qp = ctx->state.p_frame_qp = qp;
+	*comp_size = v4l2_fwht_encode(&ctx->state, buf, ctx->state.compressed_frame);
+	if ((int)*comp_size >= 0)
+		fwht_rate_update(ctx, qp, *comp_size);
+	return ctx->state.compressed_frame;
 }
 
 bool fwht_decompress(struct codec_ctx *ctx, __u8 *p_in, unsigned comp_size,
@@ -293,8 +548,6 @@ bool fwht_decompress(struct codec_ctx *ctx, __u8 *p_in, unsigned comp_size,
 {
 	memcpy(&ctx->state.header, p_in, sizeof(ctx->state.header));
 	p_in += sizeof(ctx->state.header);
-	if (v4l2_fwht_decode(&ctx->state, p_in, p_out))
-		return false;
-	copy_cap_to_ref(p_out, ctx->state.info, &ctx->state);
-	return true;
+	/* This updates the reference frame as well. */
+	return !v4l2_fwht_decode(&ctx->state, p_in, p_out);
 }
@@ -124,7 +124,9 @@ extern "C" {
  * FWHT-compression desciption:
  *
  * The compressed encoding is simple but good enough for debugging.
- * The size value is always <= bytesused + sizeof(struct fwht_cframe_hdr).
+ * The size value is always <= bytesused + sizeof(struct fwht_cframe_hdr),
+ * unless a chroma plane that isn't a whole number of macroblocks high is
+ * stored unencoded: those are padded to whole macroblocks.
  *
  * See codec-fwht.h for more information about the compression
  * details.
@@ -136,12 +138,63 @@ extern "C" {
  */
 #define V4L_STREAM_PACKET_END				v4l2_fourcc('e', 'n', 'd', ' ')
 
+/*
+ * Rate control for fwht_compress(). Without a target every frame uses
+ * qp. With one, the QP of each frame is picked so that the output
+ * averages target_bytes per frame over a GOP. Frames may run ahead of the
+ * target by at most buffer_bytes, what the link or disk absorbs within
+ * its latency budget, before the QP goes to max_qp. While P-frames cost
+ * little next to I-frames the GOP grows, up to max_gop frames.
+ *
+ * The QP is only the dead zone of the quantizer, decoders don't need to
+ * know it.
+ */
+struct fwht_rate {
+	unsigned target_bytes;
+	unsigned buffer_bytes;
+	unsigned qp;
+	unsigned min_qp;
+	unsigned max_qp;
+	unsigned max_gop;
+};
+
+/* What fwht_compress() did so far, and with the last frame. */
+struct fwht_stats {
+	__u64 frames;
+	__u64 i_frames;
+	__u64 bytes;
+	unsigned last_size;
+	unsigned qp;
+	unsigned gop_size;
+	/* bytes ahead of the target, negative when behind */
+	int fullness;
+};
+
 struct codec_ctx {
 	struct v4l2_fwht_state	state;
 	unsigned int		flags;
 	unsigned int		size;
 	u32			field;
 	u32			comp_max_size;
+	/*
+	 * What the encoder reads of its input, more than size when the last
+	 * plane isn't whole macroblocks, and a copy to read it from if the
+	 * input isn't that big.
+	 */
+	unsigned int		in_size;
+	__u8			*in_frame;
+	struct fwht_slices	slices;
+	struct fwht_rate	rate;
+	struct fwht_stats	stats;
+	/* ref_frame, last_frame, compressed_frame and in_frame, grow only */
+	void			*arena;
+	size_t			arena_size;
+	size_t			scratch_size;
+	/* rate control: the configured GOP, and I/P-frame cost per sqrt(QP) */
+	unsigned		min_gop;
+	double			i_cost;
+	double			p_cost;
+	double			qp_root;
 };
 
 unsigned rle_compress(__u8 *buf, unsigned size, unsigned bytesperline);
@@ -151,6 +204,17 @@ struct codec_ctx *fwht_alloc(unsigned pixfmt, unsigned visible_width, unsigned v
 			     unsigned colorspace, unsigned xfer_func, unsigned ycbcr_enc,
 			     unsigned quantization);
 void fwht_free(struct codec_ctx *ctx);
+bool fwht_check_format(unsigned pixfmt, unsigned coded_width, unsigned coded_height);
+bool fwht_set_format(struct codec_ctx *ctx, unsigned pixfmt,
+		     unsigned visible_width, unsigned visible_height,
+		     unsigned coded_width, unsigned coded_height, unsigned field,
+		     unsigned colorspace, unsigned xfer_func, unsigned ycbcr_enc,
+		     unsigned quantization);
+bool fwht_set_slices(struct codec_ctx *ctx,
+		     void (*run)(void *priv, void (*job)(void *arg, unsigned i),
+				 void *arg, unsigned count),
+		     void *priv, unsigned rows);
+void fwht_set_rate(struct codec_ctx *ctx, const struct fwht_rate *rate);
 __u8 *fwht_compress(struct codec_ctx *ctx, __u8 *buf, unsigned size, unsigned *comp_size);
 bool fwht_decompress(struct codec_ctx *ctx, __u8 *read_buf, unsigned comp_size,
 		     __u8 *buf, unsigned size);
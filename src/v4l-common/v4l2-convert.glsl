@@ -23,74 +23,26 @@ in vec2 vs_TexCoord;
 
 out vec4 fs_FragColor;
 
-// YUV (aka Y'CbCr) to R'G'B' matrices
-
-const mat3 yuv2rgb = mat3(
-#if YCBCRENC == V4L2_YCBCR_ENC_SMPTE240M
-	// Old obsolete HDTV standard. Replaced by REC 709.
-	// SMPTE 240M has its own luma coefficients
-	1.0,     1.0,     1.0,
-	0.0,    -0.2253,  1.8270,
-	1.5756, -0.4768,  0.0
-#elif YCBCRENC == V4L2_YCBCR_ENC_BT2020
-	// BT.2020 luma coefficients
-	1.0,     1.0,     1.0,
-	0.0,    -0.1646,  1.8814,
-	1.4719, -0.5703,  0.0
-#elif YCBCRENC == V4L2_YCBCR_ENC_601 || YCBCRENC == V4L2_YCBCR_ENC_XV601
-	// These colorspaces all use the BT.601 luma coefficients
-	1.0,    1.0,    1.0,
-	0.0,   -0.344,  1.773,
-	1.403, -0.714,  0.0
-#else
-	// The HDTV colorspaces all use REC 709 luma coefficients
-	1.0,     1.0,     1.0,
-	0.0,    -0.1870,  1.8556,
-	1.5701, -0.4664,  0.0
-#endif
-);
-
-// Various colorspace conversion matrices that transfer the source chromaticities
-// to the sRGB/Rec.709 chromaticities
-
-const mat3 colconv = mat3(
-#if COLSP == V4L2_COLORSPACE_SMPTE170M || COLSP == V4L2_COLORSPACE_SMPTE240M
-	// Current SDTV standard, although slowly being replaced by REC 709.
-	// Uses the SMPTE 170M aka SMPTE-C aka SMPTE RP 145 conversion matrix.
-	0.939536,  0.017743, -0.001591,
-	0.050215,  0.965758, -0.004356,
-	0.001789,  0.016243,  1.005951
-#elif COLSP == V4L2_COLORSPACE_470_SYSTEM_M
-	// Old obsolete NTSC standard. Replaced by REC 709.
-	// Uses the NTSC 1953 conversion matrix and the Bradford method to
-	// compensate for the different whitepoints.
-	 1.4858417, -0.0251179, -0.0272254,
-	-0.4033361,  0.9541568, -0.0440815,
-	-0.0825056,  0.0709611,  1.0713068
-#elif COLSP == V4L2_COLORSPACE_470_SYSTEM_BG
-	// Old obsolete PAL/SECAM standard. Replaced by REC 709.
-	// Uses the EBU Tech. 3213 conversion matrix.
-	 1.0440, 0,  0,
-	-0.0440, 1, -0.0119,
-	 0,      0,  1.0119
-#elif COLSP == V4L2_COLORSPACE_OPRGB
-	 1.3982832, 0,  0,
-	-0.3982831, 1, -0.0429383,
-	 0,         0,  1.0429383
-#elif COLSP == V4L2_COLORSPACE_DCI_P3
-	// Uses the Bradford method to compensate for the different whitepoints.
-	 1.1574000, -0.0415052, -0.0180562,
-	-0.1548597,  1.0455684, -0.0785993,
-	-0.0025403, -0.0040633,  1.0966555
-#elif COLSP == V4L2_COLORSPACE_BT2020
-	 1.6603627, -0.1245635, -0.0181566,
-	-0.5875400,  1.1329114, -0.1006017,
-	-0.0728227, -0.0083478,  1.1187583
-#else
-	// Identity matrix
-	1.0
-#endif
-);
+// The colorimetry is set through uniforms so that changing it doesn't
+// require a new program. See CaptureWin::updateColorUniforms().
+
+// YUV (aka Y'CbCr) to R'G'B' matrix for the Y'CbCr encoding
+uniform mat3 yuv2rgb;
+
+// Transfers the source chromaticities to the sRGB/Rec.709 chromaticities,
+// the identity matrix if no conversion is needed
+uniform mat3 colconv;
+
+// Normalizes limited range (and xv601/xv709) values, a no-op for full range
+uniform vec3 quant_offset;
+uniform vec3 quant_scale;
+
+// The V4L2_XFER_FUNC_* to linearize with, V4L2_XFER_FUNC_NONE if the
+// texture sampler already does that
+uniform uint xfer_func;
+
+// Set for V4L2_YCBCR_ENC_BT2020_CONST_LUM
+uniform bool const_lum;
 
 void main()
 {
@@ -220,10 +172,8 @@ void main()
 	rgb = vec3(urgb) / 65535.0;
 #endif
 
-#if QUANT == V4L2_QUANTIZATION_LIM_RANGE
-	rgb -= 16.0 / 255.0;
-	rgb *= 255.0 / 219.0;
-#endif
+	rgb -= quant_offset;
+	rgb *= quant_scale;
 
 #else // IS_RGB
 
@@ -319,102 +269,82 @@ void main()
 	rgb = c.z * mix(K.xxx, clamp(p - K.xxx, 0.0, 1.0), c.y);
 #else // IS_HSV
 	yuv.gb -= 0.5;
-#endif
 
-#if QUANT != V4L2_QUANTIZATION_FULL_RANGE || YCBCRENC == V4L2_YCBCR_ENC_XV601 || YCBCRENC == V4L2_YCBCR_ENC_XV709
 	/*
 	 * xv709 and xv601 have full range quantization, but they still
 	 * need to be normalized as if they were limited range. But the
 	 * result are values outside the normal 0-1 range, which is the
 	 * point of these extended gamut encodings.
 	 */
-	const vec3 scale = vec3(255.0 / 219.0, 255.0 / 224.0, 255.0 / 224.0);
-	const vec3 offset = vec3(16.0 / 255.0, 0.0, 0.0);
-
-	yuv -= offset;
-	yuv *= scale;
-#endif
-
-#if YCBCRENC == V4L2_YCBCR_ENC_BT2020_CONST_LUM
-	// BT.2020_CONST_LUM luma coefficients
-	float y = yuv.r;
-	float u = yuv.g;
-	float v = yuv.b;
-	float b = u <= 0.0 ? y + 1.9404 * u : y + 1.5816 * u;
-	float r = v <= 0.0 ? y + 1.7184 * v : y + 0.9936 * v;
-	float lin_r = (r < 0.081) ? r / 4.5 : pow((r + 0.099) / 1.099, 1.0 / 0.45);
-	float lin_b = (b < 0.081) ? b / 4.5 : pow((b + 0.099) / 1.099, 1.0 / 0.45);
-	float lin_y = (y < 0.081) ? y / 4.5 : pow((y + 0.099) / 1.099, 1.0 / 0.45);
-	float lin_g = lin_y / 0.6780 - lin_r * 0.2627 / 0.6780 - lin_b * 0.0593 / 0.6780;
-	float g = (lin_g < 0.018) ? lin_g * 4.5 : 1.099 * pow(lin_g, 0.45) - 0.099;
-	rgb = vec3(r, g, b);
-#elif !IS_HSV
-	rgb = yuv2rgb * yuv;
+	yuv -= quant_offset;
+	yuv *= quant_scale;
+
+	if (const_lum) {
+		// BT.2020_CONST_LUM luma coefficients
+		float y = yuv.r;
+		float u = yuv.g;
+		float v = yuv.b;
+		float b = u <= 0.0 ? y + 1.9404 * u : y + 1.5816 * u;
+		float r = v <= 0.0 ? y + 1.7184 * v : y + 0.9936 * v;
+		float lin_r = (r < 0.081) ? r / 4.5 : pow((r + 0.099) / 1.099, 1.0 / 0.45);
+		float lin_b = (b < 0.081) ? b / 4.5 : pow((b + 0.099) / 1.099, 1.0 / 0.45);
+		float lin_y = (y < 0.081) ? y / 4.5 : pow((y + 0.099) / 1.099, 1.0 / 0.45);
+		float lin_g = lin_y / 0.6780 - lin_r * 0.2627 / 0.6780 - lin_b * 0.0593 / 0.6780;
+		float g = (lin_g < 0.018) ? lin_g * 4.5 : 1.099 * pow(lin_g, 0.45) - 0.099;
+		rgb = vec3(r, g, b);
+	} else {
+		rgb = yuv2rgb * yuv;
+	}
 #endif
 #endif // !IS_RGB
 
 // Convert non-linear R'G'B' to linear RGB, taking into account the
 // colorspace.
-#if XFERFUNC == V4L2_XFER_FUNC_SMPTE240M
 
 // Old obsolete HDTV standard. Replaced by REC 709.
 // This is the transfer function for SMPTE 240M
-#define XFER(c) (((c) < 0.0913) ? (c) / 4.0 : pow(((c) + 0.1115) / 1.1115, 1.0 / 0.45))
-
-	rgb = vec3(XFER(rgb.r), XFER(rgb.g), XFER(rgb.b));
-
-#elif XFERFUNC == V4L2_XFER_FUNC_SRGB
+#define XFER_SMPTE240M(c) (((c) < 0.0913) ? (c) / 4.0 : pow(((c) + 0.1115) / 1.1115, 1.0 / 0.45))
 
 // This is used for sRGB as specified by the IEC FDIS 61966-2-1 standard
-#define XFER(c) (((c) < -0.04045) ? -pow((-(c) + 0.055) / 1.055, 2.4) : \
+#define XFER_SRGB_INV(c) (((c) < -0.04045) ? -pow((-(c) + 0.055) / 1.055, 2.4) : \
 		(((c) <= 0.04045) ? (c) / 12.92 : pow(((c) + 0.055) / 1.055, 2.4)))
 
-	rgb = vec3(XFER(rgb.r), XFER(rgb.g), XFER(rgb.b));
-
-#elif XFERFUNC == V4L2_XFER_FUNC_OPRGB
-
-	// Avoid powers of negative numbers
-	rgb = max(rgb, vec3(0.0));
-	rgb = pow(rgb, vec3(2.19921875));
-
-#elif XFERFUNC == V4L2_XFER_FUNC_DCI_P3
-
-	// Avoid powers of negative numbers
-	rgb = max(rgb, vec3(0.0));
-	rgb = pow(rgb, vec3(2.6));
-
-#elif XFERFUNC == V4L2_XFER_FUNC_SMPTE2084
-	const vec3 m1 = vec3(1.0 / ((2610.0 / 4096.0) / 4.0));
-	const vec3 m2 = vec3(1.0 / (128.0 * 2523.0 / 4096.0));
-	const vec3 c1 = vec3(3424.0 / 4096.0);
-	const vec3 c2 = vec3(32.0 * 2413.0 / 4096.0);
-	const vec3 c3 = vec3(32.0 * 2392.0 / 4096.0);
-
-	// Avoid powers of negative numbers
-	rgb = max(rgb, vec3(0.0));
-	rgb = pow(rgb, m2);
-	// The factor 100 is because SMPTE-2084 maps to 0-10000 cd/m^2
-	// whereas other transfer functions map to 0-100 cd/m^2.
-	rgb = pow(max(rgb - c1, vec3(0.0)) / (c2 - rgb * c3), m1) * 100.0;
-
-#elif XFERFUNC != V4L2_XFER_FUNC_NONE
-
 // All others use the transfer function specified by REC 709
-#define XFER(c) (((c) <= -0.081) ? -pow(((c) - 0.099) / -1.099, 1.0 / 0.45) : \
+#define XFER_709(c) (((c) <= -0.081) ? -pow(((c) - 0.099) / -1.099, 1.0 / 0.45) : \
 		 (((c) < 0.081) ? (c) / 4.5 : pow(((c) + 0.099) / 1.099, 1.0 / 0.45)))
 
-	rgb = vec3(XFER(rgb.r), XFER(rgb.g), XFER(rgb.b));
-
-#endif
+	if (xfer_func == V4L2_XFER_FUNC_SMPTE240M) {
+		rgb = vec3(XFER_SMPTE240M(rgb.r), XFER_SMPTE240M(rgb.g), XFER_SMPTE240M(rgb.b));
+	} else if (xfer_func == V4L2_XFER_FUNC_SRGB) {
+		rgb = vec3(XFER_SRGB_INV(rgb.r), XFER_SRGB_INV(rgb.g), XFER_SRGB_INV(rgb.b));
+	} else if (xfer_func == V4L2_XFER_FUNC_OPRGB) {
+		// Avoid powers of negative numbers
+		rgb = max(rgb, vec3(0.0));
+		rgb = pow(rgb, vec3(2.19921875));
+	} else if (xfer_func == V4L2_XFER_FUNC_DCI_P3) {
+		// Avoid powers of negative numbers
+		rgb = max(rgb, vec3(0.0));
+		rgb = pow(rgb, vec3(2.6));
+	} else if (xfer_func == V4L2_XFER_FUNC_SMPTE2084) {
+		const vec3 m1 = vec3(1.0 / ((2610.0 / 4096.0) / 4.0));
+		const vec3 m2 = vec3(1.0 / (128.0 * 2523.0 / 4096.0));
+		const vec3 c1 = vec3(3424.0 / 4096.0);
+		const vec3 c2 = vec3(32.0 * 2413.0 / 4096.0);
+		const vec3 c3 = vec3(32.0 * 2392.0 / 4096.0);
+
+		// Avoid powers of negative numbers
+		rgb = max(rgb, vec3(0.0));
+		rgb = pow(rgb, m2);
+		// The factor 100 is because SMPTE-2084 maps to 0-10000 cd/m^2
+		// whereas other transfer functions map to 0-100 cd/m^2.
+		rgb = pow(max(rgb - c1, vec3(0.0)) / (c2 - rgb * c3), m1) * 100.0;
+	} else if (xfer_func != V4L2_XFER_FUNC_NONE) {
+		rgb = vec3(XFER_709(rgb.r), XFER_709(rgb.g), XFER_709(rgb.b));
+	}
 
 // Convert the given colorspace to the REC 709/sRGB colorspace. All colors are
 // specified as linear RGB.
-#if COLSP == V4L2_COLORSPACE_SMPTE170M || COLSP == V4L2_COLORSPACE_SMPTE240M || \
-    COLSP == V4L2_COLORSPACE_470_SYSTEM_M || COLSP == V4L2_COLORSPACE_470_SYSTEM_BG || \
-    COLSP == V4L2_COLORSPACE_OPRGB || COLSP == V4L2_COLORSPACE_DCI_P3 || \
-    COLSP == V4L2_COLORSPACE_BT2020
 	rgb = colconv * rgb;
-#endif
 
 // Convert linear RGB to non-linear R'G'B', assuming an sRGB display colorspace.
 
@@ -13,74 +13,26 @@
 "\n"
 "out vec4 fs_FragColor;\n"
 "\n"
-"// YUV (aka Y'CbCr) to R'G'B' matrices\n"
-"\n"
-"const mat3 yuv2rgb = mat3(\n"
-"#if YCBCRENC == V4L2_YCBCR_ENC_SMPTE240M\n"
-"	// Old obsolete HDTV standard. Replaced by REC 709.\n"
-"	// SMPTE 240M has its own luma coefficients\n"
-"	1.0,     1.0,     1.0,\n"
-"	0.0,    -0.2253,  1.8270,\n"
-"	1.5756, -0.4768,  0.0\n"
-"#elif YCBCRENC == V4L2_YCBCR_ENC_BT2020\n"
-"	// BT.2020 luma coefficients\n"
-"	1.0,     1.0,     1.0,\n"
-"	0.0,    -0.1646,  1.8814,\n"
-"	1.4719, -0.5703,  0.0\n"
-"#elif YCBCRENC == V4L2_YCBCR_ENC_601 || YCBCRENC == V4L2_YCBCR_ENC_XV601\n"
-"	// These colorspaces all use the BT.601 luma coefficients\n"
-"	1.0,    1.0,    1.0,\n"
-"	0.0,   -0.344,  1.773,\n"
-"	1.403, -0.714,  0.0\n"
-"#else\n"
-"	// The HDTV colorspaces all use REC 709 luma coefficients\n"
-"	1.0,     1.0,     1.0,\n"
-"	0.0,    -0.1870,  1.8556,\n"
-"	1.5701, -0.4664,  0.0\n"
-"#endif\n"
-");\n"
-"\n"
-"// Various colorspace conversion matrices that transfer the source chromaticities\n"
-"// to the sRGB/Rec.709 chromaticities\n"
-"\n"
-"const mat3 colconv = mat3(\n"
-"#if COLSP == V4L2_COLORSPACE_SMPTE170M || COLSP == V4L2_COLORSPACE_SMPTE240M\n"
-"	// Current SDTV standard, although slowly being replaced by REC 709.\n"
-"	// Uses the SMPTE 170M aka SMPTE-C aka SMPTE RP 145 conversion matrix.\n"
-"	0.939536,  0.017743, -0.001591,\n"
-"	0.050215,  0.965758, -0.004356,\n"
-"	0.001789,  0.016243,  1.005951\n"
-"#elif COLSP == V4L2_COLORSPACE_470_SYSTEM_M\n"
-"	// Old obsolete NTSC standard. Replaced by REC 709.\n"
-"	// Uses the NTSC 1953 conversion matrix and the Bradford method to\n"
-"	// compensate for the different whitepoints.\n"
-"	 1.4858417, -0.0251179, -0.0272254,\n"
-"	-0.4033361,  0.9541568, -0.0440815,\n"
-"	-0.0825056,  0.0709611,  1.0713068\n"
-"#elif COLSP == V4L2_COLORSPACE_470_SYSTEM_BG\n"
-"	// Old obsolete PAL/SECAM standard. Replaced by REC 709.\n"
-"	// Uses the EBU Tech. 3213 conversion matrix.\n"
-"	 1.0440, 0,  0,\n"
-"	-0.0440, 1, -0.0119,\n"
-"	 0,      0,  1.0119\n"
-"#elif COLSP == V4L2_COLORSPACE_OPRGB\n"
-"	 1.3982832, 0,  0,\n"
-"	-0.3982831, 1, -0.0429383,\n"
-"	 0,         0,  1.0429383\n"
-"#elif COLSP == V4L2_COLORSPACE_DCI_P3\n"
-"	// Uses the Bradford method to compensate for the different whitepoints.\n"
-"	 1.1574000, -0.0415052, -0.0180562,\n"
-"	-0.1548597,  1.0455684, -0.0785993,\n"
-"	-0.0025403, -0.0040633,  1.0966555\n"
-"#elif COLSP == V4L2_COLORSPACE_BT2020\n"
-"	 1.6603627, -0.1245635, -0.0181566,\n"
-"	-0.5875400,  1.1329114, -0.1006017,\n"
-"	-0.0728227, -0.0083478,  1.1187583\n"
-"#else\n"
-"	// Identity matrix\n"
-"	1.0\n"
-"#endif\n"
-");\n"
+"// The colorimetry is set through uniforms so that changing it doesn't\n"
+"// require a new program. See CaptureWin::updateColorUniforms().\n"
+"\n"
+"// YUV (aka Y'CbCr) to R'G'B' matrix for the Y'CbCr encoding\n"
+"uniform mat3 yuv2rgb;\n"
+"\n"
+"// Transfers the source chromaticities to the sRGB/Rec.709 chromaticities,\n"
+"// the identity matrix if no conversion is needed\n"
+"uniform mat3 colconv;\n"
+"\n"
+"// Normalizes limited range (and xv601/xv709) values, a no-op for full range\n"
+"uniform vec3 quant_offset;\n"
+"uniform vec3 quant_scale;\n"
+"\n"
+"// The V4L2_XFER_FUNC_* to linearize with, V4L2_XFER_FUNC_NONE if the\n"
+"// texture sampler already does that\n"
+"uniform uint xfer_func;\n"
+"\n"
+"// Set for V4L2_YCBCR_ENC_BT2020_CONST_LUM\n"
+"uniform bool const_lum;\n"
 "\n"
 "void main()\n"
 "{\n"
@@ -196,10 +148,8 @@
 "	rgb = vec3(urgb) / 65535.0;\n"
 "#endif\n"
 "\n"
-"#if QUANT == V4L2_QUANTIZATION_LIM_RANGE\n"
-"	rgb -= 16.0 / 255.0;\n"
-"	rgb *= 255.0 / 219.0;\n"
-"#endif\n"
+"	rgb -= quant_offset;\n"
+"	rgb *= quant_scale;\n"
 "\n"
 "#else // IS_RGB\n"
 "\n"
@@ -289,97 +239,80 @@
 "	rgb = c.z * mix(K.xxx, clamp(p - K.xxx, 0.0, 1.0), c.y);\n"
 "#else // IS_HSV\n"
 "	yuv.gb -= 0.5;\n"
-"#endif\n"
 "\n"
-"#if QUANT != V4L2_QUANTIZATION_FULL_RANGE || YCBCRENC == V4L2_YCBCR_ENC_XV601 || YCBCRENC == V4L2_YCBCR_ENC_XV709\n"
 "	/*\n"
 "	 * xv709 and xv601 have full range quantization, but they still\n"
 "	 * need to be normalized as if they were limited range. But the\n"
 "	 * result are values outside the normal 0-1 range, which is the\n"
 "	 * point of these extended gamut encodings.\n"
 "	 */\n"
-"	const vec3 scale = vec3(255.0 / 219.0, 255.0 / 224.0, 255.0 / 224.0);\n"
-"	const vec3 offset = vec3(16.0 / 255.0, 0.0, 0.0);\n"
-"\n"
-"	yuv -= offset;\n"
-"	yuv *= scale;\n"
-"#endif\n"
-"\n"
-"#if YCBCRENC == V4L2_YCBCR_ENC_BT2020_CONST_LUM\n"
-"	// BT.2020_CONST_LUM luma coefficients\n"
-"	float y = yuv.r;\n"
-"	float u = yuv.g;\n"
-"	float v = yuv.b;\n"
-"	float b = u <= 0.0 ? y + 1.9404 * u : y + 1.5816 * u;\n"
-"	float r = v <= 0.0 ? y + 1.7184 * v : y + 0.9936 * v;\n"
-"	float lin_r = (r < 0.081) ? r / 4.5 : pow((r + 0.099) / 1.099, 1.0 / 0.45);\n"
-"	float lin_b = (b < 0.081) ? b / 4.5 : pow((b + 0.099) / 1.099, 1.0 / 0.45);\n"
-"	float lin_y = (y < 0.081) ? y / 4.5 : pow((y + 0.099) / 1.099, 1.0 / 0.45);\n"
-"	float lin_g = lin_y / 0.6780 - lin_r * 0.2627 / 0.6780 - lin_b * 0.0593 / 0.6780;\n"
-"	float g = (lin_g < 0.018) ? lin_g * 4.5 : 1.099 * pow(lin_g, 0.45) - 0.099;\n"
-"	rgb = vec3(r, g, b);\n"
-"#elif !IS_HSV\n"
-"	rgb = yuv2rgb * yuv;\n"
+"	yuv -= quant_offset;\n"
+"	yuv *= quant_scale;\n"
+"\n"
+"	if (const_lum) {\n"
+"		// BT.2020_CONST_LUM luma coefficients\n"
+"		float y = yuv.r;\n"
+"		float u = yuv.g;\n"
+"		float v = yuv.b;\n"
+"		float b = u <= 0.0 ? y + 1.9404 * u : y + 1.5816 * u;\n"
+"		float r = v <= 0.0 ? y + 1.7184 * v : y + 0.9936 * v;\n"
+"		float lin_r = (r < 0.081) ? r / 4.5 : pow((r + 0.099) / 1.099, 1.0 / 0.45);\n"
+"		float lin_b = (b < 0.081) ? b / 4.5 : pow((b + 0.099) / 1.099, 1.0 / 0.45);\n"
+"		float lin_y = (y < 0.081) ? y / 4.5 : pow((y + 0.099) / 1.099, 1.0 / 0.45);\n"
+"		float lin_g = lin_y / 0.6780 - lin_r * 0.2627 / 0.6780 - lin_b * 0.0593 / 0.6780;\n"
+"		float g = (lin_g < 0.018) ? lin_g * 4.5 : 1.099 * pow(lin_g, 0.45) - 0.099;\n"
+"		rgb = vec3(r, g, b);\n"
+"	} else {\n"
+"		rgb = yuv2rgb * yuv;\n"
+"	}\n"
 "#endif\n"
 "#endif // !IS_RGB\n"
 "\n"
 "// Convert non-linear R'G'B' to linear RGB, taking into account the\n"
 "// colorspace.\n"
-"#if XFERFUNC == V4L2_XFER_FUNC_SMPTE240M\n"
 "\n"
 "// Old obsolete HDTV standard. Replaced by REC 709.\n"
 "// This is the transfer function for SMPTE 240M\n"
-"#define XFER(c) (((c) < 0.0913) ? (c) / 4.0 : pow(((c) + 0.1115) / 1.1115, 1.0 / 0.45))\n"
-"\n"
-"	rgb = vec3(XFER(rgb.r), XFER(rgb.g), XFER(rgb.b));\n"
-"\n"
-"#elif XFERFUNC == V4L2_XFER_FUNC_SRGB\n"
+"#define XFER_SMPTE240M(c) (((c) < 0.0913) ? (c) / 4.0 : pow(((c) + 0.1115) / 1.1115, 1.0 / 0.45))\n"
 "\n"
 "// This is used for sRGB as specified by the IEC FDIS 61966-2-1 standard\n"
-"#define XFER(c) (((c) < -0.04045) ? -pow((-(c) + 0.055) / 1.055, 2.4) : 		(((c) <= 0.04045) ? (c) / 12.92 : pow(((c) + 0.055) / 1.055, 2.4)))\n"
-"\n"
-"	rgb = vec3(XFER(rgb.r), XFER(rgb.g), XFER(rgb.b));\n"
-"\n"
-"#elif XFERFUNC == V4L2_XFER_FUNC_OPRGB\n"
-"\n"
-"	// Avoid powers of negative numbers\n"
-"	rgb = max(rgb, vec3(0.0));\n"
-"	rgb = pow(rgb, vec3(2.19921875));\n"
-"\n"
-"#elif XFERFUNC == V4L2_XFER_FUNC_DCI_P3\n"
-"\n"
-"	// Avoid powers of negative numbers\n"
-"	rgb = max(rgb, vec3(0.0));\n"
-"	rgb = pow(rgb, vec3(2.6));\n"
-"\n"
-"#elif XFERFUNC == V4L2_XFER_FUNC_SMPTE2084\n"
-"	const vec3 m1 = vec3(1.0 / ((2610.0 / 4096.0) / 4.0));\n"
-"	const vec3 m2 = vec3(1.0 / (128.0 * 2523.0 / 4096.0));\n"
-"	const vec3 c1 = vec3(3424.0 / 4096.0);\n"
-"	const vec3 c2 = vec3(32.0 * 2413.0 / 4096.0);\n"
-"	const vec3 c3 = vec3(32.0 * 2392.0 / 4096.0);\n"
-"\n"
-"	// Avoid powers of negative numbers\n"
-"	rgb = max(rgb, vec3(0.0));\n"
-"	rgb = pow(rgb, m2);\n"
-"	// The factor 100 is because SMPTE-2084 maps to 0-10000 cd/m^2\n"
-"	// whereas other transfer functions map to 0-100 cd/m^2.\n"
-"	rgb = pow(max(rgb - c1, vec3(0.0)) / (c2 - rgb * c3), m1) * 100.0;\n"
-"\n"
-"#elif XFERFUNC != V4L2_XFER_FUNC_NONE\n"
+"#define XFER_SRGB_INV(c) (((c) < -0.04045) ? -pow((-(c) + 0.055) / 1.055, 2.4) : 		(((c) <= 0.04045) ? (c) / 12.92 : pow(((c) + 0.055) / 1.055, 2.4)))\n"
 "\n"
 "// All others use the transfer function specified by REC 709\n"
-"#define XFER(c) (((c) <= -0.081) ? -pow(((c) - 0.099) / -1.099, 1.0 / 0.45) : 		 (((c) < 0.081) ? (c) / 4.5 : pow(((c) + 0.099) / 1.099, 1.0 / 0.45)))\n"
-"\n"
-"	rgb = vec3(XFER(rgb.r), XFER(rgb.g), XFER(rgb.b));\n"
-"\n"
-"#endif\n"
+"#define XFER_709(c) (((c) <= -0.081) ? -pow(((c) - 0.099) / -1.099, 1.0 / 0.45) : 		 (((c) < 0.081) ? (c) / 4.5 : pow(((c) + 0.099) / 1.099, 1.0 / 0.45)))\n"
+"\n"
+"	if (xfer_func == V4L2_XFER_FUNC_SMPTE240M) {\n"
+"		rgb = vec3(XFER_SMPTE240M(rgb.r), XFER_SMPTE240M(rgb.g), XFER_SMPTE240M(rgb.b));\n"
+"	} else if (xfer_func == V4L2_XFER_FUNC_SRGB) {\n"
+"		rgb = vec3(XFER_SRGB_INV(rgb.r), XFER_SRGB_INV(rgb.g), XFER_SRGB_INV(rgb.b));\n"
+"	} else if (xfer_func == V4L2_XFER_FUNC_OPRGB) {\n"
+"		// Avoid powers of negative numbers\n"
+"		rgb = max(rgb, vec3(0.0));\n"
+"		rgb = pow(rgb, vec3(2.19921875));\n"
+"	} else if (xfer_func == V4L2_XFER_FUNC_DCI_P3) {\n"
+"		// Avoid powers of negative numbers\n"
+"		rgb = max(rgb, vec3(0.0));\n"
+"		rgb = pow(rgb, vec3(2.6));\n"
+"	} else if (xfer_func == V4L2_XFER_FUNC_SMPTE2084) {\n"
+"		const vec3 m1 = vec3(1.0 / ((2610.0 / 4096.0) / 4.0));\n"
+"		const vec3 m2 = vec3(1.0 / (128.0 * 2523.0 / 4096.0));\n"
+"		const vec3 c1 = vec3(3424.0 / 4096.0);\n"
+"		const vec3 c2 = vec3(32.0 * 2413.0 / 4096.0);\n"
+"		const vec3 c3 = vec3(32.0 * 2392.0 / 4096.0);\n"
+"\n"
+"		// Avoid powers of negative numbers\n"
+"		rgb = max(rgb, vec3(0.0));\n"
+"		rgb = pow(rgb, m2);\n"
+"		// The factor 100 is because SMPTE-2084 maps to 0-10000 cd/m^2\n"
+"		// whereas other transfer functions map to 0-100 cd/m^2.\n"
+"		rgb = pow(max(rgb - c1, vec3(0.0)) / (c2 - rgb * c3), m1) * 100.0;\n"
+"	} else if (xfer_func != V4L2_XFER_FUNC_NONE) {\n"
+"		rgb = vec3(XFER_709(rgb.r), XFER_709(rgb.g), XFER_709(rgb.b));\n"
+"	}\n"
 "\n"
 "// Convert the given colorspace to the REC 709/sRGB colorspace. All colors are\n"
 "// specified as linear RGB.\n"
-"#if COLSP == V4L2_COLORSPACE_SMPTE170M || COLSP == V4L2_COLORSPACE_SMPTE240M ||     COLSP == V4L2_COLORSPACE_470_SYSTEM_M || COLSP == V4L2_COLORSPACE_470_SYSTEM_BG ||     COLSP == V4L2_COLORSPACE_OPRGB || COLSP == V4L2_COLORSPACE_DCI_P3 ||     COLSP == V4L2_COLORSPACE_BT2020\n"
 "	rgb = colconv * rgb;\n"
-"#endif\n"
 "\n"
 "// Convert linear RGB to non-linear R'G'B', assuming an sRGB display colorspace.\n"
 "\n"